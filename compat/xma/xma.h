@@ -0,0 +1,239 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Software stand-in for the Xilinx Media Accelerator (XMA) application API.
+ *
+ * Only the subset of the API used by FFmpeg is declared here. It is used
+ * when configuring with --enable-xma-sw and is implemented by
+ * compat/xma/xma_sw*.c, which emulate the encoder, decoder and scaler
+ * kernels on the CPU.
+ */
+
+#ifndef COMPAT_XMA_XMA_H
+#define COMPAT_XMA_XMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XMA_SUCCESS              0
+#define XMA_ERROR               -1
+#define XMA_ERROR_INVALID       -2
+#define XMA_ERROR_NO_KERNEL     -3
+#define XMA_ERROR_TIMEOUT       -4
+#define XMA_TRY_AGAIN           -5
+#define XMA_SEND_MORE_DATA      -6
+#define XMA_FLUSH_AGAIN         -7
+#define XMA_EOS                 -8
+
+#define MAX_VENDOR_NAME         64
+#define MAX_INPUT_FILENAME     256
+#define XMA_MAX_PLANES           3
+#define MAX_SCALER_OUTPUTS       8
+
+typedef enum XmaFormatType {
+    XMA_NONE_FMT_TYPE = 0,
+    XMA_YUV420_FMT_TYPE,
+    XMA_YUV422_FMT_TYPE,
+    XMA_YUV444_FMT_TYPE,
+    XMA_RGBP_FMT_TYPE,
+} XmaFormatType;
+
+typedef enum XmaBufferType {
+    XMA_HOST_BUFFER_TYPE = 1,
+    XMA_DEVICE_BUFFER_TYPE,
+    XMA_NO_BUFFER_TYPE,
+} XmaBufferType;
+
+typedef enum XmaDataType {
+    XMA_STRING,
+    XMA_INT32,
+    XMA_UINT32,
+    XMA_INT64,
+    XMA_UINT64,
+} XmaDataType;
+
+typedef struct XmaFraction {
+    int32_t numerator;
+    int32_t denominator;
+} XmaFraction;
+
+typedef struct XmaParameter {
+    char        *name;
+    XmaDataType  type;
+    size_t       length;
+    void        *value;
+} XmaParameter;
+
+typedef struct XmaBufferRef {
+    int32_t        refcount;
+    XmaBufferType  buffer_type;
+    void          *buffer;
+    size_t         alloc_size;
+    int32_t        is_clone;
+} XmaBufferRef;
+
+typedef struct XmaFrameProperties {
+    XmaFormatType format;
+    int32_t       width;
+    int32_t       height;
+    int32_t       bits_per_pixel;
+} XmaFrameProperties;
+
+typedef struct XmaFrameData {
+    uint8_t *data[XMA_MAX_PLANES];
+} XmaFrameData;
+
+typedef struct XmaFrame {
+    XmaBufferRef        data[XMA_MAX_PLANES];
+    XmaFrameProperties  frame_props;
+    XmaFraction         time_base;
+    XmaFraction         frame_rate;
+    int32_t             do_not_encode;
+    int32_t             is_idr;
+    int32_t             is_last_frame;
+    int64_t             pts;
+} XmaFrame;
+
+typedef struct XmaDataBuffer {
+    XmaBufferRef data;
+    int32_t      alloc_size;
+    int32_t      is_eof;
+    int64_t      pts;
+} XmaDataBuffer;
+
+int32_t xma_initialize(const char *cfgfile);
+
+XmaFrame *xma_frame_alloc(XmaFrameProperties *frame_props);
+XmaFrame *xma_frame_from_buffers_clone(XmaFrameProperties *frame_props,
+                                       XmaFrameData *frame_data);
+void xma_frame_free(XmaFrame *frame);
+
+XmaDataBuffer *xma_data_buffer_alloc(size_t size);
+XmaDataBuffer *xma_data_from_buffer_clone(uint8_t *data, size_t size);
+void xma_data_buffer_free(XmaDataBuffer *data);
+
+/* Encoder */
+
+typedef enum XmaEncoderType {
+    XMA_H264_ENCODER_TYPE = 1,
+    XMA_HEVC_ENCODER_TYPE,
+    XMA_VP9_ENCODER_TYPE,
+    XMA_COPY_ENCODER_TYPE,
+} XmaEncoderType;
+
+typedef struct XmaEncoderProperties {
+    XmaEncoderType hwencoder_type;
+    char           hwvendor_string[MAX_VENDOR_NAME];
+    XmaFormatType  format;
+    int32_t        bits_per_pixel;
+    int32_t        width;
+    int32_t        height;
+    XmaFraction    framerate;
+    int32_t        bitrate;
+    int32_t        qp;
+    int32_t        gop_size;
+    int32_t        idr_interval;
+    int32_t        lookahead_depth;
+    int32_t        aq_mode;
+    int32_t        temp_aq_gain;
+    int32_t        spat_aq_gain;
+    int32_t        minQP;
+    int32_t        dev_index;   /* card to run on, -1 for any */
+    int32_t        num_b_frames; /* B-frames between anchors, output in coding order */
+} XmaEncoderProperties;
+
+typedef struct XmaEncoderSession XmaEncoderSession;
+
+XmaEncoderSession *xma_enc_session_create(XmaEncoderProperties *enc_props);
+int32_t xma_enc_session_destroy(XmaEncoderSession *session);
+int32_t xma_enc_session_send_frame(XmaEncoderSession *session, XmaFrame *frame);
+int32_t xma_enc_session_recv_data(XmaEncoderSession *session,
+                                  XmaDataBuffer *data, int32_t *data_size);
+/* Apply new bitrate, qp, gop_size and picture size to a running session.
+ * Frames sent before keep the settings they were sent with; a new picture
+ * size starts with an IDR frame. */
+int32_t xma_enc_session_reconfigure(XmaEncoderSession *session,
+                                    XmaEncoderProperties *enc_props);
+
+/* Decoder */
+
+typedef enum XmaDecoderType {
+    XMA_H264_DECODER_TYPE = 1,
+    XMA_HEVC_DECODER_TYPE,
+} XmaDecoderType;
+
+typedef struct XmaDecoderProperties {
+    XmaDecoderType  hwdecoder_type;
+    char            hwvendor_string[MAX_VENDOR_NAME];
+    int32_t         intraOnly;
+    XmaParameter   *params;
+    uint32_t        param_cnt;
+    int32_t         dev_index;  /* card to run on, -1 for any */
+} XmaDecoderProperties;
+
+typedef struct XmaDecoderSession XmaDecoderSession;
+
+XmaDecoderSession *xma_dec_session_create(XmaDecoderProperties *dec_props);
+int32_t xma_dec_session_destroy(XmaDecoderSession *session);
+int32_t xma_dec_session_send_data(XmaDecoderSession *session,
+                                  XmaDataBuffer *data, int32_t *data_used);
+int32_t xma_dec_session_get_properties(XmaDecoderSession *session,
+                                       XmaFrameProperties *fprops);
+int32_t xma_dec_session_recv_frame(XmaDecoderSession *session, XmaFrame *frame);
+
+/* Scaler */
+
+typedef enum XmaScalerType {
+    XMA_BICUBIC_SCALER_TYPE = 1,
+    XMA_BILINEAR_SCALER_TYPE,
+    XMA_POLYPHASE_SCALER_TYPE,
+} XmaScalerType;
+
+typedef struct XmaScalerInOutProperties {
+    XmaFormatType format;
+    int32_t       bits_per_pixel;
+    int32_t       width;
+    int32_t       height;
+    int32_t       stride;
+    XmaFraction   framerate;
+    int32_t       coeffLoad;
+    char          coeffFile[MAX_INPUT_FILENAME];
+} XmaScalerInOutProperties;
+
+typedef struct XmaScalerProperties {
+    XmaScalerType            hwscaler_type;
+    char                     hwvendor_string[MAX_VENDOR_NAME];
+    int32_t                  num_outputs;
+    XmaScalerInOutProperties input;
+    XmaScalerInOutProperties output[MAX_SCALER_OUTPUTS];
+    int32_t                  dev_index; /* card to run on, -1 for any */
+} XmaScalerProperties;
+
+typedef struct XmaScalerSession XmaScalerSession;
+
+XmaScalerSession *xma_scaler_session_create(XmaScalerProperties *props);
+int32_t xma_scaler_session_destroy(XmaScalerSession *session);
+int32_t xma_scaler_session_send_frame(XmaScalerSession *session, XmaFrame *frame);
+/* frame_list has one entry per output, NULL for an output that drops the
+ * frame: it is then not scaled at all */
+int32_t xma_scaler_session_recv_frame_list(XmaScalerSession *session,
+                                           XmaFrame **frame_list);
+
+#endif /* COMPAT_XMA_XMA_H */
@@ -0,0 +1,265 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Software stand-in for the XMA runtime: initialization, timing model and
+ * buffer management. The kernels themselves are emulated in
+ * xma_sw_codec.c (libavcodec) and xma_sw_scaler.c (libavfilter).
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/common.h"
+#include "libavutil/mem.h"
+#include "libavutil/time.h"
+
+#include "xma_sw.h"
+
+const AVClass xma_sw_class = {
+    .class_name = "xma_sw",
+    .item_name  = av_default_item_name,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const AVClass *xma_sw_log = &xma_sw_class;
+
+static XmaSwConfig xma_sw_cfg = {
+    .latency_us  = 0,
+    .queue_depth = 2,
+    .devices     = 1,
+};
+
+static int xma_sw_initialized;
+
+int32_t xma_initialize(const char *cfgfile)
+{
+    char line[256];
+    FILE *f;
+
+    if (xma_sw_initialized)
+        return XMA_SUCCESS;
+
+    /* Only the SwEmulation keys are interpreted, everything else in the
+     * file is accepted and ignored so a real xmacfg.yaml can be used too. */
+    f = cfgfile ? fopen(cfgfile, "r") : NULL;
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            const char *p = line + strspn(line, " \t-");
+
+            if (av_strstart(p, "latency_us:", &p))
+                xma_sw_cfg.latency_us  = FFMAX(0, strtoll(p, NULL, 10));
+            else if (av_strstart(p, "queue_depth:", &p))
+                xma_sw_cfg.queue_depth = FFMAX(1, strtol(p, NULL, 10));
+            else if (av_strstart(p, "devices:", &p))
+                xma_sw_cfg.devices     = av_clip(strtol(p, NULL, 10), 1, 64);
+        }
+        fclose(f);
+    }
+
+    av_log(&xma_sw_log, AV_LOG_VERBOSE,
+           "Using software stand-in, latency %"PRId64" us, queue depth %d, "
+           "%d card(s)\n", xma_sw_cfg.latency_us, xma_sw_cfg.queue_depth,
+           xma_sw_cfg.devices);
+
+    xma_sw_initialized = 1;
+    return XMA_SUCCESS;
+}
+
+const XmaSwConfig *xma_sw_config(void)
+{
+    return &xma_sw_cfg;
+}
+
+int xma_sw_open_device(int dev_index)
+{
+    if (dev_index >= xma_sw_cfg.devices) {
+        av_log(&xma_sw_log, AV_LOG_ERROR, "No card %d, %d card(s) configured\n",
+               dev_index, xma_sw_cfg.devices);
+        return -1;
+    }
+    return FFMAX(dev_index, 0);
+}
+
+int64_t xma_sw_ready_time(void)
+{
+    return av_gettime_relative() + xma_sw_cfg.latency_us;
+}
+
+void xma_sw_wait(int64_t ready)
+{
+    int64_t delay = ready - av_gettime_relative();
+
+    if (delay > 0)
+        av_usleep(delay);
+}
+
+int xma_sw_plane_geometry(const XmaFrameProperties *props, int plane,
+                          int *linesize, int *height)
+{
+    int bytes = (props->bits_per_pixel + 7) >> 3;
+    int w     = props->width;
+    int h     = props->height;
+
+    if (plane < 0 || plane >= XMA_MAX_PLANES || w <= 0 || h <= 0)
+        return -1;
+
+    if (plane > 0) {
+        switch (props->format) {
+        case XMA_YUV420_FMT_TYPE:
+            w = AV_CEIL_RSHIFT(w, 1);
+            h = AV_CEIL_RSHIFT(h, 1);
+            break;
+        case XMA_YUV422_FMT_TYPE:
+            w = AV_CEIL_RSHIFT(w, 1);
+            break;
+        case XMA_YUV444_FMT_TYPE:
+        case XMA_RGBP_FMT_TYPE:
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    *linesize = w * FFMAX(bytes, 1);
+    *height   = h;
+    return 0;
+}
+
+enum AVPixelFormat xma_sw_pix_fmt(const XmaFrameProperties *props)
+{
+    int hbd = props->bits_per_pixel > 8;
+
+    switch (props->format) {
+    case XMA_YUV420_FMT_TYPE: return hbd ? AV_PIX_FMT_YUV420P16LE : AV_PIX_FMT_YUV420P;
+    case XMA_YUV422_FMT_TYPE: return hbd ? AV_PIX_FMT_YUV422P16LE : AV_PIX_FMT_YUV422P;
+    case XMA_YUV444_FMT_TYPE: return hbd ? AV_PIX_FMT_YUV444P16LE : AV_PIX_FMT_YUV444P;
+    case XMA_RGBP_FMT_TYPE:   return hbd ? AV_PIX_FMT_GBRP16LE    : AV_PIX_FMT_GBRP;
+    default:                  return AV_PIX_FMT_NONE;
+    }
+}
+
+static XmaFrame *frame_new(XmaFrameProperties *frame_props, XmaFrameData *frame_data)
+{
+    XmaFrame *frame = av_mallocz(sizeof(*frame));
+    int i, linesize, height;
+
+    if (!frame)
+        return NULL;
+
+    frame->frame_props = *frame_props;
+    frame->pts         = AV_NOPTS_VALUE;
+
+    for (i = 0; i < XMA_MAX_PLANES; i++) {
+        XmaBufferRef *ref = &frame->data[i];
+
+        ref->refcount    = 1;
+        ref->buffer_type = XMA_HOST_BUFFER_TYPE;
+        ref->is_clone    = !!frame_data;
+
+        if (xma_sw_plane_geometry(frame_props, i, &linesize, &height) < 0)
+            continue;
+        ref->alloc_size = (size_t)linesize * height;
+
+        if (frame_data) {
+            ref->buffer = frame_data->data[i];
+        } else {
+            ref->buffer = av_malloc(ref->alloc_size);
+            if (!ref->buffer) {
+                xma_frame_free(frame);
+                return NULL;
+            }
+        }
+    }
+
+    return frame;
+}
+
+XmaFrame *xma_frame_alloc(XmaFrameProperties *frame_props)
+{
+    return frame_new(frame_props, NULL);
+}
+
+XmaFrame *xma_frame_from_buffers_clone(XmaFrameProperties *frame_props,
+                                       XmaFrameData *frame_data)
+{
+    return frame_new(frame_props, frame_data);
+}
+
+void xma_frame_free(XmaFrame *frame)
+{
+    int i;
+
+    if (!frame)
+        return;
+
+    for (i = 0; i < XMA_MAX_PLANES; i++)
+        if (!frame->data[i].is_clone)
+            av_freep(&frame->data[i].buffer);
+    av_free(frame);
+}
+
+static XmaDataBuffer *data_buffer_new(uint8_t *data, size_t size)
+{
+    XmaDataBuffer *buf;
+
+    if (size > INT32_MAX)
+        return NULL;
+
+    buf = av_mallocz(sizeof(*buf));
+    if (!buf)
+        return NULL;
+
+    buf->data.refcount    = 1;
+    buf->data.buffer_type = XMA_HOST_BUFFER_TYPE;
+    buf->data.alloc_size  = size;
+    buf->data.is_clone    = !!data;
+    buf->data.buffer      = data ? data : av_malloc(size);
+    buf->alloc_size       = size;
+    buf->pts              = AV_NOPTS_VALUE;
+
+    if (!buf->data.buffer && size) {
+        av_free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+XmaDataBuffer *xma_data_buffer_alloc(size_t size)
+{
+    return data_buffer_new(NULL, size);
+}
+
+XmaDataBuffer *xma_data_from_buffer_clone(uint8_t *data, size_t size)
+{
+    return data_buffer_new(data, size);
+}
+
+void xma_data_buffer_free(XmaDataBuffer *data)
+{
+    if (!data)
+        return;
+
+    if (!data->data.is_clone)
+        av_freep(&data->data.buffer);
+    av_free(data);
+}
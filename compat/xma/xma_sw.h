@@ -0,0 +1,76 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef COMPAT_XMA_XMA_SW_H
+#define COMPAT_XMA_XMA_SW_H
+
+#include <stdint.h>
+
+#include "libavutil/log.h"
+#include "libavutil/pixfmt.h"
+
+#include "xma.h"
+
+/**
+ * Timing model shared by all emulated kernels, read from the
+ * configuration file passed to xma_initialize().
+ */
+typedef struct XmaSwConfig {
+    /** time between a job entering a kernel and its result becoming
+     *  available, in microseconds */
+    int64_t latency_us;
+    /** number of jobs a kernel holds before it starts returning results */
+    int     queue_depth;
+    /** number of emulated cards */
+    int     devices;
+} XmaSwConfig;
+
+extern const AVClass xma_sw_class;
+
+const XmaSwConfig *xma_sw_config(void);
+
+/**
+ * Check that a session can be created on the given card.
+ *
+ * @return the card index the session runs on, or a negative value if
+ *         dev_index does not name an emulated card
+ */
+int xma_sw_open_device(int dev_index);
+
+/**
+ * @return the time at which a job submitted now completes
+ */
+int64_t xma_sw_ready_time(void);
+
+/**
+ * Sleep until the given completion time has passed.
+ */
+void xma_sw_wait(int64_t ready);
+
+/**
+ * Get the line size in bytes and the number of lines of one plane of a
+ * frame with the given properties. Planes are packed without padding.
+ *
+ * @return 0 on success, a negative value if the plane does not exist
+ */
+int xma_sw_plane_geometry(const XmaFrameProperties *props, int plane,
+                          int *linesize, int *height);
+
+enum AVPixelFormat xma_sw_pix_fmt(const XmaFrameProperties *props);
+
+#endif /* COMPAT_XMA_XMA_SW_H */
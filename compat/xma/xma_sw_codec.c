@@ -0,0 +1,647 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Software stand-in for the XMA encoder and decoder kernels.
+ *
+ * The encoder does not compress; it emits a syntactically plausible
+ * HEVC or VP9 frame per input, sized after the rate control settings and
+ * filled from the picture, so that the host side of a pipeline (copies,
+ * polling, packet handling) can be exercised and timed. The decoder
+ * wraps the native H.264 decoder.
+ */
+
+#include <string.h>
+
+#include "libavutil/common.h"
+#include "libavutil/fifo.h"
+#include "libavutil/frame.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
+#include "libavcodec/avcodec.h"
+
+#include "xma_sw.h"
+
+#define XMA_SW_INPUT_BUF_SIZE (8 << 20)
+
+typedef struct XmaSwPacket {
+    uint8_t *data;
+    int      size;
+    int      key;
+    int64_t  pts;
+    int64_t  ready;
+} XmaSwPacket;
+
+typedef struct XmaSwFrame {
+    AVFrame *frame;
+    int64_t  ready;
+} XmaSwFrame;
+
+struct XmaEncoderSession {
+    const AVClass        *class;
+    XmaEncoderProperties  props;
+    AVFifoBuffer         *fifo;
+    int                   device;
+    int                   depth;
+    int                   flushing;
+    int                   force_key;
+    int64_t               frame_num;
+    XmaSwPacket          *pending;      ///< B-frames waiting for their next anchor
+    int                   nb_pending;
+};
+
+struct XmaDecoderSession {
+    const AVClass        *class;
+    XmaDecoderProperties  props;
+    AVCodecContext       *avctx;
+    AVCodecParserContext *parser;
+    AVFifoBuffer         *fifo;
+    int                   device;
+    int                   depth;
+    int                   flushing;
+    int                   packed;
+    uint64_t              bytes_pending;
+};
+
+static int fifo_push(AVFifoBuffer *fifo, void *elem, int size)
+{
+    if (av_fifo_space(fifo) < size) {
+        int ret = av_fifo_grow(fifo, size);
+        if (ret < 0)
+            return ret;
+    }
+    av_fifo_generic_write(fifo, elem, size, NULL);
+    return 0;
+}
+
+static int enc_payload_size(const XmaEncoderProperties *p, int key)
+{
+    int64_t luma = (int64_t)p->width * p->height;
+    int64_t size;
+
+    if (p->bitrate > 0 && p->framerate.numerator > 0 && p->framerate.denominator > 0)
+        size = (int64_t)p->bitrate / 8 * p->framerate.denominator / p->framerate.numerator;
+    else
+        size = luma >> av_clip(p->qp / 6 + 2, 2, 12);
+
+    if (key)
+        size *= 4;
+    return av_clip64(size, 16, luma);
+}
+
+static int enc_frame(XmaEncoderSession *s, const XmaFrame *frame, XmaSwPacket *pkt)
+{
+    const XmaEncoderProperties *p = &s->props;
+    const uint8_t *luma = frame->data[0].buffer;
+    int64_t luma_size   = (int64_t)p->width * p->height;
+    int key = frame->is_idr || !s->frame_num || s->force_key ||
+              (p->gop_size > 0 && !(s->frame_num % p->gop_size));
+    int size = enc_payload_size(p, key);
+    uint8_t *d;
+    int i;
+
+    pkt->data = av_malloc(size + 64);
+    if (!pkt->data)
+        return AVERROR(ENOMEM);
+    d = pkt->data;
+
+    if (p->hwencoder_type == XMA_HEVC_ENCODER_TYPE) {
+        static const uint8_t ps_types[] = { 32, 33, 34 };
+
+        if (key) {
+            for (i = 0; i < FF_ARRAY_ELEMS(ps_types); i++) {
+                AV_WB32(d, 1);
+                d[4] = ps_types[i] << 1;
+                d[5] = 0x01;
+                d[6] = 0x80;
+                d += 7;
+            }
+        }
+        AV_WB32(d, 1);
+        d[4] = (key ? 19 : 1) << 1;
+        d[5] = 0x01;
+        d += 6;
+    } else {
+        /* frame marker, profile 0, show_frame */
+        *d++ = key ? 0x82 : 0x86;
+        if (key) {
+            *d++ = 0x49;
+            *d++ = 0x83;
+            *d++ = 0x42;
+        }
+    }
+
+    /* never produces a start code emulation */
+    for (i = 0; i < size; i++)
+        *d++ = luma[(i * 7919LL) % luma_size] | 0x80;
+
+    s->force_key = 0;
+    pkt->key   = key;
+    pkt->size  = d - pkt->data;
+    pkt->pts   = frame->pts;
+    pkt->ready = xma_sw_ready_time();
+    return 0;
+}
+
+XmaEncoderSession *xma_enc_session_create(XmaEncoderProperties *enc_props)
+{
+    XmaEncoderSession *s;
+    int device;
+
+    if (enc_props->hwencoder_type != XMA_HEVC_ENCODER_TYPE &&
+        enc_props->hwencoder_type != XMA_VP9_ENCODER_TYPE)
+        return NULL;
+    if (enc_props->width <= 0 || enc_props->height <= 0 ||
+        enc_props->format != XMA_YUV420_FMT_TYPE)
+        return NULL;
+    if ((device = xma_sw_open_device(enc_props->dev_index)) < 0)
+        return NULL;
+
+    s = av_mallocz(sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->class = &xma_sw_class;
+    s->props  = *enc_props;
+    s->device = device;
+    s->depth = enc_props->lookahead_depth > 0 ? enc_props->lookahead_depth
+                                              : xma_sw_config()->queue_depth;
+    s->fifo  = av_fifo_alloc((s->depth + 1) * sizeof(XmaSwPacket));
+    s->props.num_b_frames = av_clip(enc_props->num_b_frames, 0, s->depth - 1);
+    if (s->props.num_b_frames)
+        s->pending = av_malloc_array(s->props.num_b_frames, sizeof(*s->pending));
+    if (!s->fifo || (s->props.num_b_frames && !s->pending)) {
+        av_fifo_freep(&s->fifo);
+        av_free(s);
+        return NULL;
+    }
+
+    av_log(s, AV_LOG_VERBOSE, "%s encoder session %dx%d on card %d, depth %d, %d B-frames\n",
+           enc_props->hwencoder_type == XMA_HEVC_ENCODER_TYPE ? "HEVC" : "VP9",
+           enc_props->width, enc_props->height, s->device, s->depth,
+           s->props.num_b_frames);
+    return s;
+}
+
+int32_t xma_enc_session_destroy(XmaEncoderSession *s)
+{
+    XmaSwPacket pkt;
+
+    if (!s)
+        return XMA_ERROR_INVALID;
+
+    while (av_fifo_size(s->fifo) >= sizeof(pkt)) {
+        av_fifo_generic_read(s->fifo, &pkt, sizeof(pkt), NULL);
+        av_free(pkt.data);
+    }
+    while (s->nb_pending)
+        av_free(s->pending[--s->nb_pending].data);
+    av_fifo_freep(&s->fifo);
+    av_free(s->pending);
+    av_free(s);
+    return XMA_SUCCESS;
+}
+
+/* queue the B-frames held back, in display order */
+static int enc_push_pending(XmaEncoderSession *s)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < s->nb_pending; i++) {
+        if (ret >= 0)
+            ret = fifo_push(s->fifo, &s->pending[i], sizeof(s->pending[i]));
+        if (ret < 0)
+            av_free(s->pending[i].data);
+    }
+    s->nb_pending = 0;
+    return ret;
+}
+
+int32_t xma_enc_session_send_frame(XmaEncoderSession *s, XmaFrame *frame)
+{
+    XmaSwPacket pkt;
+    int queued;
+
+    if (frame->do_not_encode || !frame->data[0].buffer) {
+        if (!s->flushing && enc_push_pending(s) < 0)
+            return XMA_ERROR;
+        s->flushing = 1;
+        return XMA_SUCCESS;
+    }
+    if (s->flushing)
+        return XMA_ERROR;
+
+    if (enc_frame(s, frame, &pkt) < 0)
+        return XMA_ERROR;
+    s->frame_num++;
+
+    /* the pictures between two anchors are coded after the second one;
+     * a keyframe starts a new group, so those before it become anchors */
+    if (!pkt.key && s->nb_pending < s->props.num_b_frames) {
+        s->pending[s->nb_pending++] = pkt;
+    } else {
+        if (pkt.key && enc_push_pending(s) < 0) {
+            av_free(pkt.data);
+            return XMA_ERROR;
+        }
+        if (fifo_push(s->fifo, &pkt, sizeof(pkt)) < 0) {
+            av_free(pkt.data);
+            return XMA_ERROR;
+        }
+        if (enc_push_pending(s) < 0)
+            return XMA_ERROR;
+    }
+
+    queued = av_fifo_size(s->fifo) / sizeof(pkt) + s->nb_pending;
+    return queued < s->depth ? XMA_SEND_MORE_DATA : XMA_SUCCESS;
+}
+
+int32_t xma_enc_session_reconfigure(XmaEncoderSession *s,
+                                    XmaEncoderProperties *enc_props)
+{
+    XmaEncoderProperties *p = &s->props;
+
+    if (enc_props->width <= 0 || enc_props->height <= 0 || s->flushing)
+        return XMA_ERROR;
+
+    /* packets already queued were encoded at send time, with the old settings */
+    if (enc_props->width != p->width || enc_props->height != p->height)
+        s->force_key = 1;
+    p->bitrate  = enc_props->bitrate;
+    p->qp       = enc_props->qp;
+    p->gop_size = enc_props->gop_size;
+    p->width    = enc_props->width;
+    p->height   = enc_props->height;
+
+    av_log(s, AV_LOG_DEBUG, "encoder session reconfigured: %dx%d, %d bps, qp %d, gop %d\n",
+           p->width, p->height, p->bitrate, p->qp, p->gop_size);
+    return XMA_SUCCESS;
+}
+
+int32_t xma_enc_session_recv_data(XmaEncoderSession *s,
+                                  XmaDataBuffer *data, int32_t *data_size)
+{
+    XmaSwPacket pkt;
+    int queued = av_fifo_size(s->fifo) / sizeof(pkt);
+
+    *data_size   = 0;
+    data->is_eof = 0;
+
+    if (!queued) {
+        data->is_eof = s->flushing;
+        return s->flushing ? XMA_EOS : XMA_TRY_AGAIN;
+    }
+    if (!s->flushing && queued + s->nb_pending < s->depth)
+        return XMA_TRY_AGAIN;
+
+    av_fifo_generic_peek(s->fifo, &pkt, sizeof(pkt), NULL);
+    if (av_gettime_relative() < pkt.ready)
+        return XMA_TRY_AGAIN;
+    av_fifo_generic_read(s->fifo, &pkt, sizeof(pkt), NULL);
+
+    if (pkt.size > data->alloc_size) {
+        av_log(s, AV_LOG_ERROR, "Output buffer too small: %d < %d\n",
+               data->alloc_size, pkt.size);
+        av_free(pkt.data);
+        return XMA_ERROR;
+    }
+
+    memcpy(data->data.buffer, pkt.data, pkt.size);
+    av_free(pkt.data);
+
+    *data_size   = pkt.size;
+    data->pts    = pkt.pts;
+    data->is_eof = s->flushing && av_fifo_size(s->fifo) < sizeof(pkt);
+    return XMA_SUCCESS;
+}
+
+static XmaParameter *dec_param(XmaDecoderSession *s, const char *name)
+{
+    int i;
+
+    for (i = 0; i < s->props.param_cnt; i++)
+        if (s->props.params[i].name && !strcmp(s->props.params[i].name, name))
+            return &s->props.params[i];
+    return NULL;
+}
+
+static void dec_param_set(XmaDecoderSession *s, const char *name, uint64_t val)
+{
+    XmaParameter *p = dec_param(s, name);
+
+    if (!p || !p->value)
+        return;
+    if (p->type == XMA_UINT64 || p->type == XMA_INT64)
+        *(uint64_t *)p->value = val;
+    else if (p->type == XMA_UINT32 || p->type == XMA_INT32)
+        *(uint32_t *)p->value = val;
+}
+
+static void dec_update_params(XmaDecoderSession *s)
+{
+    int queued = av_fifo_size(s->fifo) / sizeof(XmaSwFrame);
+    uint64_t full = queued >= s->depth || s->flushing ? s->bytes_pending : 0;
+
+    dec_param_set(s, "inp_buf_bytes_full", full);
+    dec_param_set(s, "inp_buf_bytes_free",
+                  XMA_SW_INPUT_BUF_SIZE - FFMIN(s->bytes_pending, XMA_SW_INPUT_BUF_SIZE));
+}
+
+static int dec_decode(XmaDecoderSession *s, AVPacket *pkt)
+{
+    XmaSwFrame f;
+    int ret;
+
+    ret = avcodec_send_packet(s->avctx, pkt);
+    if (ret < 0 && ret != AVERROR_EOF)
+        return ret;
+
+    while (1) {
+        f.frame = av_frame_alloc();
+        if (!f.frame)
+            return AVERROR(ENOMEM);
+
+        ret = avcodec_receive_frame(s->avctx, f.frame);
+        if (ret < 0) {
+            av_frame_free(&f.frame);
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+        }
+
+        f.ready = xma_sw_ready_time();
+        ret = fifo_push(s->fifo, &f, sizeof(f));
+        if (ret < 0) {
+            av_frame_free(&f.frame);
+            return ret;
+        }
+    }
+}
+
+XmaDecoderSession *xma_dec_session_create(XmaDecoderProperties *dec_props)
+{
+    XmaDecoderSession *s;
+    XmaParameter *pix_fmt;
+    AVCodec *codec;
+    int device;
+
+    if (dec_props->hwdecoder_type != XMA_H264_DECODER_TYPE)
+        return NULL;
+    if ((device = xma_sw_open_device(dec_props->dev_index)) < 0)
+        return NULL;
+
+    codec = avcodec_find_decoder_by_name("h264");
+    if (!codec)
+        return NULL;
+
+    s = av_mallocz(sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->class  = &xma_sw_class;
+    s->props  = *dec_props;
+    s->device = device;
+    s->depth  = xma_sw_config()->queue_depth;
+    s->fifo   = av_fifo_alloc((s->depth + 1) * sizeof(XmaSwFrame));
+    s->avctx  = avcodec_alloc_context3(codec);
+    s->parser = av_parser_init(AV_CODEC_ID_H264);
+    if (!s->fifo || !s->avctx || !s->parser)
+        goto fail;
+
+    s->avctx->thread_count = 1;
+    if (dec_props->intraOnly)
+        s->avctx->skip_frame = AVDISCARD_NONINTRA;
+
+    pix_fmt = dec_param(s, "pixel_format");
+    if (pix_fmt && pix_fmt->type == XMA_STRING && pix_fmt->value)
+        s->packed = !strcmp(pix_fmt->value, "yuyv422");
+
+    if (avcodec_open2(s->avctx, codec, NULL) < 0)
+        goto fail;
+
+    dec_update_params(s);
+    av_log(s, AV_LOG_VERBOSE, "H.264 decoder session on card %d, depth %d\n",
+           s->device, s->depth);
+    return s;
+
+fail:
+    xma_dec_session_destroy(s);
+    return NULL;
+}
+
+int32_t xma_dec_session_destroy(XmaDecoderSession *s)
+{
+    XmaSwFrame f;
+
+    if (!s)
+        return XMA_ERROR_INVALID;
+
+    while (s->fifo && av_fifo_size(s->fifo) >= sizeof(f)) {
+        av_fifo_generic_read(s->fifo, &f, sizeof(f), NULL);
+        av_frame_free(&f.frame);
+    }
+    av_fifo_freep(&s->fifo);
+    if (s->parser)
+        av_parser_close(s->parser);
+    avcodec_free_context(&s->avctx);
+    av_free(s);
+    return XMA_SUCCESS;
+}
+
+int32_t xma_dec_session_send_data(XmaDecoderSession *s,
+                                  XmaDataBuffer *data, int32_t *data_used)
+{
+    AVPacket pkt;
+    const uint8_t *buf = data ? data->data.buffer : NULL;
+    int size           = data ? data->alloc_size  : 0;
+    int ret            = 0;
+
+    *data_used = 0;
+    av_init_packet(&pkt);
+
+    if (s->flushing)
+        return data ? XMA_ERROR : XMA_SUCCESS;
+
+    /* a NULL buffer signals the end of the stream; the parser still holds
+     * the last access unit */
+    do {
+        int len = av_parser_parse2(s->parser, s->avctx, &pkt.data, &pkt.size,
+                                   buf, size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        buf  += len;
+        size -= len;
+        if (pkt.size)
+            ret = dec_decode(s, &pkt);
+    } while (ret >= 0 && size > 0);
+
+    if (ret >= 0 && !data) {
+        s->flushing = 1;
+        ret = dec_decode(s, NULL);
+    }
+    if (ret < 0)
+        return XMA_ERROR;
+
+    if (data) {
+        *data_used        = data->alloc_size;
+        s->bytes_pending += data->alloc_size;
+    }
+    dec_update_params(s);
+    return XMA_SUCCESS;
+}
+
+int32_t xma_dec_session_get_properties(XmaDecoderSession *s,
+                                       XmaFrameProperties *fprops)
+{
+    const AVPixFmtDescriptor *desc;
+    XmaSwFrame f;
+    int queued = av_fifo_size(s->fifo) / sizeof(f);
+
+    dec_update_params(s);
+
+    if (!queued)
+        return s->flushing ? XMA_EOS : XMA_SEND_MORE_DATA;
+    if (!s->flushing && queued < s->depth)
+        return XMA_SEND_MORE_DATA;
+
+    av_fifo_generic_peek(s->fifo, &f, sizeof(f), NULL);
+    if (av_gettime_relative() < f.ready)
+        return XMA_SEND_MORE_DATA;
+
+    desc = av_pix_fmt_desc_get(f.frame->format);
+    if (!desc)
+        return XMA_ERROR;
+
+    fprops->width          = f.frame->width;
+    fprops->height         = f.frame->height;
+    fprops->bits_per_pixel = desc->comp[0].depth > 8 ? 16 : 8;
+    if (s->packed || (desc->log2_chroma_w && !desc->log2_chroma_h))
+        fprops->format = XMA_YUV422_FMT_TYPE;
+    else if (desc->log2_chroma_w)
+        fprops->format = XMA_YUV420_FMT_TYPE;
+    else
+        fprops->format = XMA_YUV444_FMT_TYPE;
+    return XMA_SUCCESS;
+}
+
+static int dec_pack_yuyv(const AVFrame *src, uint8_t *dst)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src->format);
+    int x, y;
+
+    if (!desc || desc->comp[0].depth > 8 || !desc->log2_chroma_w)
+        return AVERROR(ENOSYS);
+
+    for (y = 0; y < src->height; y++) {
+        const uint8_t *luma = src->data[0] + y * src->linesize[0];
+        const uint8_t *cb   = src->data[1] + (y >> desc->log2_chroma_h) * src->linesize[1];
+        const uint8_t *cr   = src->data[2] + (y >> desc->log2_chroma_h) * src->linesize[2];
+
+        for (x = 0; x < src->width; x += 2) {
+            *dst++ = luma[x];
+            *dst++ = cb[x >> 1];
+            *dst++ = x + 1 < src->width ? luma[x + 1] : luma[x];
+            *dst++ = cr[x >> 1];
+        }
+    }
+    return 0;
+}
+
+int32_t xma_dec_session_recv_frame(XmaDecoderSession *s, XmaFrame *frame)
+{
+    XmaFrameProperties props;
+    XmaSwFrame f;
+    int i, ret = 0;
+
+    if (xma_dec_session_get_properties(s, &props) != XMA_SUCCESS)
+        return XMA_ERROR;
+    av_fifo_generic_read(s->fifo, &f, sizeof(f), NULL);
+    s->bytes_pending = 0;
+
+    /* buffers owned by the frame are resized to what the kernel outputs */
+    for (i = 0; i < XMA_MAX_PLANES; i++) {
+        XmaBufferRef *ref = &frame->data[i];
+        int linesize, height;
+        size_t size;
+
+        if (xma_sw_plane_geometry(&props, i, &linesize, &height) < 0)
+            continue;
+        size = (size_t)linesize * height;
+        if (s->packed)
+            size = i ? (size_t)f.frame->width * f.frame->height / 2
+                     : (size_t)f.frame->width * f.frame->height;
+
+        if (ref->alloc_size < size) {
+            if (ref->is_clone) {
+                ret = AVERROR(EINVAL);
+                break;
+            }
+            av_freep(&ref->buffer);
+            ref->buffer     = av_malloc(size);
+            ref->alloc_size = ref->buffer ? size : 0;
+            if (!ref->buffer) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+        }
+    }
+
+    if (!ret && s->packed) {
+        /* the kernel writes the packed picture across the three buffers */
+        uint8_t *packed = av_malloc((size_t)f.frame->width * f.frame->height * 2);
+        size_t luma = (size_t)f.frame->width * f.frame->height;
+
+        ret = packed ? dec_pack_yuyv(f.frame, packed) : AVERROR(ENOMEM);
+        if (!ret) {
+            memcpy(frame->data[0].buffer, packed,                luma);
+            memcpy(frame->data[1].buffer, packed + luma,         luma / 2);
+            memcpy(frame->data[2].buffer, packed + luma * 3 / 2, luma / 2);
+        }
+        av_free(packed);
+    } else if (!ret) {
+        for (i = 0; i < XMA_MAX_PLANES; i++) {
+            int linesize, height;
+
+            if (xma_sw_plane_geometry(&props, i, &linesize, &height) < 0)
+                continue;
+            av_image_copy_plane(frame->data[i].buffer, linesize,
+                                f.frame->data[i], f.frame->linesize[i],
+                                linesize, height);
+        }
+    }
+
+    if (!ret) {
+        int linesize[2], height[2];
+
+        frame->frame_props = props;
+        frame->pts         = f.frame->pts;
+
+        /* what the kernel wrote to the luma and each chroma buffer */
+        xma_sw_plane_geometry(&props, 0, &linesize[0], &height[0]);
+        xma_sw_plane_geometry(&props, 1, &linesize[1], &height[1]);
+        dec_param_set(s, "comn_yuv_buf_rdsz_luma",
+                      s->packed ? (size_t)f.frame->width * f.frame->height
+                                : (size_t)linesize[0] * height[0]);
+        dec_param_set(s, "comn_yuv_buf_rdsz_cbcr",
+                      s->packed ? (size_t)f.frame->width * f.frame->height / 2
+                                : (size_t)linesize[1] * height[1]);
+    }
+    av_frame_free(&f.frame);
+    dec_update_params(s);
+    return ret < 0 ? XMA_ERROR : XMA_SUCCESS;
+}
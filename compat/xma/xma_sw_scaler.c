@@ -0,0 +1,202 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Software stand-in for the XMA ABR scaler kernel, built on libswscale.
+ */
+
+#include "libavutil/common.h"
+#include "libavutil/fifo.h"
+#include "libavutil/frame.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libswscale/swscale.h"
+
+#include "xma_sw.h"
+
+typedef struct XmaSwFrame {
+    AVFrame *frame;
+    int64_t  ready;
+} XmaSwFrame;
+
+struct XmaScalerSession {
+    const AVClass       *class;
+    XmaScalerProperties  props;
+    struct SwsContext   *sws[MAX_SCALER_OUTPUTS];
+    AVFifoBuffer        *fifo;
+    int                  device;
+    int                  depth;
+};
+
+static void inout_frame_props(const XmaScalerInOutProperties *io,
+                              XmaFrameProperties *props)
+{
+    props->format         = io->format;
+    props->width          = io->width;
+    props->height         = io->height;
+    props->bits_per_pixel = io->bits_per_pixel ? io->bits_per_pixel : 8;
+}
+
+XmaScalerSession *xma_scaler_session_create(XmaScalerProperties *props)
+{
+    XmaFrameProperties in, out;
+    XmaScalerSession *s;
+    int i, flags, device;
+
+    if (props->num_outputs < 1 || props->num_outputs > MAX_SCALER_OUTPUTS)
+        return NULL;
+    if ((device = xma_sw_open_device(props->dev_index)) < 0)
+        return NULL;
+
+    s = av_mallocz(sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->class  = &xma_sw_class;
+    s->props  = *props;
+    s->device = device;
+    s->depth = xma_sw_config()->queue_depth;
+    s->fifo  = av_fifo_alloc((s->depth + 1) * sizeof(XmaSwFrame));
+    if (!s->fifo)
+        goto fail;
+
+    flags = props->hwscaler_type == XMA_BILINEAR_SCALER_TYPE ? SWS_BILINEAR : SWS_BICUBIC;
+    flags |= SWS_ACCURATE_RND | SWS_BITEXACT;
+
+    inout_frame_props(&props->input, &in);
+    for (i = 0; i < props->num_outputs; i++) {
+        inout_frame_props(&props->output[i], &out);
+        s->sws[i] = sws_getContext(in.width,  in.height,  xma_sw_pix_fmt(&in),
+                                   out.width, out.height, xma_sw_pix_fmt(&out),
+                                   flags, NULL, NULL, NULL);
+        if (!s->sws[i])
+            goto fail;
+    }
+
+    av_log(s, AV_LOG_VERBOSE, "Scaler session %dx%d on card %d, %d outputs, depth %d\n",
+           in.width, in.height, s->device, props->num_outputs, s->depth);
+    return s;
+
+fail:
+    xma_scaler_session_destroy(s);
+    return NULL;
+}
+
+int32_t xma_scaler_session_destroy(XmaScalerSession *s)
+{
+    XmaSwFrame f;
+    int i;
+
+    if (!s)
+        return XMA_ERROR_INVALID;
+
+    while (s->fifo && av_fifo_size(s->fifo) >= sizeof(f)) {
+        av_fifo_generic_read(s->fifo, &f, sizeof(f), NULL);
+        av_frame_free(&f.frame);
+    }
+    av_fifo_freep(&s->fifo);
+    for (i = 0; i < MAX_SCALER_OUTPUTS; i++)
+        sws_freeContext(s->sws[i]);
+    av_free(s);
+    return XMA_SUCCESS;
+}
+
+int32_t xma_scaler_session_send_frame(XmaScalerSession *s, XmaFrame *frame)
+{
+    const uint8_t *src_data[4] = { NULL };
+    int src_linesize[4] = { 0 };
+    XmaFrameProperties in;
+    XmaSwFrame f;
+    int i, height, queued = av_fifo_size(s->fifo) / sizeof(f);
+
+    /* a frame without data flushes the pipeline one result at a time */
+    if (!frame->data[0].buffer)
+        return queued ? XMA_FLUSH_AGAIN : XMA_EOS;
+
+    inout_frame_props(&s->props.input, &in);
+    for (i = 0; i < XMA_MAX_PLANES; i++) {
+        if (xma_sw_plane_geometry(&in, i, &src_linesize[i], &height) < 0)
+            break;
+        src_data[i] = frame->data[i].buffer;
+    }
+
+    /* the input is uploaded, so the caller may reuse its buffers */
+    f.frame = av_frame_alloc();
+    if (!f.frame)
+        return XMA_ERROR;
+    f.frame->format = xma_sw_pix_fmt(&in);
+    f.frame->width  = in.width;
+    f.frame->height = in.height;
+    f.frame->pts    = frame->pts;
+    if (av_frame_get_buffer(f.frame, 32) < 0)
+        goto fail;
+    av_image_copy(f.frame->data, f.frame->linesize, src_data, src_linesize,
+                  f.frame->format, in.width, in.height);
+
+    f.ready = xma_sw_ready_time();
+    if (av_fifo_space(s->fifo) < sizeof(f) && av_fifo_grow(s->fifo, sizeof(f)) < 0)
+        goto fail;
+    av_fifo_generic_write(s->fifo, &f, sizeof(f), NULL);
+
+    return queued + 1 < s->depth ? XMA_SEND_MORE_DATA : XMA_SUCCESS;
+
+fail:
+    av_frame_free(&f.frame);
+    return XMA_ERROR;
+}
+
+int32_t xma_scaler_session_recv_frame_list(XmaScalerSession *s,
+                                           XmaFrame **frame_list)
+{
+    XmaSwFrame f;
+    int i, p;
+
+    if (av_fifo_size(s->fifo) < sizeof(f))
+        return XMA_TRY_AGAIN;
+    av_fifo_generic_read(s->fifo, &f, sizeof(f), NULL);
+
+    /* the kernel is busy until the job completes */
+    xma_sw_wait(f.ready);
+
+    for (i = 0; i < s->props.num_outputs; i++) {
+        XmaFrame *out = frame_list[i];
+        uint8_t *dst_data[4] = { NULL };
+        int dst_linesize[4] = { 0 };
+        XmaFrameProperties props;
+        int height;
+
+        /* the output drops this frame */
+        if (!out)
+            continue;
+
+        inout_frame_props(&s->props.output[i], &props);
+        for (p = 0; p < XMA_MAX_PLANES; p++) {
+            if (xma_sw_plane_geometry(&props, p, &dst_linesize[p], &height) < 0)
+                break;
+            dst_data[p] = out->data[p].buffer;
+        }
+
+        sws_scale(s->sws[i], (const uint8_t * const *)f.frame->data,
+                  f.frame->linesize, 0, f.frame->height, dst_data, dst_linesize);
+        out->pts = f.frame->pts;
+    }
+
+    av_frame_free(&f.frame);
+    return XMA_SUCCESS;
+}
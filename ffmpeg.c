@@ -40,8 +40,6 @@
 #include <unistd.h>
 #endif
 
-#include <xma.h>
-
 #include "libavformat/avformat.h"
 #include "libavdevice/avdevice.h"
 #include "libswresample/swresample.h"
@@ -165,6 +163,8 @@ static int restore_tty;
 
 #if HAVE_PTHREADS
 static void free_input_threads(void);
+static void free_encoder_threads(void);
+static void free_mux_threads(void);
 #endif
 
 /* sub2video hack:
@@ -465,6 +465,14 @@ static int decode_interrupt_cb(void *ctx)
 
 const AVIOInterruptCB int_cb = { decode_interrupt_cb, NULL };
 
+#if HAVE_PTHREADS
+int mux_interrupt_cb(void *opaque)
+{
+    OutputFile *of = opaque;
+    return decode_interrupt_cb(NULL) || atomic_load(&of->mux_abort);
+}
+#endif
+
 static void ffmpeg_cleanup(int ret)
 {
     int i, j;
@@ -474,8 +482,16 @@ static void ffmpeg_cleanup(int ret)
         av_log(NULL, AV_LOG_INFO, "bench: maxrss=%ikB\n", maxrss);
     }
 
+#if HAVE_PTHREADS
+    free_encoder_threads();
+    free_mux_threads();
+#endif
+
     for (i = 0; i < nb_filtergraphs; i++) {
         FilterGraph *fg = filtergraphs[i];
+#if HAVE_PTHREADS
+        filtergraph_thread_free(fg);
+#endif
         avfilter_graph_free(&fg->graph);
         for (j = 0; j < fg->nb_inputs; j++) {
             while (av_fifo_size(fg->inputs[j]->frame_queue)) {
@@ -664,13 +680,220 @@ static void update_benchmark(const char *fmt, ...)
 
 static void close_all_output_streams(OutputStream *ost, OSTFinished this_stream, OSTFinished others)
 {
+    int job = output_files[ost->file_index]->job;
     int i;
     for (i = 0; i < nb_output_streams; i++) {
         OutputStream *ost2 = output_streams[i];
+        /* with -jobs, the other jobs go on */
+        if (job && output_files[ost2->file_index]->job != job)
+            continue;
         ost2->finished |= ost == ost2 ? this_stream : others;
     }
 }
 
+/*
+ * Stop the job an output stream that failed belongs to, finishing all the
+ * streams of its outputs.
+ *
+ * @return 1 if the other jobs go on, 0 outside -jobs where the caller exits
+ */
+static int stop_job(OutputStream *ost)
+{
+    int job = output_files[ost->file_index]->job;
+    int i;
+
+    if (!job)
+        return 0;
+    if (!output_files[ost->file_index]->job_failed)
+        av_log(NULL, AV_LOG_ERROR, "Stopping job %d\n", job);
+    main_return_code = 1;
+    for (i = 0; i < nb_output_files; i++)
+        if (output_files[i]->job == job)
+            output_files[i]->job_failed = 1;
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost2 = output_streams[i];
+        if (output_files[ost2->file_index]->job != job)
+            continue;
+        ost2->finished    = ENCODER_FINISHED | MUXER_FINISHED;
+        /* so that choose_output() does not wait for it to be initialized */
+        ost2->inputs_done = 1;
+    }
+    return 1;
+}
+
+#if HAVE_PTHREADS
+static void free_pkt_msg(void *msg)
+{
+    av_packet_unref(msg);
+}
+
+static void *mux_thread(void *arg)
+{
+    OutputFile *of = arg;
+    AVFormatContext *s = of->ctx;
+    AVPacket pkt;
+    int ret;
+
+    while ((ret = av_thread_message_queue_recv(of->mux_queue, &pkt, 0)) >= 0) {
+        ret = av_interleaved_write_frame(s, &pkt);
+        av_packet_unref(&pkt);
+        if (ret < 0) {
+            if (!atomic_load(&of->mux_abort))
+                print_error("av_interleaved_write_frame()", ret);
+            break;
+        }
+        pthread_mutex_lock(&of->mux_lock);
+        of->mux_size = s->pb ? avio_tell(s->pb) : 0;
+        pthread_mutex_unlock(&of->mux_lock);
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
+
+    of->mux_ret = ret;
+    av_thread_message_queue_set_err_send(of->mux_queue, ret < 0 ? ret : AVERROR_EOF);
+
+    return NULL;
+}
+
+static int init_mux_thread(OutputFile *of)
+{
+    int ret;
+
+    if (of->mux_queue_size <= 0)
+        return 0;
+
+    ret = av_thread_message_queue_alloc(&of->mux_queue, of->mux_queue_size,
+                                        sizeof(AVPacket));
+    if (ret < 0)
+        return ret;
+    av_thread_message_queue_set_free_func(of->mux_queue, free_pkt_msg);
+    pthread_mutex_init(&of->mux_lock, NULL);
+
+    if ((ret = pthread_create(&of->mux_thread, NULL, mux_thread, of))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        pthread_mutex_destroy(&of->mux_lock);
+        av_thread_message_queue_free(&of->mux_queue);
+        return AVERROR(ret);
+    }
+    return 0;
+}
+
+static int64_t mux_thread_size(OutputFile *of)
+{
+    int64_t size;
+
+    pthread_mutex_lock(&of->mux_lock);
+    size = of->mux_size;
+    pthread_mutex_unlock(&of->mux_lock);
+
+    return size;
+}
+
+/* Give up on an output whose mux queue overflowed, without disturbing the
+ * other outputs. */
+static void disconnect_output_file(OutputFile *of, int file_index)
+{
+    int i;
+
+    av_log(NULL, AV_LOG_ERROR, "Mux queue of output file #%d is full, disconnecting it.\n",
+           file_index);
+    main_return_code = 1;
+
+    for (i = 0; i < of->ctx->nb_streams; i++)
+        output_streams[of->ost_index + i]->finished = ENCODER_FINISHED | MUXER_FINISHED;
+
+    atomic_store(&of->mux_abort, 1);
+    av_thread_message_queue_set_err_recv(of->mux_queue, AVERROR_EXIT);
+    av_thread_message_flush(of->mux_queue);
+}
+
+/* Returns 1 if the packet was dropped or the output disconnected. */
+static int send_to_mux_thread(OutputFile *of, OutputStream *ost, AVPacket *pkt)
+{
+    int key = pkt->flags & AV_PKT_FLAG_KEY;
+    int ret;
+
+    if (atomic_load(&of->mux_abort) || (ost->mux_dropping && !key))
+        goto drop;
+
+    ret = av_thread_message_queue_send(of->mux_queue, pkt,
+                                       of->mux_queue_policy == MUX_QUEUE_BLOCK ?
+                                       0 : AV_THREAD_MESSAGE_NONBLOCK);
+    if (ret == AVERROR(EAGAIN)) {
+        if (of->mux_queue_policy == MUX_QUEUE_DISCONNECT) {
+            disconnect_output_file(of, ost->file_index);
+            goto drop;
+        }
+        /* only the frames depending on what we drop can go as well */
+        if (!key) {
+            if (!of->mux_dropped)
+                av_log(NULL, AV_LOG_WARNING, "Mux queue of output file #%d is full, "
+                       "dropping packets until the next keyframe\n", ost->file_index);
+            ost->mux_dropping = 1;
+            goto drop;
+        }
+        ret = av_thread_message_queue_send(of->mux_queue, pkt, 0);
+    }
+    if (ret < 0) {
+        av_packet_unref(pkt);
+        main_return_code = 1;
+        close_all_output_streams(ost, MUXER_FINISHED | ENCODER_FINISHED, ENCODER_FINISHED);
+        return 1;
+    }
+    ost->mux_dropping = 0;
+    av_init_packet(pkt);
+    pkt->data = NULL;
+    pkt->size = 0;
+    return 0;
+
+drop:
+    of->mux_dropped += !atomic_load(&of->mux_abort);
+    av_packet_unref(pkt);
+    return 1;
+}
+
+/* Let the mux thread write what it was sent and join it. */
+static int join_mux_thread(OutputFile *of, int file_index)
+{
+    if (!of->mux_queue || of->mux_joined)
+        return 0;
+
+    av_thread_message_queue_set_err_recv(of->mux_queue, AVERROR_EOF);
+    pthread_join(of->mux_thread, NULL);
+    of->mux_joined = 1;
+
+    if (of->mux_dropped)
+        av_log(NULL, AV_LOG_WARNING, "%d packets of output file #%d were dropped "
+               "because its mux queue was full\n", of->mux_dropped, file_index);
+    if (atomic_load(&of->mux_abort))
+        return AVERROR_EXIT;
+    if (of->mux_ret < 0)
+        main_return_code = 1;
+    return of->mux_ret;
+}
+
+static void free_mux_threads(void)
+{
+    int i;
+
+    for (i = 0; i < nb_output_files; i++) {
+        OutputFile *of = output_files[i];
+
+        if (!of || !of->mux_queue)
+            continue;
+        if (!of->mux_joined) {
+            atomic_store(&of->mux_abort, 1);
+            av_thread_message_queue_set_err_recv(of->mux_queue, AVERROR_EXIT);
+            av_thread_message_flush(of->mux_queue);
+            pthread_join(of->mux_thread, NULL);
+            of->mux_joined = 1;
+        }
+        pthread_mutex_destroy(&of->mux_lock);
+        av_thread_message_queue_free(&of->mux_queue);
+    }
+}
+#endif
+
 static void write_packet(OutputFile *of, AVPacket *pkt, OutputStream *ost, int unqueue)
 {
     AVFormatContext *s = of->ctx;
@@ -797,6 +1020,17 @@ static void write_packet(OutputFile *of, AVPacket *pkt, OutputStream *ost, int u
               );
     }
 
+#if HAVE_PTHREADS
+    if (of->mux_queue) {
+        int size = pkt->size;
+        if (send_to_mux_thread(of, ost, pkt)) {
+            ost->data_size -= size;
+            ost->packets_written--;
+        }
+        return;
+    }
+#endif
+
     ret = av_interleaved_write_frame(s, pkt);
     if (ret < 0) {
         print_error("av_interleaved_write_frame()", ret);
@@ -879,6 +1113,205 @@ finish:
     }
 }
 
+#if HAVE_PTHREADS
+static void free_frame_msg(void *msg)
+{
+    av_frame_free(msg);
+}
+
+static void *encoder_thread(void *arg)
+{
+    OutputStream *ost = arg;
+    AVCodecContext *enc = ost->enc_ctx;
+    int64_t pts = AV_NOPTS_VALUE;
+    AVFrame *frame;
+    AVPacket pkt;
+    int ret;
+
+    do {
+        ret = av_thread_message_queue_recv(ost->enc_queue, &frame, 0);
+        if (ret < 0)
+            break;
+
+        /* a NULL frame flushes the encoder, the thread ends on AVERROR_EOF */
+        if (frame)
+            pts = frame->pts;
+        ret = avcodec_send_frame(enc, frame);
+        av_frame_free(&frame);
+
+        while (ret >= 0) {
+            av_init_packet(&pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+
+            ret = avcodec_receive_packet(enc, &pkt);
+            if (ret < 0)
+                break;
+
+            if (enc->codec_type == AVMEDIA_TYPE_VIDEO && pkt.pts == AV_NOPTS_VALUE &&
+                !(enc->codec->capabilities & AV_CODEC_CAP_DELAY))
+                pkt.pts = pts;
+
+            /* if two pass, output log */
+            if (ost->logfile && enc->stats_out)
+                fprintf(ost->logfile, "%s", enc->stats_out);
+
+            /* the packets are muxed by the main thread, never block on it */
+            pthread_mutex_lock(&ost->enc_lock);
+            if (!av_fifo_space(ost->enc_packets))
+                ret = av_fifo_grow(ost->enc_packets, av_fifo_size(ost->enc_packets));
+            if (ret >= 0)
+                av_fifo_generic_write(ost->enc_packets, &pkt, sizeof(pkt), NULL);
+            pthread_mutex_unlock(&ost->enc_lock);
+            if (ret < 0)
+                av_packet_unref(&pkt);
+        }
+    } while (ret == AVERROR(EAGAIN));
+
+    pthread_mutex_lock(&ost->enc_lock);
+    ost->enc_ret = ret;
+    pthread_mutex_unlock(&ost->enc_lock);
+    /* fail the next frame sent by the main thread */
+    av_thread_message_queue_set_err_send(ost->enc_queue, ret);
+
+    return NULL;
+}
+
+static int init_encoder_thread(OutputStream *ost)
+{
+    int ret;
+
+    if (!enc_threads || (ost->enc_ctx->codec_type != AVMEDIA_TYPE_VIDEO &&
+                         ost->enc_ctx->codec_type != AVMEDIA_TYPE_AUDIO))
+        return 0;
+
+    ost->enc_packets = av_fifo_alloc(FFMAX(enc_queue_size, 1) * sizeof(AVPacket));
+    if (!ost->enc_packets)
+        return AVERROR(ENOMEM);
+    ret = av_thread_message_queue_alloc(&ost->enc_queue, FFMAX(enc_queue_size, 1), sizeof(AVFrame *));
+    if (ret < 0)
+        return ret;
+    av_thread_message_queue_set_free_func(ost->enc_queue, free_frame_msg);
+    pthread_mutex_init(&ost->enc_lock, NULL);
+
+    if ((ret = pthread_create(&ost->enc_thread, NULL, encoder_thread, ost))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        pthread_mutex_destroy(&ost->enc_lock);
+        av_thread_message_queue_free(&ost->enc_queue);
+        return AVERROR(ret);
+    }
+    return 0;
+}
+
+static int send_frame_to_encoder_thread(OutputStream *ost, const AVFrame *frame)
+{
+    AVFrame *msg = NULL;
+    int ret;
+
+    if (frame && !(msg = av_frame_clone(frame)))
+        return AVERROR(ENOMEM);
+
+    ret = av_thread_message_queue_send(ost->enc_queue, &msg, 0);
+    if (ret < 0)
+        av_frame_free(&msg);
+    return ret;
+}
+
+/* mux the packets the encoder thread of ost has returned so far */
+static void reap_encoder_thread(OutputStream *ost)
+{
+    OutputFile *of = output_files[ost->file_index];
+    AVCodecContext *enc = ost->enc_ctx;
+    AVPacket pkt;
+    int ret, got_packet;
+
+    for (;;) {
+        pthread_mutex_lock(&ost->enc_lock);
+        got_packet = av_fifo_size(ost->enc_packets) >= sizeof(pkt);
+        if (got_packet)
+            av_fifo_generic_read(ost->enc_packets, &pkt, sizeof(pkt), NULL);
+        ret = ost->enc_ret;
+        pthread_mutex_unlock(&ost->enc_lock);
+
+        if (!got_packet)
+            break;
+        if (ost->finished & MUXER_FINISHED) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+
+        if (debug_ts) {
+            av_log(NULL, AV_LOG_INFO, "encoder -> type:%s "
+                   "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
+                   av_get_media_type_string(enc->codec_type),
+                   av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &enc->time_base),
+                   av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &enc->time_base));
+        }
+
+        av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase);
+        if (enc->codec_type == AVMEDIA_TYPE_VIDEO && vstats_filename) {
+            int pkt_size = pkt.size;
+            output_packet(of, &pkt, ost);
+            do_video_stats(ost, pkt_size);
+        } else
+            output_packet(of, &pkt, ost);
+    }
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        if (of->job_failed)
+            return;
+        av_log(NULL, AV_LOG_FATAL, "%s encoding failed: %s\n",
+               av_get_media_type_string(enc->codec_type), av_err2str(ret));
+        if (!stop_job(ost))
+            exit_program(1);
+    }
+}
+
+/* wait for the encoder threads to drain their encoders, and mux the rest */
+static void join_encoder_threads(void)
+{
+    int i;
+
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost = output_streams[i];
+
+        if (!ost->enc_queue || ost->enc_joined)
+            continue;
+        av_thread_message_queue_set_err_recv(ost->enc_queue, AVERROR_EOF);
+        pthread_join(ost->enc_thread, NULL);
+        ost->enc_joined = 1;
+        reap_encoder_thread(ost);
+    }
+}
+
+static void free_encoder_threads(void)
+{
+    int i;
+
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost = output_streams[i];
+        AVPacket pkt;
+
+        if (!ost || !ost->enc_queue)
+            continue;
+        if (!ost->enc_joined) {
+            av_thread_message_queue_set_err_send(ost->enc_queue, AVERROR_EOF);
+            av_thread_message_flush(ost->enc_queue);
+            av_thread_message_queue_set_err_recv(ost->enc_queue, AVERROR_EOF);
+            pthread_join(ost->enc_thread, NULL);
+            ost->enc_joined = 1;
+        }
+        while (av_fifo_size(ost->enc_packets) >= sizeof(pkt)) {
+            av_fifo_generic_read(ost->enc_packets, &pkt, sizeof(pkt), NULL);
+            av_packet_unref(&pkt);
+        }
+        av_fifo_freep(&ost->enc_packets);
+        pthread_mutex_destroy(&ost->enc_lock);
+        av_thread_message_queue_free(&ost->enc_queue);
+    }
+}
+#endif
+
 static int check_recording_time(OutputStream *ost)
 {
     OutputFile *of = output_files[ost->file_index];
@@ -921,6 +1354,15 @@ static void do_audio_out(OutputFile *of, OutputStream *ost,
                enc->time_base.num, enc->time_base.den);
     }
 
+#if HAVE_PTHREADS
+    if (ost->enc_queue) {
+        ret = send_frame_to_encoder_thread(ost, frame);
+        if (ret < 0)
+            goto error;
+        return;
+    }
+#endif
+
     ret = avcodec_send_frame(enc, frame);
     if (ret < 0)
         goto error;
@@ -949,7 +1391,8 @@ static void do_audio_out(OutputFile *of, OutputStream *ost,
     return;
 error:
     av_log(NULL, AV_LOG_FATAL, "Audio encoding failed\n");
-    exit_program(1);
+    if (!stop_job(ost))
+        exit_program(1);
 }
 
 static void do_subtitle_out(OutputFile *of,
@@ -1288,43 +1731,52 @@ static void do_video_out(OutputFile *of,
 
         ost->frames_encoded++;
 
-        ret = avcodec_send_frame(enc, in_picture);
-        if (ret < 0)
-            goto error;
-
-        while (1) {
-            ret = avcodec_receive_packet(enc, &pkt);
-            update_benchmark("encode_video %d.%d", ost->file_index, ost->index);
-            if (ret == AVERROR(EAGAIN))
-                break;
+#if HAVE_PTHREADS
+        if (ost->enc_queue) {
+            ret = send_frame_to_encoder_thread(ost, in_picture);
+            if (ret < 0)
+                goto error;
+        } else
+#endif
+        {
+            ret = avcodec_send_frame(enc, in_picture);
             if (ret < 0)
                 goto error;
 
-            if (debug_ts) {
-                av_log(NULL, AV_LOG_INFO, "encoder -> type:video "
-                       "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
-                       av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &enc->time_base),
-                       av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &enc->time_base));
-            }
+            while (1) {
+                ret = avcodec_receive_packet(enc, &pkt);
+                update_benchmark("encode_video %d.%d", ost->file_index, ost->index);
+                if (ret == AVERROR(EAGAIN))
+                    break;
+                if (ret < 0)
+                    goto error;
 
-            if (pkt.pts == AV_NOPTS_VALUE && !(enc->codec->capabilities & AV_CODEC_CAP_DELAY))
-                pkt.pts = ost->sync_opts;
+                if (debug_ts) {
+                    av_log(NULL, AV_LOG_INFO, "encoder -> type:video "
+                           "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
+                           av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &enc->time_base),
+                           av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &enc->time_base));
+                }
 
-            av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase);
+                if (pkt.pts == AV_NOPTS_VALUE && !(enc->codec->capabilities & AV_CODEC_CAP_DELAY))
+                    pkt.pts = ost->sync_opts;
 
-            if (debug_ts) {
-                av_log(NULL, AV_LOG_INFO, "encoder -> type:video "
-                    "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
-                    av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &ost->mux_timebase),
-                    av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &ost->mux_timebase));
-            }
+                av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase);
 
-            frame_size = pkt.size;
-            output_packet(of, &pkt, ost);
+                if (debug_ts) {
+                    av_log(NULL, AV_LOG_INFO, "encoder -> type:video "
+                        "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
+                        av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &ost->mux_timebase),
+                        av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &ost->mux_timebase));
+                }
 
-            /* if two pass, output log */
-            if (ost->logfile && enc->stats_out) {
-                fprintf(ost->logfile, "%s", enc->stats_out);
+                frame_size = pkt.size;
+                output_packet(of, &pkt, ost);
+
+                /* if two pass, output log */
+                if (ost->logfile && enc->stats_out) {
+                    fprintf(ost->logfile, "%s", enc->stats_out);
+                }
             }
         }
     }
@@ -1351,7 +1803,8 @@ static void do_video_out(OutputFile *of,
     return;
 error:
     av_log(NULL, AV_LOG_FATAL, "Video encoding failed\n");
-    exit_program(1);
+    if (!stop_job(ost))
+        exit_program(1);
 }
 
 static double psnr(double d)
@@ -1440,16 +1893,27 @@ static int reap_filters(int flush)
             continue;
         filter = ost->filter->filter;
 
+        if (of->job_failed)
+            continue;
         if (!ost->initialized) {
             char error[1024] = "";
             ret = init_output_stream(ost, error, sizeof(error));
             if (ret < 0) {
                 av_log(NULL, AV_LOG_ERROR, "Error initializing output stream %d:%d -- %s\n",
                        ost->file_index, ost->index, error);
+                if (stop_job(ost))
+                    continue;
                 exit_program(1);
             }
         }
 
+#if HAVE_PTHREADS
+        /* a flush comes before the graph is reconfigured or at the end,
+         * when a thread would only have to be stopped again */
+        if (!flush && (ret = filtergraph_thread_start(ost->filter->graph)) < 0)
+            return ret;
+#endif
+
         if (!ost->filtered_frame && !(ost->filtered_frame = av_frame_alloc())) {
             return AVERROR(ENOMEM);
         }
@@ -1457,6 +1921,11 @@ static int reap_filters(int flush)
 
         while (1) {
             double float_pts = AV_NOPTS_VALUE; // this is identical to filtered_frame.pts but with higher precision
+#if HAVE_PTHREADS
+            if (ost->filter->thread_frames)
+                ret = filtergraph_thread_receive(ost->filter, filtered_frame);
+            else
+#endif
             ret = av_buffersink_get_frame_flags(filter, filtered_frame,
                                                AV_BUFFERSINK_FLAG_NO_REQUEST);
             if (ret < 0) {
@@ -1524,6 +1993,11 @@ static int reap_filters(int flush)
 
             av_frame_unref(filtered_frame);
         }
+
+#if HAVE_PTHREADS
+        if (ost->enc_queue)
+            reap_encoder_thread(ost);
+#endif
     }
 
     return 0;
@@ -1646,6 +2120,72 @@ static void print_final_stats(int64_t total_size)
     }
 }
 
+static const char *const xma_stat_names[] = {
+    "frames", "in_flight", "send_time", "recv_time", "xfer_bytes", "copy_bytes", "allocs",
+};
+
+/* XMA sessions export their counters as xma_* options, other objects lack
+ * them. The sessions may run in encoder or graph threads, which update the
+ * counters atomically, so they are loaded the same way. */
+static void report_xma_stats(void *obj, const char *name, AVBPrint *buf_script, int log)
+{
+    int64_t v[FF_ARRAY_ELEMS(xma_stat_names)];
+    const AVOption *o;
+    void *target;
+    char opt[32];
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(xma_stat_names); i++) {
+        snprintf(opt, sizeof(opt), "xma_%s", xma_stat_names[i]);
+        o = av_opt_find2(obj, opt, NULL, 0, AV_OPT_SEARCH_CHILDREN, &target);
+        if (!o || o->type != AV_OPT_TYPE_INT64)
+            return;
+        v[i] = atomic_load((atomic_int_least64_t *)((uint8_t *)target + o->offset));
+    }
+
+    for (i = 0; i < FF_ARRAY_ELEMS(xma_stat_names); i++)
+        av_bprintf(buf_script, "%s_xma_%s=%"PRId64"\n", name, xma_stat_names[i], v[i]);
+    if (log)
+        av_log(NULL, AV_LOG_INFO, "bench: xma %s frames=%"PRId64" in_flight=%"PRId64" "
+               "send=%0.3fs recv=%0.3fs xfer=%.0fkB copy=%.0fkB allocs/frame=%.2f\n",
+               name, v[0], v[1], v[2] / 1000000.0, v[3] / 1000000.0,
+               v[4] / 1024.0, v[5] / 1024.0, v[0] ? (double)v[6] / v[0] : 0.0);
+}
+
+static void print_xma_stats(AVBPrint *buf_script, int is_last_report)
+{
+    int log = do_benchmark_all || (do_benchmark && is_last_report);
+    char name[128];
+    int i, j;
+
+    for (i = 0; i < nb_input_streams; i++) {
+        InputStream *ist = input_streams[i];
+
+        if (!ist->decoding_needed || !ist->dec_ctx)
+            continue;
+        snprintf(name, sizeof(name), "input_%d_%d", ist->file_index, ist->st->index);
+        report_xma_stats(ist->dec_ctx, name, buf_script, log);
+    }
+    for (i = 0; i < nb_filtergraphs; i++) {
+        AVFilterGraph *graph = filtergraphs[i]->graph;
+
+        if (!graph)
+            continue;
+        for (j = 0; j < graph->nb_filters; j++) {
+            snprintf(name, sizeof(name), "graph_%d_%s", i, graph->filters[j]->name);
+            report_xma_stats(graph->filters[j], name, buf_script, log);
+        }
+    }
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost = output_streams[i];
+
+        if (!ost->encoding_needed || !ost->enc_ctx)
+            continue;
+        snprintf(name, sizeof(name), "stream_%d_%d", ost->file_index, ost->index);
+        report_xma_stats(ost->enc_ctx, name, buf_script, log);
+    }
+}
+
 static void print_report(int is_last_report, int64_t timer_start, int64_t cur_time)
 {
     char buf[1024];
@@ -1682,9 +2222,16 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
 
     oc = output_files[0]->ctx;
 
-    total_size = avio_size(oc->pb);
-    if (total_size <= 0) // FIXME improve avio_size() so it works with non seekable output too
-        total_size = avio_tell(oc->pb);
+#if HAVE_PTHREADS
+    if (output_files[0]->mux_queue && !output_files[0]->mux_joined) {
+        total_size = mux_thread_size(output_files[0]);
+    } else
+#endif
+    {
+        total_size = avio_size(oc->pb);
+        if (total_size <= 0) // FIXME improve avio_size() so it works with non seekable output too
+            total_size = avio_tell(oc->pb);
+    }
 
     buf[0] = '\0';
     vid = 0;
@@ -1810,6 +2357,8 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
         av_bprintf(&buf_script, "speed=%4.3gx\n", speed);
     }
 
+    print_xma_stats(&buf_script, is_last_report);
+
     if (print_stats || is_last_report) {
         const char end = is_last_report ? '\n' : '\r';
         if (print_stats==1 && AV_LOG_INFO > av_log_get_level()) {
@@ -1847,7 +2396,7 @@ static void flush_encoders(void)
         AVCodecContext *enc = ost->enc_ctx;
         OutputFile      *of = output_files[ost->file_index];
 
-        if (!ost->encoding_needed)
+        if (!ost->encoding_needed || of->job_failed)
             continue;
 
         // Try to enable encoding with no input frames.
@@ -1884,6 +2433,8 @@ static void flush_encoders(void)
                 ret = configure_filtergraph(fg);
                 if (ret < 0) {
                     av_log(NULL, AV_LOG_ERROR, "Error configuring filter graph\n");
+                    if (stop_job(ost))
+                        continue;
                     exit_program(1);
                 }
 
@@ -1894,10 +2445,27 @@ static void flush_encoders(void)
             if (ret < 0) {
                 av_log(NULL, AV_LOG_ERROR, "Error initializing output stream %d:%d -- %s\n",
                        ost->file_index, ost->index, error);
+                if (stop_job(ost))
+                    continue;
                 exit_program(1);
             }
         }
 
+#if HAVE_PTHREADS
+        if (ost->enc_queue) {
+            /* the thread drains the encoder, its packets are muxed below */
+            ret = send_frame_to_encoder_thread(ost, NULL);
+            if (ret < 0 && ret != AVERROR_EOF) {
+                av_log(NULL, AV_LOG_FATAL, "Flushing the encoder failed: %s\n",
+                       av_err2str(ret));
+                if (stop_job(ost))
+                    continue;
+                exit_program(1);
+            }
+            continue;
+        }
+#endif
+
         if (enc->codec_type == AVMEDIA_TYPE_AUDIO && enc->frame_size <= 1)
             continue;
 #if FF_API_LAVF_FMT_RAWPICTURE
@@ -1932,12 +2500,8 @@ static void flush_encoders(void)
 
                 while ((ret = avcodec_receive_packet(enc, &pkt)) == AVERROR(EAGAIN)) {
                     ret = avcodec_send_frame(enc, NULL);
-                    if (ret < 0) {
-                        av_log(NULL, AV_LOG_FATAL, "%s encoding failed: %s\n",
-                               desc,
-                               av_err2str(ret));
-                        exit_program(1);
-                    }
+                    if (ret < 0)
+                        break;
                 }
 
                 update_benchmark("flush_%s %d.%d", desc, ost->file_index, ost->index);
@@ -1945,6 +2509,8 @@ static void flush_encoders(void)
                     av_log(NULL, AV_LOG_FATAL, "%s encoding failed: %s\n",
                            desc,
                            av_err2str(ret));
+                    if (stop_job(ost))
+                        break;
                     exit_program(1);
                 }
                 if (ost->logfile && enc->stats_out) {
@@ -1965,6 +2531,10 @@ static void flush_encoders(void)
                 }
         }
     }
+
+#if HAVE_PTHREADS
+    join_encoder_threads();
+#endif
 }
 
 /*
@@ -2149,6 +2719,23 @@ static int ifilter_has_all_input_formats(FilterGraph *fg)
     return 1;
 }
 
+#if HAVE_PTHREADS
+static int send_to_graph_thread(InputFilter *ifilter, AVFrame *frame)
+{
+    int ret;
+
+    /* the graph thread is behind: mux what it has filtered so far and wait
+     * for it to make room */
+    while ((ret = filtergraph_thread_send(ifilter, frame)) == AVERROR(EAGAIN)) {
+        ret = reap_filters(0);
+        if (ret < 0)
+            return ret;
+        filtergraph_thread_wait(ifilter->graph, 1);
+    }
+    return ret;
+}
+#endif
+
 static int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame)
 {
     FilterGraph *fg = ifilter->graph;
@@ -2199,6 +2786,13 @@ static int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame)
             }
         }
 
+#if HAVE_PTHREADS
+        /* the frames sent before the change are filtered by the old graph */
+        filtergraph_thread_stop(fg, 0);
+        if (fg->thread_ret < 0)
+            return fg->thread_ret;
+#endif
+
         ret = reap_filters(1);
         if (ret < 0 && ret != AVERROR_EOF) {
             char errbuf[128];
@@ -2215,6 +2809,11 @@ static int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame)
         }
     }
 
+#if HAVE_PTHREADS
+    if (fg->thread_running)
+        ret = send_to_graph_thread(ifilter, frame);
+    else
+#endif
     ret = av_buffersrc_add_frame_flags(ifilter->filter, frame, AV_BUFFERSRC_FLAG_PUSH);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error while filtering\n");
@@ -2231,6 +2830,11 @@ static int ifilter_send_eof(InputFilter *ifilter)
     ifilter->eof = 1;
 
     if (ifilter->filter) {
+#if HAVE_PTHREADS
+        if (ifilter->graph->thread_running)
+            ret = send_to_graph_thread(ifilter, NULL);
+        else
+#endif
         ret = av_buffersrc_add_frame_flags(ifilter->filter, NULL, AV_BUFFERSRC_FLAG_PUSH);
         if (ret < 0)
             return ret;
@@ -2946,6 +3550,9 @@ static int check_init_output_file(OutputFile *of, int file_index)
             return 0;
     }
 
+#if HAVE_PTHREADS
+    if (of->mux_queue_size <= 0)
+#endif
     of->ctx->interrupt_callback = int_cb;
 
     ret = avformat_write_header(of->ctx, &of->opts);
@@ -2964,6 +3571,12 @@ static int check_init_output_file(OutputFile *of, int file_index)
     if (sdp_filename || want_sdp)
         print_sdp();
 
+#if HAVE_PTHREADS
+    ret = init_mux_thread(of);
+    if (ret < 0)
+        return ret;
+#endif
+
     /* flush the muxing queues */
     for (i = 0; i < of->ctx->nb_streams; i++) {
         OutputStream *ost = output_streams[of->ost_index + i];
@@ -3527,6 +4140,15 @@ static int init_output_stream(OutputStream *ost, char *error, int error_len)
             ost->st->duration = av_rescale_q(ist->st->duration, ist->st->time_base, ost->st->time_base);
 
         ost->st->codec->codec= ost->enc_ctx->codec;
+
+#if HAVE_PTHREADS
+        ret = init_encoder_thread(ost);
+        if (ret < 0) {
+            snprintf(error, error_len, "Error starting the encoder thread for "
+                     "output stream #%d:%d", ost->file_index, ost->index);
+            return ret;
+        }
+#endif
     } else if (ost->stream_copy) {
         ret = init_output_stream_streamcopy(ost);
         if (ret < 0)
@@ -3786,8 +4408,15 @@ static int need_output(void)
         OutputFile *of       = output_files[ost->file_index];
         AVFormatContext *os  = output_files[ost->file_index]->ctx;
 
-        if (ost->finished ||
-            (os->pb && avio_tell(os->pb) >= of->limit_filesize))
+        if (ost->finished)
+            continue;
+#if HAVE_PTHREADS
+        if (of->mux_queue) {
+            if (mux_thread_size(of) >= of->limit_filesize)
+                continue;
+        } else
+#endif
+        if (os->pb && avio_tell(os->pb) >= of->limit_filesize)
             continue;
         if (ost->frame_number >= ost->max_frames) {
             int j;
@@ -3889,6 +4518,10 @@ static int check_keyboard_interaction(int64_t cur_time)
                    target, time, command, arg);
             for (i = 0; i < nb_filtergraphs; i++) {
                 FilterGraph *fg = filtergraphs[i];
+#if HAVE_PTHREADS
+                /* reap_filters() restarts the thread */
+                filtergraph_thread_stop(fg, 0);
+#endif
                 if (fg->graph) {
                     if (time < 0) {
                         ret = avfilter_graph_send_command(fg->graph, target, command, arg, buf, sizeof(buf),
@@ -4424,6 +5057,60 @@ discard_packet:
     return 0;
 }
 
+#if HAVE_PTHREADS
+static int transcode_from_graph_thread(FilterGraph *graph, InputStream **best_ist)
+{
+    int i, ret, pending;
+    unsigned nb_requests, nb_requests_max = 0;
+    InputFilter *ifilter;
+    InputStream *ist;
+
+    ret = reap_filters(0);
+    if (ret < 0)
+        return ret;
+
+    pending = filtergraph_thread_poll(graph);
+    if (pending == AVERROR_EOF) {
+        ret = reap_filters(1);
+        for (i = 0; i < graph->nb_outputs; i++)
+            close_output_stream(graph->outputs[i]->ost);
+        return ret;
+    }
+    if (pending == AVERROR(EAGAIN))
+        return filtergraph_thread_wait(graph, 1);
+    if (pending < 0)
+        return pending;
+
+    /* which input is read next depends on what the graph asks for: let it
+     * settle first, so that the order and the output stay deterministic */
+    if (pending && graph->nb_inputs > 1)
+        return filtergraph_thread_wait(graph, 0);
+
+    for (i = 0; i < graph->nb_inputs; i++) {
+        ifilter = graph->inputs[i];
+        ist = ifilter->ist;
+        if (ifilter->eof || input_files[ist->file_index]->eagain ||
+            input_files[ist->file_index]->eof_reached)
+            continue;
+        nb_requests = graph->nb_inputs == 1 ? 1 :
+                      av_buffersrc_get_nb_failed_requests(ifilter->filter);
+        if (nb_requests > nb_requests_max) {
+            nb_requests_max = nb_requests;
+            *best_ist = ist;
+        }
+    }
+
+    if (!*best_ist) {
+        if (pending)
+            return filtergraph_thread_wait(graph, 0);
+        for (i = 0; i < graph->nb_outputs; i++)
+            graph->outputs[i]->ost->unavailable = 1;
+    }
+
+    return 0;
+}
+#endif
+
 /**
  * Perform a step of transcoding for the specified filter graph.
  *
@@ -4439,6 +5126,10 @@ static int transcode_from_filter(FilterGraph *graph, InputStream **best_ist)
     InputStream *ist;
 
     *best_ist = NULL;
+#if HAVE_PTHREADS
+    if (graph->thread_running)
+        return transcode_from_graph_thread(graph, best_ist);
+#endif
     ret = avfilter_graph_request_oldest(graph->graph);
     if (ret >= 0)
         return reap_filters(0);
@@ -4618,6 +5309,10 @@ static int transcode(void)
                    i, os->filename);
             continue;
         }
+#if HAVE_PTHREADS
+        if (join_mux_thread(output_files[i], i) == AVERROR_EXIT)
+            continue;
+#endif
         if ((ret = av_write_trailer(os)) < 0) {
             av_log(NULL, AV_LOG_ERROR, "Error writing trailer of %s: %s\n", os->filename, av_err2str(ret));
             if (exit_on_error)
@@ -4758,16 +5453,6 @@ int main(int argc, char **argv)
 
     show_banner(argc, argv, options);
 
-#if CONFIG_LIBXMAAPI
-    /* Initialize the Xilinx Media Accelerator */
-    ret = xma_initialize("/var/tmp/xmacfg.yaml");
-    if (ret != 0)
-    {
-        printf("xma_initialize failed: rc = %d\n", ret);
-        exit_program(1);
-    }
-#endif
-
     /* parse options and open all input/output files */
     ret = ffmpeg_parse_options(argc, argv);
     if (ret < 0)
@@ -21,6 +21,7 @@
 
 #include "config.h"
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <signal.h>
@@ -67,6 +68,7 @@ enum HWAccelID {
     HWACCEL_QSV,
     HWACCEL_VAAPI,
     HWACCEL_CUVID,
+    HWACCEL_XMA,
 };
 
 typedef struct HWAccel {
@@ -152,6 +154,8 @@ typedef struct OptionsContext {
     float mux_preload;
     float mux_max_delay;
     int shortest;
+    int mux_queue_size;
+    const char *mux_queue_policy;
 
     int video_disable;
     int audio_disable;
@@ -273,6 +277,11 @@ typedef struct OutputFilter {
     int *formats;
     uint64_t *channel_layouts;
     int *sample_rates;
+
+#if HAVE_PTHREADS
+    AVFifoBuffer *thread_frames;     /* frames pulled from the sink by the graph thread */
+    int sink_eof;                    /* the graph thread got EOF from the sink */
+#endif
 } OutputFilter;
 
 typedef struct FilterGraph {
@@ -286,6 +295,21 @@ typedef struct FilterGraph {
     int          nb_inputs;
     OutputFilter **outputs;
     int         nb_outputs;
+
+    int job;                         /* job the graph belongs to, 0 outside -jobs */
+    int job_input_offset;            /* first input file of the job */
+    int job_nb_inputs;               /* input files of the job */
+
+#if HAVE_PTHREADS
+    pthread_t thread;                /* thread running the graph, see -graph_threads */
+    pthread_mutex_t thread_lock;     /* protects the fields below and thread_frames */
+    pthread_cond_t thread_cond;
+    AVFifoBuffer *thread_queue;      /* frames and EOFs sent to the graph thread */
+    int thread_running;
+    int thread_busy;                 /* the graph thread is filtering a frame */
+    int thread_stop;                 /* 1: filter what is queued and exit, 2: exit now */
+    int thread_ret;                  /* error the graph thread stopped with */
+#endif
 } FilterGraph;
 
 typedef struct InputStream {
@@ -547,8 +571,25 @@ typedef struct OutputStream {
 
     /* frame encode sum of squared error values */
     int64_t error[4];
+
+#if HAVE_PTHREADS
+    AVThreadMessageQueue *enc_queue; /* frames sent to the encoder thread */
+    pthread_t enc_thread;            /* thread running the encoder, see -enc_threads */
+    pthread_mutex_t enc_lock;        /* protects enc_packets and enc_ret */
+    AVFifoBuffer *enc_packets;       /* packets returned by the encoder thread */
+    int enc_ret;                     /* error the encoder thread stopped with */
+    int enc_joined;                  /* the encoder thread has been joined */
+
+    int mux_dropping;                /* drop packets until the next keyframe, see -mux_queue_policy */
+#endif
 } OutputStream;
 
+enum MuxQueuePolicy {
+    MUX_QUEUE_BLOCK,
+    MUX_QUEUE_DROP,
+    MUX_QUEUE_DISCONNECT,
+};
+
 typedef struct OutputFile {
     AVFormatContext *ctx;
     AVDictionary *opts;
@@ -560,6 +601,22 @@ typedef struct OutputFile {
     int shortest;
 
     int header_written;
+
+    int job;             /* job the file belongs to, 0 outside -jobs */
+    int job_failed;      /* an output of the job failed, the job is stopped */
+
+    int mux_queue_size;                   /* packets queued to the mux thread, 0 to mux inline */
+    enum MuxQueuePolicy mux_queue_policy; /* what to do when the mux queue is full */
+#if HAVE_PTHREADS
+    AVThreadMessageQueue *mux_queue;
+    pthread_t mux_thread;
+    pthread_mutex_t mux_lock;             /* protects mux_size */
+    int64_t mux_size;                     /* bytes written by the mux thread */
+    int mux_ret;                          /* error the mux thread stopped with */
+    int mux_dropped;                      /* packets dropped by MUX_QUEUE_DROP */
+    atomic_int mux_abort;                 /* interrupt the I/O of a disconnected output */
+    int mux_joined;
+#endif
 } OutputFile;
 
 extern InputStream **input_streams;
@@ -607,9 +664,15 @@ extern char *videotoolbox_pixfmt;
 
 extern int filter_nbthreads;
 extern int filter_complex_nbthreads;
+extern int enc_threads;
+extern int enc_queue_size;
+extern int graph_threads;
 extern int vstats_version;
 
 extern const AVIOInterruptCB int_cb;
+#if HAVE_PTHREADS
+int mux_interrupt_cb(void *opaque);
+#endif
 
 extern const OptionDef options[];
 extern const HWAccel hwaccels[];
@@ -618,6 +681,9 @@ extern AVBufferRef *hw_device_ctx;
 #if CONFIG_QSV
 extern char *qsv_device;
 #endif
+#if CONFIG_LIBXMAAPI
+extern char *xma_cfg;
+#endif
 
 
 void term_init(void);
@@ -648,6 +714,16 @@ void sub2video_update(InputStream *ist, AVSubtitle *sub);
 
 int ifilter_parameters_from_frame(InputFilter *ifilter, const AVFrame *frame);
 
+#if HAVE_PTHREADS
+int filtergraph_thread_start(FilterGraph *fg);
+void filtergraph_thread_stop(FilterGraph *fg, int abort);
+void filtergraph_thread_free(FilterGraph *fg);
+int filtergraph_thread_send(InputFilter *ifilter, AVFrame *frame);
+int filtergraph_thread_receive(OutputFilter *ofilter, AVFrame *frame);
+int filtergraph_thread_poll(FilterGraph *fg);
+int filtergraph_thread_wait(FilterGraph *fg, int for_input);
+#endif
+
 int ffmpeg_parse_options(int argc, char **argv);
 
 int vdpau_init(AVCodecContext *s);
@@ -658,5 +734,8 @@ int qsv_init(AVCodecContext *s);
 int vaapi_decode_init(AVCodecContext *avctx);
 int vaapi_device_init(const char *device);
 int cuvid_init(AVCodecContext *s);
+int xma_init(AVCodecContext *s);
+int xma_device_init(const char *device);
+int xma_setup(void);
 
 #endif /* FFMPEG_H */
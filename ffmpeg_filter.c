@@ -293,9 +293,13 @@ static void init_input_filter(FilterGraph *fg, AVFilterInOut *in)
         }
         ist = input_streams[input_files[file_idx]->ist_index + st->index];
     } else {
-        /* find the first unused stream of corresponding type */
+        /* find the first unused stream of corresponding type, in the
+         * inputs of the job of the graph with -jobs */
         for (i = 0; i < nb_input_streams; i++) {
             ist = input_streams[i];
+            if (fg->job && (ist->file_index <  fg->job_input_offset ||
+                            ist->file_index >= fg->job_input_offset + fg->job_nb_inputs))
+                continue;
             if (ist->dec_ctx->codec_type == type && ist->discard)
                 break;
         }
@@ -329,6 +333,45 @@ static void init_input_filter(FilterGraph *fg, AVFilterInOut *in)
     ist->filters[ist->nb_filters - 1] = fg->inputs[fg->nb_inputs - 1];
 }
 
+/* Rename the open labels of a graph of a job, so that they cannot clash with
+ * the other jobs: [N...] refers to input N of the job, and the outputs get
+ * the prefix the -map options of the job were given, see expand_jobs(). */
+static int rename_job_labels(FilterGraph *fg, AVFilterInOut *inputs, AVFilterInOut *outputs)
+{
+    AVFilterInOut *cur;
+
+    for (cur = inputs; cur; cur = cur->next) {
+        char *end, *name;
+        long idx;
+
+        if (!cur->name)
+            continue;
+        idx = strtol(cur->name, &end, 10);
+        if (end == cur->name || idx < 0)
+            continue;
+        if (idx >= fg->job_nb_inputs) {
+            av_log(NULL, AV_LOG_FATAL, "Invalid file index %ld in filtergraph description %s "
+                   "of job %d.\n", idx, fg->graph_desc, fg->job);
+            return AVERROR(EINVAL);
+        }
+        if (!(name = av_asprintf("%ld%s", idx + fg->job_input_offset, end)))
+            return AVERROR(ENOMEM);
+        av_free(cur->name);
+        cur->name = name;
+    }
+    for (cur = outputs; cur; cur = cur->next) {
+        char *name;
+
+        if (!cur->name)
+            continue;
+        if (!(name = av_asprintf("job%d_%s", fg->job, cur->name)))
+            return AVERROR(ENOMEM);
+        av_free(cur->name);
+        cur->name = name;
+    }
+    return 0;
+}
+
 int init_complex_filtergraph(FilterGraph *fg)
 {
     AVFilterInOut *inputs, *outputs, *cur;
@@ -345,6 +388,9 @@ int init_complex_filtergraph(FilterGraph *fg)
     if (ret < 0)
         goto fail;
 
+    if (fg->job && (ret = rename_job_labels(fg, inputs, outputs)) < 0)
+        goto fail;
+
     for (cur = inputs; cur; cur = cur->next)
         init_input_filter(fg, cur);
 
@@ -985,6 +1031,10 @@ static int configure_input_filter(FilterGraph *fg, InputFilter *ifilter,
 static void cleanup_filtergraph(FilterGraph *fg)
 {
     int i;
+#if HAVE_PTHREADS
+    /* the graph thread must not run the graph freed below */
+    filtergraph_thread_stop(fg, 0);
+#endif
     for (i = 0; i < fg->nb_outputs; i++)
         fg->outputs[i]->filter = (AVFilterContext *)NULL;
     for (i = 0; i < fg->nb_inputs; i++)
@@ -1202,3 +1252,323 @@ int filtergraph_is_simple(FilterGraph *fg)
 {
     return !fg->graph_desc;
 }
+
+#if HAVE_PTHREADS
+/* Frames queued to a graph thread, and filtered frames an output may hold
+ * before the graph thread stops taking new input. */
+#define GRAPH_THREAD_QUEUE_SIZE 8
+
+typedef struct GraphThreadMsg {
+    InputFilter *ifilter;
+    AVFrame     *frame;         /* NULL to signal EOF on ifilter */
+} GraphThreadMsg;
+
+static int graph_thread_outputs_full(FilterGraph *fg)
+{
+    int i;
+    for (i = 0; i < fg->nb_outputs; i++)
+        if (av_fifo_size(fg->outputs[i]->thread_frames) >=
+            GRAPH_THREAD_QUEUE_SIZE * sizeof(AVFrame *))
+            return 1;
+    return 0;
+}
+
+static int graph_thread_outputs_ready(FilterGraph *fg)
+{
+    int i;
+    for (i = 0; i < fg->nb_outputs; i++)
+        if (av_fifo_size(fg->outputs[i]->thread_frames))
+            return 1;
+    return 0;
+}
+
+static int graph_thread_eof(FilterGraph *fg)
+{
+    int i;
+    for (i = 0; i < fg->nb_outputs; i++)
+        if (!fg->outputs[i]->sink_eof)
+            return 0;
+    return 1;
+}
+
+/* Move everything the sinks can return to the output queues. The sinks are
+ * asked for more like avfilter_graph_request_oldest() does, so the buffer
+ * sources keep counting the frames they are missing. */
+static int graph_thread_pull(FilterGraph *fg)
+{
+    int i, ret, progress;
+
+    do {
+        progress = 0;
+        for (i = 0; i < fg->nb_outputs; i++) {
+            OutputFilter *ofilter = fg->outputs[i];
+            AVFrame *frame;
+
+            if (ofilter->sink_eof)
+                continue;
+            if (!(frame = av_frame_alloc()))
+                return AVERROR(ENOMEM);
+
+            ret = av_buffersink_get_frame_flags(ofilter->filter, frame, 0);
+            if (ret < 0) {
+                av_frame_free(&frame);
+                if (ret == AVERROR_EOF) {
+                    pthread_mutex_lock(&fg->thread_lock);
+                    ofilter->sink_eof = 1;
+                    pthread_cond_broadcast(&fg->thread_cond);
+                    pthread_mutex_unlock(&fg->thread_lock);
+                } else if (ret != AVERROR(EAGAIN)) {
+                    av_log(NULL, AV_LOG_WARNING,
+                           "Error in av_buffersink_get_frame_flags(): %s\n", av_err2str(ret));
+                }
+                continue;
+            }
+
+            pthread_mutex_lock(&fg->thread_lock);
+            ret = 0;
+            if (av_fifo_space(ofilter->thread_frames) < sizeof(frame))
+                ret = av_fifo_grow(ofilter->thread_frames,
+                                   FFMAX(av_fifo_size(ofilter->thread_frames), sizeof(frame)));
+            if (ret >= 0)
+                av_fifo_generic_write(ofilter->thread_frames, &frame, sizeof(frame), NULL);
+            pthread_cond_broadcast(&fg->thread_cond);
+            pthread_mutex_unlock(&fg->thread_lock);
+            if (ret < 0) {
+                av_frame_free(&frame);
+                return ret;
+            }
+            progress = 1;
+        }
+    } while (progress);
+
+    return 0;
+}
+
+static void *graph_thread(void *arg)
+{
+    FilterGraph *fg = arg;
+    GraphThreadMsg msg;
+    int ret;
+
+    /* frames filtered on the main thread before this one was started */
+    ret = graph_thread_pull(fg);
+
+    pthread_mutex_lock(&fg->thread_lock);
+    while (ret >= 0 && fg->thread_stop < 2) {
+        if (!av_fifo_size(fg->thread_queue)) {
+            if (fg->thread_stop)
+                break;
+            pthread_cond_wait(&fg->thread_cond, &fg->thread_lock);
+            continue;
+        }
+        /* back-pressure: wait for the encoders to catch up */
+        if (!fg->thread_stop && graph_thread_outputs_full(fg)) {
+            pthread_cond_wait(&fg->thread_cond, &fg->thread_lock);
+            continue;
+        }
+
+        av_fifo_generic_read(fg->thread_queue, &msg, sizeof(msg), NULL);
+        fg->thread_busy = 1;
+        pthread_cond_broadcast(&fg->thread_cond);
+        pthread_mutex_unlock(&fg->thread_lock);
+
+        ret = av_buffersrc_add_frame_flags(msg.ifilter->filter, msg.frame,
+                                           AV_BUFFERSRC_FLAG_PUSH);
+        av_frame_free(&msg.frame);
+        if (ret < 0)
+            av_log(NULL, AV_LOG_ERROR, "Error while filtering: %s\n", av_err2str(ret));
+        else
+            ret = graph_thread_pull(fg);
+
+        pthread_mutex_lock(&fg->thread_lock);
+        fg->thread_busy = 0;
+        pthread_cond_broadcast(&fg->thread_cond);
+    }
+    if (ret < 0)
+        fg->thread_ret = ret;
+    pthread_cond_broadcast(&fg->thread_cond);
+    pthread_mutex_unlock(&fg->thread_lock);
+
+    return NULL;
+}
+
+int filtergraph_thread_start(FilterGraph *fg)
+{
+    int i, ret;
+
+    if (!graph_threads || fg->thread_running || !fg->graph || !fg->nb_inputs)
+        return 0;
+    /* sub2video feeds its buffer source from the main thread */
+    for (i = 0; i < fg->nb_inputs; i++)
+        if (fg->inputs[i]->type == AVMEDIA_TYPE_SUBTITLE)
+            return 0;
+    /* initializing an encoder reads and sets the sink parameters */
+    for (i = 0; i < fg->nb_outputs; i++)
+        if (!fg->outputs[i]->ost->initialized)
+            return 0;
+
+    /* the lock outlives the thread, the frames it filtered are reaped
+     * after it is stopped */
+    if (!fg->thread_queue) {
+        if (!(fg->thread_queue = av_fifo_alloc(GRAPH_THREAD_QUEUE_SIZE * sizeof(GraphThreadMsg))))
+            return AVERROR(ENOMEM);
+        pthread_mutex_init(&fg->thread_lock, NULL);
+        pthread_cond_init(&fg->thread_cond, NULL);
+    }
+    for (i = 0; i < fg->nb_outputs; i++) {
+        OutputFilter *ofilter = fg->outputs[i];
+        if (!ofilter->thread_frames &&
+            !(ofilter->thread_frames = av_fifo_alloc(GRAPH_THREAD_QUEUE_SIZE * sizeof(AVFrame *))))
+            return AVERROR(ENOMEM);
+        ofilter->sink_eof = 0;
+    }
+    fg->thread_busy = 0;
+    fg->thread_stop = 0;
+    fg->thread_ret  = 0;
+
+    if ((ret = pthread_create(&fg->thread, NULL, graph_thread, fg))) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        return AVERROR(ret);
+    }
+    fg->thread_running = 1;
+
+    return 0;
+}
+
+/* Join the graph thread, after it filtered the queued frames unless abort is
+ * set. Filtered frames stay queued for reap_filters(). */
+void filtergraph_thread_stop(FilterGraph *fg, int abort)
+{
+    GraphThreadMsg msg;
+
+    if (!fg->thread_running)
+        return;
+
+    pthread_mutex_lock(&fg->thread_lock);
+    fg->thread_stop = abort ? 2 : 1;
+    pthread_cond_broadcast(&fg->thread_cond);
+    pthread_mutex_unlock(&fg->thread_lock);
+
+    pthread_join(fg->thread, NULL);
+    fg->thread_running = 0;
+
+    while (av_fifo_size(fg->thread_queue)) {
+        av_fifo_generic_read(fg->thread_queue, &msg, sizeof(msg), NULL);
+        av_frame_free(&msg.frame);
+    }
+}
+
+void filtergraph_thread_free(FilterGraph *fg)
+{
+    int i;
+
+    filtergraph_thread_stop(fg, 1);
+    if (fg->thread_queue) {
+        pthread_cond_destroy(&fg->thread_cond);
+        pthread_mutex_destroy(&fg->thread_lock);
+    }
+    av_fifo_freep(&fg->thread_queue);
+    for (i = 0; i < fg->nb_outputs; i++) {
+        OutputFilter *ofilter = fg->outputs[i];
+        while (ofilter->thread_frames && av_fifo_size(ofilter->thread_frames)) {
+            AVFrame *frame;
+            av_fifo_generic_read(ofilter->thread_frames, &frame, sizeof(frame), NULL);
+            av_frame_free(&frame);
+        }
+        av_fifo_freep(&ofilter->thread_frames);
+    }
+}
+
+/* Queue a frame (or EOF if frame is NULL) to the graph thread, taking its
+ * reference. Returns AVERROR(EAGAIN) if the queue is full. */
+int filtergraph_thread_send(InputFilter *ifilter, AVFrame *frame)
+{
+    FilterGraph *fg = ifilter->graph;
+    GraphThreadMsg msg = { ifilter };
+    int ret = 0;
+
+    pthread_mutex_lock(&fg->thread_lock);
+    if (fg->thread_ret < 0) {
+        ret = fg->thread_ret;
+    } else if (av_fifo_space(fg->thread_queue) < sizeof(msg)) {
+        ret = AVERROR(EAGAIN);
+    } else if (frame && !(msg.frame = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
+    } else {
+        if (frame)
+            av_frame_move_ref(msg.frame, frame);
+        av_fifo_generic_write(fg->thread_queue, &msg, sizeof(msg), NULL);
+        pthread_cond_broadcast(&fg->thread_cond);
+    }
+    pthread_mutex_unlock(&fg->thread_lock);
+
+    return ret;
+}
+
+/* Same as av_buffersink_get_frame_flags() with AV_BUFFERSINK_FLAG_NO_REQUEST,
+ * for outputs of a graph that has been run by a thread. */
+int filtergraph_thread_receive(OutputFilter *ofilter, AVFrame *frame)
+{
+    FilterGraph *fg = ofilter->graph;
+    AVFrame *tmp;
+    int ret = 0;
+
+    if (!fg->thread_running && !av_fifo_size(ofilter->thread_frames))
+        return av_buffersink_get_frame_flags(ofilter->filter, frame,
+                                             AV_BUFFERSINK_FLAG_NO_REQUEST);
+
+    pthread_mutex_lock(&fg->thread_lock);
+    if (av_fifo_size(ofilter->thread_frames)) {
+        av_fifo_generic_read(ofilter->thread_frames, &tmp, sizeof(tmp), NULL);
+        av_frame_move_ref(frame, tmp);
+        av_frame_free(&tmp);
+        pthread_cond_broadcast(&fg->thread_cond);
+    } else {
+        ret = ofilter->sink_eof ? AVERROR_EOF : AVERROR(EAGAIN);
+    }
+    pthread_mutex_unlock(&fg->thread_lock);
+
+    return ret;
+}
+
+/* Returns AVERROR(EAGAIN) if the input queue is full, 1 if the graph thread
+ * has work pending or frames to reap, AVERROR_EOF once all the outputs are
+ * finished and reaped, 0 if it waits for input. */
+int filtergraph_thread_poll(FilterGraph *fg)
+{
+    int ret;
+
+    pthread_mutex_lock(&fg->thread_lock);
+    if (fg->thread_ret < 0)
+        ret = fg->thread_ret;
+    else if (av_fifo_space(fg->thread_queue) < sizeof(GraphThreadMsg))
+        ret = AVERROR(EAGAIN);
+    else if (av_fifo_size(fg->thread_queue) || fg->thread_busy ||
+             graph_thread_outputs_ready(fg))
+        ret = 1;
+    else if (graph_thread_eof(fg))
+        ret = AVERROR_EOF;
+    else
+        ret = 0;
+    pthread_mutex_unlock(&fg->thread_lock);
+
+    return ret;
+}
+
+/* Block until there are filtered frames to reap, or until the graph thread
+ * has room for input (for_input) or nothing left to do (!for_input). */
+int filtergraph_thread_wait(FilterGraph *fg, int for_input)
+{
+    int ret;
+
+    pthread_mutex_lock(&fg->thread_lock);
+    while (fg->thread_ret >= 0 && !graph_thread_outputs_ready(fg) &&
+           (for_input ? av_fifo_space(fg->thread_queue) < sizeof(GraphThreadMsg) :
+                        av_fifo_size(fg->thread_queue) || fg->thread_busy))
+        pthread_cond_wait(&fg->thread_cond, &fg->thread_lock);
+    ret = fg->thread_ret;
+    pthread_mutex_unlock(&fg->thread_lock);
+
+    return ret;
+}
+#endif
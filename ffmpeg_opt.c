@@ -32,6 +32,7 @@
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
 #include "libavutil/avutil.h"
+#include "libavutil/bprint.h"
 #include "libavutil/channel_layout.h"
 #include "libavutil/intreadwrite.h"
 #include "libavutil/fifo.h"
@@ -86,6 +87,9 @@ const HWAccel hwaccels[] = {
 #endif
 #if CONFIG_CUVID
     { "cuvid", cuvid_init, HWACCEL_CUVID, AV_PIX_FMT_CUDA },
+#endif
+#if CONFIG_LIBXMAAPI
+    { "xma",   xma_init,   HWACCEL_XMA,   AV_PIX_FMT_XMA },
 #endif
     { 0 },
 };
@@ -122,7 +126,23 @@ float max_error_rate  = 2.0/3;
 int filter_nbthreads = 0;
 int filter_complex_nbthreads = 0;
 int vstats_version = 2;
+int enc_threads = 0;
+int enc_queue_size = 8;
+int graph_threads = 0;
+
 
+/* job of each complex filtergraph and of each output file, in the order they
+ * appear on the command line expanded by expand_jobs() */
+typedef struct JobSpan {
+    int job;            // 1 for the first job, 0 outside the jobs
+    int input_offset;   // first input file of the job
+    int nb_inputs;      // input files of the job
+} JobSpan;
+
+static JobSpan *job_graphs;
+static int   nb_job_graphs;
+static JobSpan *job_outputs;
+static int   nb_job_outputs;
 
 static int intra_only         = 0;
 static int file_overwrite     = 0;
@@ -463,6 +483,17 @@ static int opt_vaapi_device(void *optctx, const char *opt, const char *arg)
 }
 #endif
 
+#if CONFIG_LIBXMAAPI
+static int opt_xma_device(void *optctx, const char *opt, const char *arg)
+{
+    int err;
+    err = xma_device_init(arg);
+    if (err < 0)
+        exit_program(1);
+    return 0;
+}
+#endif
+
 /**
  * Parse a metadata specifier passed as 'arg' parameter.
  * @param arg  metadata string to parse
@@ -2024,6 +2055,7 @@ static int open_output_file(OptionsContext *o, const char *filename)
     AVDictionary *unused_opts = NULL;
     AVDictionaryEntry *e = NULL;
     int format_flags = 0;
+    int ist_first = 0, ist_end = nb_input_files;
 
     if (o->stop_time != INT64_MAX && o->recording_time != INT64_MAX) {
         o->stop_time = INT64_MAX;
@@ -2051,6 +2083,30 @@ static int open_output_file(OptionsContext *o, const char *filename)
     of->start_time     = o->start_time;
     of->limit_filesize = o->limit_filesize;
     of->shortest       = o->shortest;
+    of->mux_queue_size = o->mux_queue_size;
+    if (nb_output_files <= nb_job_outputs && job_outputs[nb_output_files - 1].job) {
+        /* the streams picked without -map come from the inputs of the job */
+        of->job = job_outputs[nb_output_files - 1].job;
+        ist_first = job_outputs[nb_output_files - 1].input_offset;
+        ist_end   = ist_first + job_outputs[nb_output_files - 1].nb_inputs;
+    }
+    if (o->mux_queue_policy) {
+        if (!strcmp(o->mux_queue_policy, "block"))
+            of->mux_queue_policy = MUX_QUEUE_BLOCK;
+        else if (!strcmp(o->mux_queue_policy, "drop"))
+            of->mux_queue_policy = MUX_QUEUE_DROP;
+        else if (!strcmp(o->mux_queue_policy, "disconnect"))
+            of->mux_queue_policy = MUX_QUEUE_DISCONNECT;
+        else {
+            av_log(NULL, AV_LOG_FATAL, "Invalid mux queue policy: %s\n",
+                   o->mux_queue_policy);
+            exit_program(1);
+        }
+    }
+#if !HAVE_PTHREADS
+    if (of->mux_queue_size > 0)
+        av_log(NULL, AV_LOG_WARNING, "-mux_queue_size needs threads, muxing inline\n");
+#endif
     av_dict_copy(&of->opts, o->g->format_opts, 0);
 
     if (!strcmp(filename, "-"))
@@ -2068,6 +2124,13 @@ static int open_output_file(OptionsContext *o, const char *filename)
 
     file_oformat= oc->oformat;
     oc->interrupt_callback = int_cb;
+#if HAVE_PTHREADS
+    /* a disconnected output must be able to interrupt its own I/O */
+    if (of->mux_queue_size > 0) {
+        oc->interrupt_callback.callback = mux_interrupt_cb;
+        oc->interrupt_callback.opaque   = of;
+    }
+#endif
 
     e = av_dict_get(o->g->format_opts, "fflags", NULL, 0);
     if (e) {
@@ -2144,6 +2207,8 @@ static int open_output_file(OptionsContext *o, const char *filename)
             for (i = 0; i < nb_input_streams; i++) {
                 int new_area;
                 ist = input_streams[i];
+                if (ist->file_index < ist_first || ist->file_index >= ist_end)
+                    continue;
                 new_area = ist->st->codecpar->width * ist->st->codecpar->height + 100000000*!!ist->st->codec_info_nb_frames;
                 if((qcr!=MKTAG('A', 'P', 'I', 'C')) && (ist->st->disposition & AV_DISPOSITION_ATTACHED_PIC))
                     new_area = 1;
@@ -2165,6 +2230,8 @@ static int open_output_file(OptionsContext *o, const char *filename)
             for (i = 0; i < nb_input_streams; i++) {
                 int score;
                 ist = input_streams[i];
+                if (ist->file_index < ist_first || ist->file_index >= ist_end)
+                    continue;
                 score = ist->st->codecpar->channels + 100000000*!!ist->st->codec_info_nb_frames;
                 if (ist->st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO &&
                     score > best_score) {
@@ -2180,7 +2247,9 @@ static int open_output_file(OptionsContext *o, const char *filename)
         MATCH_PER_TYPE_OPT(codec_names, str, subtitle_codec_name, oc, "s");
         if (!o->subtitle_disable && (avcodec_find_encoder(oc->oformat->subtitle_codec) || subtitle_codec_name)) {
             for (i = 0; i < nb_input_streams; i++)
-                if (input_streams[i]->st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+                if (input_streams[i]->st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE &&
+                    input_streams[i]->file_index >= ist_first &&
+                    input_streams[i]->file_index <  ist_end) {
                     AVCodecDescriptor const *input_descriptor =
                         avcodec_descriptor_get(input_streams[i]->st->codecpar->codec_id);
                     AVCodecDescriptor const *output_descriptor = NULL;
@@ -2209,7 +2278,9 @@ static int open_output_file(OptionsContext *o, const char *filename)
             enum AVCodecID codec_id = av_guess_codec(oc->oformat, NULL, filename, NULL, AVMEDIA_TYPE_DATA);
             for (i = 0; codec_id != AV_CODEC_ID_NONE && i < nb_input_streams; i++) {
                 if (input_streams[i]->st->codecpar->codec_type == AVMEDIA_TYPE_DATA
-                    && input_streams[i]->st->codecpar->codec_id == codec_id )
+                    && input_streams[i]->st->codecpar->codec_id == codec_id
+                    && input_streams[i]->file_index >= ist_first
+                    && input_streams[i]->file_index <  ist_end)
                     new_data_stream(o, oc, i);
             }
         }
@@ -3062,6 +3133,15 @@ static int opt_audio_qscale(void *optctx, const char *opt, const char *arg)
     return parse_option(o, "q:a", arg, options);
 }
 
+static void set_graph_job(FilterGraph *fg)
+{
+    if (fg->index < nb_job_graphs) {
+        fg->job              = job_graphs[fg->index].job;
+        fg->job_input_offset = job_graphs[fg->index].input_offset;
+        fg->job_nb_inputs    = job_graphs[fg->index].nb_inputs;
+    }
+}
+
 static int opt_filter_complex(void *optctx, const char *opt, const char *arg)
 {
     GROW_ARRAY(filtergraphs, nb_filtergraphs);
@@ -3071,6 +3151,7 @@ static int opt_filter_complex(void *optctx, const char *opt, const char *arg)
     filtergraphs[nb_filtergraphs - 1]->graph_desc = av_strdup(arg);
     if (!filtergraphs[nb_filtergraphs - 1]->graph_desc)
         return AVERROR(ENOMEM);
+    set_graph_job(filtergraphs[nb_filtergraphs - 1]);
 
     input_stream_potentially_available = 1;
 
@@ -3088,6 +3169,7 @@ static int opt_filter_complex_script(void *optctx, const char *opt, const char *
         return AVERROR(ENOMEM);
     filtergraphs[nb_filtergraphs - 1]->index      = nb_filtergraphs - 1;
     filtergraphs[nb_filtergraphs - 1]->graph_desc = graph_desc;
+    set_graph_job(filtergraphs[nb_filtergraphs - 1]);
 
     input_stream_potentially_available = 1;
 
@@ -3213,14 +3295,278 @@ static int open_files(OptionGroupList *l, const char *inout,
     return 0;
 }
 
+/* shift a leading file index in [-]N... by offset */
+static void job_shift_index(AVBPrint *bp, const char *arg, int offset)
+{
+    char *end;
+    long idx = strtol(arg, &end, 10);
+
+    if (end == arg || idx < 0)
+        av_bprintf(bp, "%s", arg);
+    else
+        av_bprintf(bp, "%ld%s", idx + offset, end);
+}
+
+static char *job_rewrite_arg(const char *opt, const char *arg, int job,
+                             int input_offset, int output_offset)
+{
+    AVBPrint bp;
+    char *ret;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    if (!strcmp(opt, "-map")) {
+        const char *sync = strchr(arg, ',');
+        int neg = *arg == '-';
+
+        /* the output labels of the graphs of a job get the same prefix,
+         * see init_complex_filtergraph() */
+        if (arg[neg] == '[') {
+            av_bprintf(&bp, "%.*s[job%d_%s", neg, arg, job, arg + neg + 1);
+        } else if (sync) {
+            char *src = av_strndup(arg + neg, sync - arg - neg);
+            if (src) {
+                av_bprintf(&bp, "%.*s", neg, arg);
+                job_shift_index(&bp, src, input_offset);
+                av_bprint_chars(&bp, ',', 1);
+                job_shift_index(&bp, sync + 1, input_offset);
+                av_free(src);
+            }
+        } else {
+            av_bprintf(&bp, "%.*s", neg, arg);
+            job_shift_index(&bp, arg + neg, input_offset);
+        }
+    } else if (!strcmp(opt, "-map_channel")) {
+        /* [file.stream.channel|-1][:out_file.out_stream] */
+        const char *out = strchr(arg, ':');
+        char *in = av_strndup(arg, out ? out - arg : strlen(arg));
+
+        if (in) {
+            if (strcmp(in, "-1"))
+                job_shift_index(&bp, in, input_offset);
+            else
+                av_bprintf(&bp, "%s", in);
+            if (out) {
+                av_bprint_chars(&bp, ':', 1);
+                job_shift_index(&bp, out + 1, output_offset);
+            }
+            av_free(in);
+        }
+    } else {
+        job_shift_index(&bp, arg, input_offset);
+    }
+    av_bprint_finalize(&bp, &ret);
+    return ret;
+}
+
+static int job_rewrites(const char *opt)
+{
+    return !strcmp(opt, "-map")             ||
+           !strncmp(opt, "-map_metadata", 13) ||
+           !strcmp(opt, "-map_chapters")    ||
+           !strcmp(opt, "-map_channel");
+}
+
+/* whether -opt takes an argument, as decided by split_commandline() */
+static int job_option_has_arg(const char *opt)
+{
+    const char *p = strchr(opt, ':');
+    int len = p ? p - opt : strlen(opt);
+    const OptionDef *po;
+
+    for (po = options; po->name; po++)
+        if (!strncmp(opt, po->name, len) && strlen(po->name) == len)
+            return !!(po->flags & (HAS_ARG | OPT_EXIT));
+
+    /* -nofoo for a boolean foo, anything else is an AVOption */
+    if (opt[0] == 'n' && opt[1] == 'o')
+        for (po = options; po->name; po++)
+            if (!strcmp(opt + 2, po->name))
+                return !(po->flags & OPT_BOOL);
+    return 1;
+}
+
+/**
+ * Follow one argument of the command line the way split_commandline() does,
+ * counting the input and output files and recording the job of each complex
+ * filtergraph and output file.
+ *
+ * @param popt the option waiting for its argument, updated
+ * @return the option arg is the argument of, NULL if it is not one
+ */
+static const char *job_scan_arg(const char **popt, const char *arg, int *nb_inputs,
+                                int job, int input_offset)
+{
+    const char *opt = *popt;
+
+    *popt = NULL;
+    if (opt) {
+        if (!strcmp(opt, "-i")) {
+            (*nb_inputs)++;
+        } else if (!strcmp(opt, "-filter_complex") || !strcmp(opt, "-lavfi") ||
+                   !strcmp(opt, "-filter_complex_script")) {
+            GROW_ARRAY(job_graphs, nb_job_graphs);
+            job_graphs[nb_job_graphs - 1].job          = job;
+            job_graphs[nb_job_graphs - 1].input_offset = input_offset;
+        }
+        return opt;
+    }
+
+    if (arg[0] != '-' || !arg[1]) {
+        GROW_ARRAY(job_outputs, nb_job_outputs);
+        job_outputs[nb_job_outputs - 1].job          = job;
+        job_outputs[nb_job_outputs - 1].input_offset = input_offset;
+    } else if (job_option_has_arg(arg + 1)) {
+        *popt = arg;
+    }
+    return NULL;
+}
+
+/**
+ * Insert the arguments of every job listed in the -jobs file, one job per
+ * line, after the -jobs option. The input and output file indexes of each job
+ * are renumbered here, and the labels of its filtergraphs when they are
+ * parsed, so that all jobs can share one transcoding session.
+ */
+static int expand_jobs(int *pargc, char **argv, char ***pargs,
+                       char ***pstrings, int *pnb_strings)
+{
+    char **out = NULL, **strings = NULL;
+    const char *opt = NULL;
+    int argc = *pargc, nb_out = 0, nb_strings = 0;
+    int i, jobs_idx = -1, nb_inputs = 0, job = 0, ret = 0;
+    JobSpan last = { 0 };
+    uint8_t *buf;
+    char *line, *saveptr = NULL;
+
+    for (i = 1; i < argc && jobs_idx < 0; i++) {
+        if (!opt && !strcmp(argv[i], "-jobs"))
+            jobs_idx = i;
+        else
+            job_scan_arg(&opt, argv[i], &nb_inputs, 0, 0);
+    }
+    if (jobs_idx < 0)
+        goto done;
+    if (jobs_idx + 1 >= argc) {
+        av_log(NULL, AV_LOG_FATAL, "Missing argument for option 'jobs'.\n");
+        return AVERROR(EINVAL);
+    }
+
+    buf = read_file(argv[jobs_idx + 1]);
+    if (!buf)
+        return AVERROR(EINVAL);
+
+    for (i = 0; i < jobs_idx + 2; i++) {
+        GROW_ARRAY(out, nb_out);
+        out[nb_out - 1] = argv[i];
+    }
+
+    for (line = av_strtok(buf, "\r\n", &saveptr); line;
+         line = av_strtok(NULL, "\r\n", &saveptr)) {
+        const char *p = line;
+        int input_offset = nb_inputs, output_offset = nb_job_outputs;
+
+        p += strspn(p, " \t");
+        if (!*p || *p == '#')
+            continue;
+        job++;
+
+        while (*p) {
+            const char *arg_of;
+            char *tok = av_get_token(&p, " \t");
+            if (!tok) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            arg_of = job_scan_arg(&opt, tok, &nb_inputs, job, input_offset);
+            if (arg_of && job_rewrites(arg_of)) {
+                char *arg = job_rewrite_arg(arg_of, tok, job, input_offset, output_offset);
+                av_free(tok);
+                if (!(tok = arg)) {
+                    ret = AVERROR(ENOMEM);
+                    goto fail;
+                }
+            } else if (!arg_of && !strcmp(tok, "-jobs")) {
+                av_log(NULL, AV_LOG_FATAL, "Job %d: -jobs cannot be nested.\n", job);
+                av_free(tok);
+                ret = AVERROR(EINVAL);
+                goto fail;
+            }
+            GROW_ARRAY(strings, nb_strings);
+            strings[nb_strings - 1] = tok;
+            GROW_ARRAY(out, nb_out);
+            out[nb_out - 1] = tok;
+            p += strspn(p, " \t");
+        }
+        for (i = 0; i < nb_job_graphs; i++)
+            if (job_graphs[i].job == job)
+                job_graphs[i].nb_inputs = nb_inputs - input_offset;
+        for (i = 0; i < nb_job_outputs; i++)
+            if (job_outputs[i].job == job)
+                job_outputs[i].nb_inputs = nb_inputs - input_offset;
+        last.job          = job;
+        last.input_offset = input_offset;
+        last.nb_inputs    = nb_inputs - input_offset;
+        av_log(NULL, AV_LOG_VERBOSE, "Job %d: %d input(s) starting at input file #%d.\n",
+               job, nb_inputs - input_offset, input_offset);
+    }
+    if (!job)
+        av_log(NULL, AV_LOG_WARNING, "No jobs found in %s.\n", argv[jobs_idx + 1]);
+
+    /* the rest of the command line is not renumbered, but its outputs
+     * complete the last job */
+    for (i = jobs_idx + 2; i < argc; i++) {
+        int nb_outputs = nb_job_outputs;
+
+        job_scan_arg(&opt, argv[i], &nb_inputs, 0, 0);
+        if (job && nb_job_outputs > nb_outputs)
+            job_outputs[nb_outputs] = last;
+        GROW_ARRAY(out, nb_out);
+        out[nb_out - 1] = argv[i];
+    }
+
+    /* the parser expects argv[argc] to be valid */
+    GROW_ARRAY(out, nb_out);
+    out[--nb_out] = NULL;
+
+    *pargc       = nb_out;
+    *pargs       = out;
+    *pstrings    = strings;
+    *pnb_strings = nb_strings;
+    av_free(buf);
+done:
+    /* without jobs, nothing is renumbered */
+    if (!job) {
+        av_freep(&job_graphs);
+        av_freep(&job_outputs);
+        nb_job_graphs = nb_job_outputs = 0;
+    }
+    return 0;
+fail:
+    for (i = 0; i < nb_strings; i++)
+        av_free(strings[i]);
+    av_free(strings);
+    av_free(out);
+    av_free(buf);
+    return ret;
+}
+
 int ffmpeg_parse_options(int argc, char **argv)
 {
     OptionParseContext octx;
     uint8_t error[128];
+    char **job_args = NULL, **job_strings = NULL;
+    int i, nb_job_strings = 0;
     int ret;
 
     memset(&octx, 0, sizeof(octx));
 
+    /* merge the jobs of a job file into this command line */
+    ret = expand_jobs(&argc, argv, &job_args, &job_strings, &nb_job_strings);
+    if (ret < 0)
+        goto fail;
+    if (job_args)
+        argv = job_args;
+
     /* split the commandline into an internal representation */
     ret = split_commandline(&octx, argc, argv, options, groups,
                             FF_ARRAY_ELEMS(groups));
@@ -3236,6 +3582,13 @@ int ffmpeg_parse_options(int argc, char **argv)
         goto fail;
     }
 
+#if CONFIG_LIBXMAAPI
+    /* the XMA decoders may already be opened while probing the inputs */
+    ret = xma_setup();
+    if (ret < 0)
+        goto fail;
+#endif
+
     /* configure terminal and setup signal handlers */
     term_init();
 
@@ -3264,6 +3617,13 @@ int ffmpeg_parse_options(int argc, char **argv)
 
 fail:
     uninit_parse_context(&octx);
+    av_freep(&job_graphs);
+    av_freep(&job_outputs);
+    nb_job_graphs = nb_job_outputs = 0;
+    for (i = 0; i < nb_job_strings; i++)
+        av_free(job_strings[i]);
+    av_free(job_strings);
+    av_free(job_args);
     if (ret < 0) {
         av_strerror(ret, error, sizeof(error));
         av_log(NULL, AV_LOG_FATAL, "%s\n", error);
@@ -3271,6 +3631,12 @@ fail:
     return ret;
 }
 
+static int opt_jobs(void *optctx, const char *opt, const char *arg)
+{
+    /* the job file has already been merged into the command line */
+    return 0;
+}
+
 static int opt_progress(void *optctx, const char *opt, const char *arg)
 {
     AVIOContext *avio = NULL;
@@ -3430,6 +3796,14 @@ const OptionDef options[] = {
         "set stream filtergraph", "filter_graph" },
     { "filter_threads",  HAS_ARG | OPT_INT,                          { &filter_nbthreads },
         "number of non-complex filter threads" },
+    { "enc_threads",    OPT_BOOL | OPT_EXPERT,                       { &enc_threads },
+        "run each audio and video encoder in its own thread" },
+    { "enc_queue_size", HAS_ARG | OPT_INT | OPT_EXPERT,                { &enc_queue_size },
+        "set the maximum number of frames queued to an encoder thread", "size" },
+    { "graph_threads",  OPT_BOOL | OPT_EXPERT,                       { &graph_threads },
+        "run each filtergraph in its own thread" },
+    { "jobs",           HAS_ARG | OPT_EXPERT,                        { .func_arg = opt_jobs },
+        "run the jobs listed in a file, one per line, in this process", "filename" },
     { "filter_script",  HAS_ARG | OPT_STRING | OPT_SPEC | OPT_OUTPUT, { .off = OFFSET(filter_scripts) },
         "read stream filtergraph description from a file", "filename" },
     { "reinit_filter",  HAS_ARG | OPT_INT | OPT_SPEC | OPT_INPUT,    { .off = OFFSET(reinit_filters) },
@@ -3622,6 +3996,10 @@ const OptionDef options[] = {
         "set the maximum demux-decode delay", "seconds" },
     { "muxpreload", OPT_FLOAT | HAS_ARG | OPT_EXPERT | OPT_OFFSET | OPT_OUTPUT, { .off = OFFSET(mux_preload) },
         "set the initial demux-decode delay", "seconds" },
+    { "mux_queue_size", HAS_ARG | OPT_INT | OPT_EXPERT | OPT_OFFSET | OPT_OUTPUT, { .off = OFFSET(mux_queue_size) },
+        "mux in a thread of its own, with up to this many packets queued", "packets" },
+    { "mux_queue_policy", HAS_ARG | OPT_STRING | OPT_EXPERT | OPT_OFFSET | OPT_OUTPUT, { .off = OFFSET(mux_queue_policy) },
+        "what to do when the mux queue is full: block, drop or disconnect", "policy" },
     { "override_ffserver", OPT_BOOL | OPT_EXPERT | OPT_OUTPUT, { &override_ffserver },
         "override the options from ffserver", "" },
     { "sdp_file", HAS_ARG | OPT_EXPERT | OPT_OUTPUT, { .func_arg = opt_sdp_file },
@@ -3660,6 +4038,13 @@ const OptionDef options[] = {
         "set VAAPI hardware device (DRM path or X11 display name)", "device" },
 #endif
 
+#if CONFIG_LIBXMAAPI
+    { "xma_device", HAS_ARG | OPT_EXPERT, { .func_arg = opt_xma_device },
+        "set XMA hardware device (comma-separated card indices)", "devices" },
+    { "xma_cfg", HAS_ARG | OPT_STRING | OPT_EXPERT, { &xma_cfg },
+        "set XMA configuration file", "file" },
+#endif
+
 #if CONFIG_QSV
     { "qsv_device", HAS_ARG | OPT_STRING | OPT_EXPERT, { &qsv_device },
         "set QSV hardware device (DirectX adapter index, DRM path or X11 display name)", "device"},
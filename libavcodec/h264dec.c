@@ -54,6 +54,7 @@
 #include "rectangle.h"
 #include "thread.h"
 #include "vdpau_compat.h"
+#include "xma_h264.h"
 
 static int h264_decode_end(AVCodecContext *avctx);
 
@@ -995,8 +996,14 @@ static int h264_decode_frame(AVCodecContext *avctx, void *data,
     ff_h264_unref_picture(h, &h->last_pic_for_ec);
 
     /* end of stream, output what is still in the buffers */
-    if (buf_size == 0)
+    if (buf_size == 0) {
+#if CONFIG_H264_XMA_HWACCEL
+        if (avctx->hwaccel && avctx->hwaccel->pix_fmt == AV_PIX_FMT_XMA &&
+            (ret = ff_xma_h264_flush(avctx)) < 0)
+            return ret;
+#endif
         return send_next_delayed_frame(h, pict, got_frame, 0);
+    }
 
     if (h->is_avc && av_packet_get_side_data(avpkt, AV_PKT_DATA_NEW_EXTRADATA, NULL)) {
         int side_size;
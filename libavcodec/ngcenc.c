@@ -0,0 +1,537 @@
+/*
+ * NGCodec XMA encoders, shared code
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <inttypes.h>
+
+#include "libavutil/common.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/log.h"
+#include "libavutil/mem.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
+
+#include "internal.h"
+#include "ngcenc.h"
+
+/* first sleep of the back-off, doubled on every further sleep */
+#define NGC_MIN_SLEEP 50
+
+int ff_ngcenc_recv_data(NGCWait *w, XmaEncoderSession *session,
+                        XmaDataBuffer *buf, int32_t *size)
+{
+    int64_t start = 0;
+    int delay = FFMIN(NGC_MIN_SLEEP, w->max_sleep);
+    int polls = 0;
+    int rc;
+
+    for (;;) {
+        *size = 0;
+        rc = xma_enc_session_recv_data(session, buf, size);
+        if (*size > 0 || (rc != XMA_SUCCESS && rc != XMA_TRY_AGAIN))
+            break;
+
+        if (!polls++) {
+            start = av_gettime_relative();
+            w->waits++;
+        }
+        w->polls++;
+
+        if (w->mode == NGC_WAIT_SLEEP && polls > w->spin) {
+            av_usleep(delay);
+            delay = FFMIN(delay * 2, w->max_sleep);
+            w->sleeps++;
+        }
+    }
+
+    if (polls)
+        w->wait_time += av_gettime_relative() - start;
+    return rc;
+}
+
+void ff_ngcenc_log_wait_stats(AVCodecContext *avctx, const NGCWait *w)
+{
+    av_log(avctx, AV_LOG_VERBOSE,
+           "waited %.3f s for the card over %"PRId64" waits "
+           "(%"PRId64" polls, %"PRId64" sleeps)\n",
+           w->wait_time / 1000000.0, w->waits, w->polls, w->sleeps);
+}
+
+int ff_ngcenc_init(AVCodecContext *avctx, NGCEnc *enc,
+                   XmaEncoderProperties *props, int out_size)
+{
+    XmaFrameProperties fprops = {
+        .format         = XMA_YUV420_FMT_TYPE,
+        .width          = avctx->width,
+        .height         = avctx->height,
+        .bits_per_pixel = 8,
+    };
+    XmaFrameData frame_data;
+    int i, ret;
+
+    if (avctx->pix_fmt == AV_PIX_FMT_XMA) {
+        AVHWFramesContext *frames_ctx;
+
+        if (!avctx->hw_frames_ctx) {
+            av_log(avctx, AV_LOG_ERROR, "XMA frames require a hw_frames_ctx\n");
+            return AVERROR(EINVAL);
+        }
+        frames_ctx = (AVHWFramesContext *)avctx->hw_frames_ctx->data;
+        if (frames_ctx->sw_format != AV_PIX_FMT_YUV420P) {
+            av_log(avctx, AV_LOG_ERROR, "Unsupported XMA surface format %s\n",
+                   av_get_pix_fmt_name(frames_ctx->sw_format));
+            return AVERROR(ENOSYS);
+        }
+    }
+
+    enc->depth = FFMAX(props->lookahead_depth, 1);
+
+    /* only HEVC has B-frames, the card codes them after their next anchor */
+    if (avctx->codec_id == AV_CODEC_ID_HEVC && avctx->max_b_frames > 0) {
+#if HAVE_XMAENCODERPROPERTIES_NUM_B_FRAMES
+        enc->reorder = FFMIN(avctx->max_b_frames, enc->depth - 1);
+#else
+        av_log(avctx, AV_LOG_WARNING,
+               "The XMA library cannot enable B-frames, encoding without them\n");
+#endif
+    }
+#if HAVE_XMAENCODERPROPERTIES_NUM_B_FRAMES
+    props->num_b_frames = enc->reorder;
+#endif
+    avctx->has_b_frames = enc->reorder;
+
+    /* the pts of the last reorder packets returned stay queued for the dts */
+    enc->pts_fifo = av_fifo_alloc((enc->depth + enc->reorder) * sizeof(int64_t));
+    if (!enc->pts_fifo)
+        return AVERROR(ENOMEM);
+    enc->frame_fifo = av_fifo_alloc(enc->depth * sizeof(AVFrame *));
+    if (!enc->frame_fifo)
+        return AVERROR(ENOMEM);
+
+    /* the card takes planes without padding between lines */
+    enc->tmp_frame = av_frame_alloc();
+    if (!enc->tmp_frame)
+        return AVERROR(ENOMEM);
+    enc->tmp_frame->width  = avctx->width;
+    enc->tmp_frame->height = avctx->height;
+    enc->tmp_frame->format = AV_PIX_FMT_YUV420P;
+    ret = av_frame_get_buffer(enc->tmp_frame, 1);
+    if (ret < 0)
+        return ret;
+    for (i = 0; i < 3; i++)
+        frame_data.data[i] = enc->tmp_frame->data[i];
+
+    enc->in_frame = xma_frame_from_buffers_clone(&fprops, &frame_data);
+    if (!enc->in_frame)
+        return AVERROR(ENOMEM);
+    enc->in_frame->is_idr                = 0;
+    enc->in_frame->do_not_encode         = 0;
+    enc->in_frame->is_last_frame         = 0;
+    enc->in_frame->time_base.numerator   = avctx->time_base.num;
+    enc->in_frame->time_base.denominator = avctx->time_base.den;
+
+    frame_data.data[0] = frame_data.data[1] = frame_data.data[2] = NULL;
+    enc->eos_frame = xma_frame_from_buffers_clone(&fprops, &frame_data);
+    if (!enc->eos_frame)
+        return AVERROR(ENOMEM);
+    enc->eos_frame->is_idr        = 0;
+    enc->eos_frame->do_not_encode = 1;
+
+    enc->out_size = out_size;
+    enc->out_pool = av_buffer_pool_init2(out_size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                         &enc->stats, avpriv_xma_stats_alloc, NULL);
+    if (!enc->out_pool)
+        return AVERROR(ENOMEM);
+    /* the data pointer is set before every receive */
+    enc->out_buf = xma_data_from_buffer_clone(enc->tmp_frame->data[0], out_size);
+    if (!enc->out_buf)
+        return AVERROR(ENOMEM);
+
+    ret = avpriv_xma_session_acquire(avctx, &enc->slot, enc->device,
+                                     avpriv_xma_session_load(props->width, props->height,
+                                                             (AVRational){ props->framerate.numerator,
+                                                                           props->framerate.denominator }));
+    if (ret < 0)
+        return ret;
+#if HAVE_XMAENCODERPROPERTIES_DEV_INDEX
+    props->dev_index = enc->slot.device;
+#endif
+
+    enc->session = xma_enc_session_create(props);
+    if (!enc->session) {
+        av_log(avctx, AV_LOG_ERROR, "Unable to create the encoder session\n");
+        return AVERROR_EXTERNAL;
+    }
+
+    enc->props    = *props;
+    enc->base_qp  = props->qp;
+    enc->bit_rate = avctx->bit_rate;
+    enc->gop_size = avctx->gop_size;
+    return 0;
+}
+
+#if HAVE_XMA_ENC_SESSION_RECONFIGURE
+static int resize_buffers(AVCodecContext *avctx, NGCEnc *enc, int width, int height)
+{
+    int out_size = av_rescale(enc->out_size, (int64_t)width * height,
+                              (int64_t)enc->props.width * enc->props.height);
+    int ret;
+
+    av_frame_unref(enc->tmp_frame);
+    enc->tmp_frame->width  = width;
+    enc->tmp_frame->height = height;
+    enc->tmp_frame->format = AV_PIX_FMT_YUV420P;
+    ret = av_frame_get_buffer(enc->tmp_frame, 1);
+    if (ret < 0)
+        return ret;
+    ff_xma_stats_add(&enc->stats.allocs, 1);
+
+    enc->in_frame->frame_props.width   = enc->eos_frame->frame_props.width  = width;
+    enc->in_frame->frame_props.height  = enc->eos_frame->frame_props.height = height;
+
+    if (out_size > enc->out_size) {
+        /* packets still held by the caller keep the old pool alive */
+        av_buffer_pool_uninit(&enc->out_pool);
+        enc->out_pool = av_buffer_pool_init2(out_size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                             &enc->stats, avpriv_xma_stats_alloc, NULL);
+        if (!enc->out_pool)
+            return AVERROR(ENOMEM);
+        enc->out_size            = out_size;
+        enc->out_buf->alloc_size = out_size;
+    }
+    return 0;
+}
+#endif
+
+/* bring the session in line with the codec context and the next frame */
+static int reconfigure(AVCodecContext *avctx, NGCEnc *enc, const AVFrame *pic,
+                       int width, int height)
+{
+    XmaEncoderProperties props = enc->props;
+
+    if (avctx->bit_rate != enc->bit_rate)
+        props.bitrate = avctx->bit_rate;
+    if (avctx->gop_size != enc->gop_size && avctx->gop_size > 0)
+        props.gop_size = avctx->gop_size;
+    props.qp     = pic->quality > 0 ? av_clip(pic->quality / FF_QP2LAMBDA, 0, 51)
+                                    : enc->base_qp;
+    props.width  = width;
+    props.height = height;
+    enc->bit_rate = avctx->bit_rate;
+    enc->gop_size = avctx->gop_size;
+
+    if (props.bitrate  == enc->props.bitrate  && props.qp     == enc->props.qp &&
+        props.gop_size == enc->props.gop_size &&
+        props.width    == enc->props.width    && props.height == enc->props.height)
+        return 0;
+
+#if HAVE_XMA_ENC_SESSION_RECONFIGURE
+    if (props.width != enc->props.width || props.height != enc->props.height) {
+        int ret;
+
+        av_log(avctx, AV_LOG_VERBOSE, "Picture size changed from %dx%d to %dx%d\n",
+               enc->props.width, enc->props.height, width, height);
+        ret = resize_buffers(avctx, enc, width, height);
+        if (ret < 0)
+            return ret;
+    }
+    if (xma_enc_session_reconfigure(enc->session, &props) != XMA_SUCCESS) {
+        av_log(avctx, AV_LOG_ERROR, "Error reconfiguring the encoder session\n");
+        return AVERROR_EXTERNAL;
+    }
+    av_log(avctx, AV_LOG_DEBUG, "Session set to %dx%d, %d bps, qp %d, gop %d\n",
+           props.width, props.height, props.bitrate, props.qp, props.gop_size);
+    enc->props = props;
+    return 0;
+#else
+    if (props.width != enc->props.width || props.height != enc->props.height) {
+        av_log(avctx, AV_LOG_ERROR, "Picture size changed from %dx%d to %dx%d, "
+               "the XMA library cannot reconfigure a running session\n",
+               enc->props.width, enc->props.height, width, height);
+        return AVERROR(ENOSYS);
+    }
+    if (!enc->reconf_warned++)
+        av_log(avctx, AV_LOG_WARNING, "The XMA library cannot reconfigure a "
+               "running session, bitrate, gop and qp changes are ignored\n");
+    enc->props = props;
+    return 0;
+#endif
+}
+
+/* drop the reference to the oldest frame in flight, or to all of them */
+static void release_frames(NGCEnc *enc, int all)
+{
+    AVFrame *ref;
+
+    while (av_fifo_size(enc->frame_fifo) >= sizeof(ref)) {
+        av_fifo_generic_read(enc->frame_fifo, &ref, sizeof(ref), NULL);
+        av_frame_free(&ref);
+        if (!all)
+            break;
+    }
+}
+
+int ff_ngcenc_send_frame(AVCodecContext *avctx, NGCEnc *enc, const AVFrame *pic)
+{
+    XmaFrame *frame = enc->in_frame;
+    XmaFrame surface;
+    AVFrame *ref = NULL;
+    int64_t start;
+    int i, ret, rc;
+
+    if (!pic) {
+        /* the card is flushed from ff_ngcenc_receive_packet() */
+        enc->draining = 1;
+        return 0;
+    }
+    if (enc->in_flight >= enc->depth)
+        return AVERROR(EAGAIN);
+
+    if (pic->format == AV_PIX_FMT_XMA) {
+        /* the frame already lives in a card buffer, send it as it is; the
+         * buffer may feed several encoders, so the flags are set on a copy
+         * of its header rather than on the shared XmaFrame */
+        surface = *(XmaFrame *)pic->data[3];
+        frame   = &surface;
+        ret = reconfigure(avctx, enc, pic, frame->frame_props.width,
+                          frame->frame_props.height);
+        if (ret < 0)
+            return ret;
+        frame->do_not_encode = 0;
+        frame->is_last_frame = 0;
+        frame->time_base     = enc->in_frame->time_base;
+    } else {
+        ret = reconfigure(avctx, enc, pic, pic->width, pic->height);
+        if (ret < 0)
+            return ret;
+        for (i = 0; i < 3; i++) {
+            int width  = i ? AV_CEIL_RSHIFT(pic->width,  1) : pic->width;
+            int height = i ? AV_CEIL_RSHIFT(pic->height, 1) : pic->height;
+
+            if (pic->linesize[i] != width) {
+                av_image_copy_plane(enc->tmp_frame->data[i], enc->tmp_frame->linesize[i],
+                                    pic->data[i], pic->linesize[i], width, height);
+                frame->data[i].buffer = enc->tmp_frame->data[i];
+                ff_xma_stats_add(&enc->stats.copy_bytes, width * height);
+            } else {
+                frame->data[i].buffer = pic->data[i];
+            }
+            ff_xma_stats_add(&enc->stats.xfer_bytes, width * height);
+        }
+    }
+    frame->is_idr = pic->pict_type == AV_PICTURE_TYPE_I;
+    frame->pts    = pic->pts;
+
+    /* the card reads the surface until the packet comes back */
+    if (pic->format == AV_PIX_FMT_XMA && !(ref = av_frame_clone(pic)))
+        return AVERROR(ENOMEM);
+
+    start = av_gettime_relative();
+    rc = xma_enc_session_send_frame(enc->session, frame);
+    ff_xma_stats_add(&enc->stats.send_time, av_gettime_relative() - start);
+    if (rc == XMA_ERROR) {
+        av_log(avctx, AV_LOG_ERROR, "Error sending a frame to the card\n");
+        av_frame_free(&ref);
+        return AVERROR_EXTERNAL;
+    }
+
+    av_fifo_generic_write(enc->pts_fifo, (void *)&pic->pts, sizeof(pic->pts), NULL);
+    av_fifo_generic_write(enc->frame_fifo, &ref, sizeof(ref), NULL);
+    enc->in_flight++;
+    ff_xma_stats_add(&enc->stats.frames, 1);
+    ff_xma_stats_set(&enc->stats.in_flight, enc->in_flight);
+    return 0;
+}
+
+static int send_flush(NGCEnc *enc)
+{
+    int64_t start = av_gettime_relative();
+    int rc;
+
+    enc->eos_frame->is_last_frame = !enc->flush_sent;
+    rc = xma_enc_session_send_frame(enc->session, enc->eos_frame);
+    ff_xma_stats_add(&enc->stats.send_time, av_gettime_relative() - start);
+    enc->flush_sent = 1;
+    return rc == XMA_ERROR ? AVERROR_EXTERNAL : 0;
+}
+
+/* keyframes are told from the bitstream, so segmenters can cut on the flag */
+static int is_keyframe(AVCodecContext *avctx, const uint8_t *buf, int size)
+{
+    const uint8_t *p = buf, *end = buf + size;
+    uint32_t state = -1;
+
+    switch (avctx->codec_id) {
+    case AV_CODEC_ID_HEVC:
+        while (p < end) {
+            int type;
+
+            p = avpriv_find_start_code(p, end, &state);
+            if ((state & 0xffffff00) != 0x100)
+                break;
+            type = (state >> 1) & 0x3f;
+
+            /* IRAP pictures: BLA, IDR and CRA */
+            if (type >= 16 && type <= 23)
+                return 1;
+            /* any other VCL NAL unit decides for the whole access unit */
+            if (type < 32)
+                return 0;
+        }
+        return 0;
+    case AV_CODEC_ID_VP9: {
+        int profile, shift;
+
+        if (size < 1 || (buf[0] >> 6) != 2)
+            return 0;
+        profile = ((buf[0] >> 5) & 1) | ((buf[0] >> 3) & 2);
+        shift   = profile == 3 ? 1 : 0;
+        /* show_existing_frame repeats a decoded frame, frame_type 0 is key */
+        if ((buf[0] >> (3 - shift)) & 1)
+            return 0;
+        return !((buf[0] >> (2 - shift)) & 1);
+    }
+    default:
+        return 0;
+    }
+}
+
+/* dts of one of the first reorder packets: before the first input pts,
+ * spaced like the first inputs */
+static int64_t initial_dts(NGCEnc *enc, int n)
+{
+    int count = FFMIN(av_fifo_size(enc->pts_fifo) / sizeof(int64_t), enc->reorder + 1);
+    int64_t first, last, step = 1;
+
+    if (!count)
+        return AV_NOPTS_VALUE;
+    av_fifo_generic_peek_at(enc->pts_fifo, &first, 0, sizeof(first), NULL);
+    av_fifo_generic_peek_at(enc->pts_fifo, &last, (count - 1) * sizeof(last),
+                            sizeof(last), NULL);
+    if (first == AV_NOPTS_VALUE || last == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+    if (count > 1)
+        step = FFMAX((last - first) / (count - 1), 1);
+    return first - (enc->reorder - n) * step;
+}
+
+int ff_ngcenc_receive_packet(AVCodecContext *avctx, NGCEnc *enc, AVPacket *pkt)
+{
+    AVBufferRef *buf;
+    int32_t size = 0;
+    int64_t dts, start;
+    int ret, rc;
+
+    if (enc->eof)
+        return AVERROR_EOF;
+    if (!enc->draining && !enc->in_flight)
+        return AVERROR(EAGAIN);
+
+    if (enc->draining) {
+        if (!enc->in_flight) {
+            enc->eof = 1;
+            release_frames(enc, 1);
+            return AVERROR_EOF;
+        }
+        /* the card expects a marker for every packet it flushes */
+        ret = send_flush(enc);
+        if (ret < 0)
+            return ret;
+    }
+
+    buf = av_buffer_pool_get(enc->out_pool);
+    if (!buf)
+        return AVERROR(ENOMEM);
+    enc->out_buf->data.buffer = buf->data;
+    enc->out_buf->pts         = AV_NOPTS_VALUE;
+
+    start = av_gettime_relative();
+    if (enc->draining || enc->in_flight >= enc->depth)
+        rc = ff_ngcenc_recv_data(&enc->wait, enc->session, enc->out_buf, &size);
+    else
+        rc = xma_enc_session_recv_data(enc->session, enc->out_buf, &size);
+    ff_xma_stats_add(&enc->stats.recv_time, av_gettime_relative() - start);
+
+    if (rc != XMA_SUCCESS && rc != XMA_TRY_AGAIN && rc != XMA_SEND_MORE_DATA &&
+        rc != XMA_EOS) {
+        av_log(avctx, AV_LOG_ERROR, "Error receiving data from the card\n");
+        av_buffer_unref(&buf);
+        return AVERROR_EXTERNAL;
+    }
+    if (enc->draining && (enc->out_buf->is_eof || rc == XMA_EOS)) {
+        enc->eof = 1;
+        release_frames(enc, 1);
+    }
+
+    if (size <= 0) {
+        av_buffer_unref(&buf);
+        return enc->eof ? AVERROR_EOF : AVERROR(EAGAIN);
+    }
+
+    memset(buf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    pkt->buf  = buf;
+    pkt->data = buf->data;
+    pkt->size = size;
+
+    /* packets leave the card in coding order: the dts of a packet is the
+     * pts of the input sent reorder frames before it, so that no dts
+     * exceeds its pts; the card returns the pts itself */
+    if (enc->nb_packets < enc->reorder) {
+        dts = initial_dts(enc, enc->nb_packets);
+    } else {
+        dts = AV_NOPTS_VALUE;
+        if (av_fifo_size(enc->pts_fifo) >= sizeof(dts))
+            av_fifo_generic_read(enc->pts_fifo, &dts, sizeof(dts), NULL);
+    }
+    enc->nb_packets++;
+    pkt->pts = enc->out_buf->pts != AV_NOPTS_VALUE ? enc->out_buf->pts : dts;
+    pkt->dts = dts;
+
+    if (is_keyframe(avctx, pkt->data, pkt->size))
+        pkt->flags |= AV_PKT_FLAG_KEY;
+
+    release_frames(enc, 0);
+    enc->in_flight = FFMAX(enc->in_flight - 1, 0);
+    ff_xma_stats_set(&enc->stats.in_flight, enc->in_flight);
+    ff_xma_stats_add(&enc->stats.xfer_bytes, size);
+    return 0;
+}
+
+void ff_ngcenc_close(AVCodecContext *avctx, NGCEnc *enc)
+{
+    ff_ngcenc_log_wait_stats(avctx, &enc->wait);
+
+    if (enc->session)
+        xma_enc_session_destroy(enc->session);
+    enc->session = NULL;
+    if (enc->frame_fifo)
+        release_frames(enc, 1);
+    av_fifo_freep(&enc->frame_fifo);
+    avpriv_xma_session_release(&enc->slot);
+    xma_data_buffer_free(enc->out_buf);
+    enc->out_buf = NULL;
+    xma_frame_free(enc->in_frame);
+    enc->in_frame = NULL;
+    xma_frame_free(enc->eos_frame);
+    enc->eos_frame = NULL;
+    av_buffer_pool_uninit(&enc->out_pool);
+    av_frame_free(&enc->tmp_frame);
+    av_fifo_freep(&enc->pts_fifo);
+}
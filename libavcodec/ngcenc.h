@@ -0,0 +1,162 @@
+/*
+ * NGCodec XMA encoders, shared code
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVCODEC_NGCENC_H
+#define AVCODEC_NGCENC_H
+
+#include <stdint.h>
+
+#include "xma.h"
+
+#include "libavutil/buffer.h"
+#include "libavutil/fifo.h"
+#include "libavutil/frame.h"
+#include "libavutil/hwcontext_xma_internal.h"
+
+#include "avcodec.h"
+
+enum NGCWaitMode {
+    NGC_WAIT_SPIN,      ///< poll the session back to back
+    NGC_WAIT_SLEEP,     ///< poll wait_spin times, then back off with sleeps
+};
+
+/**
+ * How an encoder waits for the card to return a packet, and how long it
+ * has spent doing so. The policy fields are AVOptions of the encoder.
+ */
+typedef struct NGCWait {
+    int mode;
+    int spin;           ///< polls before the first sleep
+    int max_sleep;      ///< upper bound of the back-off, in microseconds
+
+    int64_t wait_time;  ///< total time spent waiting, in microseconds
+    int64_t waits;      ///< number of receive calls that had to wait
+    int64_t polls;      ///< xma_enc_session_recv_data() calls while waiting
+    int64_t sleeps;
+} NGCWait;
+
+#define NGC_WAIT_OPTIONS(ctx, field, flags)                                                                                      \
+    { "wait-mode",      "How to wait for encoded data",      offsetof(ctx, field.mode),      AV_OPT_TYPE_INT, { .i64 = NGC_WAIT_SLEEP }, NGC_WAIT_SPIN, NGC_WAIT_SLEEP, flags, "wait_mode" }, \
+    { "spin",           "Poll without sleeping",             0,                              AV_OPT_TYPE_CONST, { .i64 = NGC_WAIT_SPIN },  0, 0, flags, "wait_mode" },                 \
+    { "sleep",          "Poll, then sleep with back-off",    0,                              AV_OPT_TYPE_CONST, { .i64 = NGC_WAIT_SLEEP }, 0, 0, flags, "wait_mode" },                 \
+    { "wait-spin",      "Polls before sleeping",             offsetof(ctx, field.spin),      AV_OPT_TYPE_INT, { .i64 = 64 },   0, INT_MAX, flags },                                   \
+    { "wait-max-sleep", "Longest sleep between polls (us)",  offsetof(ctx, field.max_sleep), AV_OPT_TYPE_INT, { .i64 = 1000 }, 1, 1000000, flags }
+
+#define NGC_DEVICE_OPTIONS(ctx, field, flags)                                                                                    \
+    { "xma-device",     "Card to encode on (-1 for the least loaded)", offsetof(ctx, field), AV_OPT_TYPE_INT, { .i64 = -1 }, -1, INT_MAX, flags }
+
+/**
+ * State of one encoder session driven through the send_frame/receive_packet
+ * API. Up to depth frames are kept in flight on the card, so that input is
+ * uploaded while earlier packets are drained.
+ */
+typedef struct NGCEnc {
+    XmaEncoderSession *session;
+    NGCWait        wait;
+    XMAStats       stats;       ///< exported through XMA_STATS_OPTIONS
+    int            device;      ///< card requested by the user, -1 for any
+    XMASlot        slot;        ///< card and channel the session was placed on
+
+    int            depth;       ///< frames the card holds before it returns a packet
+    int            reorder;     ///< B-frames the card codes after their anchor, delays the dts
+    int64_t        nb_packets;  ///< packets returned so far
+    int            in_flight;   ///< frames sent whose packet was not received yet
+    int            draining;    ///< a NULL frame was sent, no more input follows
+    int            flush_sent;  ///< the end of stream marker was sent to the card
+    int            eof;         ///< the card returned its last packet
+
+    AVFifoBuffer  *pts_fifo;    ///< pts of the frames in flight, in send order
+    AVFifoBuffer  *frame_fifo;  ///< AV_PIX_FMT_XMA frames in flight (NULL for others), in send order
+    AVFrame       *tmp_frame;   ///< input planes repacked to the width of the picture
+    XmaFrame      *in_frame;    ///< reused for every input, pointed at its planes
+    XmaFrame      *eos_frame;   ///< end of stream marker
+
+    AVBufferPool  *out_pool;    ///< packet buffers the card writes into
+    XmaDataBuffer *out_buf;     ///< reused, pointed at a buffer from out_pool
+    int            out_size;
+
+    XmaEncoderProperties props; ///< settings the session currently runs with
+    int            base_qp;     ///< qp of frames that do not carry a quality
+    int64_t        bit_rate;    ///< AVCodecContext.bit_rate the session was set up for
+    int            gop_size;    ///< AVCodecContext.gop_size the session was set up for
+    int            reconf_warned;
+} NGCEnc;
+
+/**
+ * Create the encoder session and the buffers used to feed it. The depth
+ * of the pipeline is the lookahead depth of the session. The session is
+ * placed on enc->device, or on the least loaded card if that is -1.
+ *
+ * Planes whose line size equals their width are passed to the card as they
+ * are; others are repacked first. Packets are returned in buffers the card
+ * wrote to directly.
+ *
+ * @param out_size size of the largest packet the session can return
+ */
+int ff_ngcenc_init(AVCodecContext *avctx, NGCEnc *enc,
+                   XmaEncoderProperties *props, int out_size);
+
+/**
+ * Submit a frame to the card, or start draining it if frame is NULL.
+ *
+ * AV_PIX_FMT_XMA frames are sent without an upload and are left unchanged,
+ * so a frame uploaded once can be fed to several encoders. A reference to
+ * them is held until their packet is received, so that their surface is not
+ * reused while the card still reads it.
+ *
+ * Changes of AVCodecContext.bit_rate and gop_size, of the picture size and
+ * a per-frame AVFrame.quality are applied to the running session before the
+ * frame is sent, without recreating it. AV_PICTURE_TYPE_I frames are
+ * encoded as IDR frames.
+ *
+ * @return 0 on success, AVERROR(EAGAIN) if depth frames are already in
+ *         flight, a negative error code on failure
+ */
+int ff_ngcenc_send_frame(AVCodecContext *avctx, NGCEnc *enc, const AVFrame *frame);
+
+/**
+ * Return the next packet. Blocks only while the pipeline is full or being
+ * drained; otherwise the session is polled once. The dts are the input
+ * timestamps delayed by the B-frame reordering depth, the pts come from the card, and packets holding a keyframe
+ * get AV_PKT_FLAG_KEY.
+ *
+ * @return 0 on success, AVERROR(EAGAIN) if more input is needed,
+ *         AVERROR_EOF once drained, a negative error code on failure
+ */
+int ff_ngcenc_receive_packet(AVCodecContext *avctx, NGCEnc *enc, AVPacket *pkt);
+
+void ff_ngcenc_close(AVCodecContext *avctx, NGCEnc *enc);
+
+/**
+ * Receive encoded data from the session, waiting according to the policy
+ * in w until data is available, the session reports end of stream or an
+ * error occurs.
+ *
+ * @return the last return code of xma_enc_session_recv_data()
+ */
+int ff_ngcenc_recv_data(NGCWait *w, XmaEncoderSession *session,
+                        XmaDataBuffer *buf, int32_t *size);
+
+/**
+ * Log the wait statistics gathered in w.
+ */
+void ff_ngcenc_log_wait_stats(AVCodecContext *avctx, const NGCWait *w);
+
+#endif /* AVCODEC_NGCENC_H */
@@ -19,11 +19,18 @@
 */
 
 #include "libavutil/internal.h"
+#include "libavutil/buffer.h"
 #include "libavutil/common.h"
 #include "libavutil/opt.h"
 #include "libavutil/pixdesc.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/hwcontext_xma_internal.h"
+#include "libavutil/time.h"
 #include "avcodec.h"
+#include "h264.h"
+#include "h264_parse.h"
+#include "h264_ps.h"
 #include "internal.h"
 #include <unistd.h>
 #include <stdio.h>
@@ -48,6 +55,8 @@ typedef struct vyu_h264_dec_ctx {
     uint32_t                                  kernel_version;
     uint32_t                                  plugin_version;
     uint32_t                                  ch_index;
+    int                                       xma_device;
+    XMASlot                                   slot;
     uint32_t                                  log_level;
     uint32_t                                  ref_only;
     uint32_t                                  intra_only;
@@ -55,6 +64,7 @@ typedef struct vyu_h264_dec_ctx {
     uint32_t                                  max_krnl_enables;
     uint64_t                                  inp_buf_bytes_full;
     uint64_t                                  inp_buf_bytes_free;
+    unsigned int                              inp_buf_reported;
     uint32_t                                  comn_yuv_buf_rdsz_luma;
     uint32_t                                  comn_yuv_buf_rdsz_cbcr;
     uint64_t                                  krnl_yuv_buf_addr_luma;
@@ -65,6 +75,14 @@ typedef struct vyu_h264_dec_ctx {
     XmaFrame                                 *xmaFrame;
     int                                       is_mp4_wrapped;
     int                                       nalu_length_size;
+    uint8_t                                  *au_buf;
+    unsigned int                              au_buf_size;
+    AVBufferPool                             *pool;
+    int                                       pool_size;
+    H264ParamSets                             ps;
+    int                                       sps_seen;
+    int                                       recv_timeout;
+    XMAStats                                  stats;
 } vyu_h264_dec_ctx;
 
 
@@ -82,6 +100,9 @@ static const AVOption options[] = {
     { "refOnly",        "Decode Reference Slices Only",                     OFFSET(ref_only),         AV_OPT_TYPE_BOOL,   { .i64 = 0 },         0,          1, VD, "refOnly"        },
     { "logLevel",       "Level for debug messages",                         OFFSET(log_level),        AV_OPT_TYPE_INT,    { .i64 = 0 },         0,         63, VD, "logLevel"       },
     { "maxKrnlEnables", "Maximum number of times kernel should be enabled", OFFSET(max_krnl_enables), AV_OPT_TYPE_INT,    { .i64 = 0 },         0, 2147483647, VD, "maxKrnlEnables" },
+    { "xmaDevice",      "Card to decode on (-1 for the least loaded)",      OFFSET(xma_device),       AV_OPT_TYPE_INT,    { .i64 = -1 },       -1, 2147483647, VD, "xmaDevice"      },
+    { "recvTimeout",    "Longest wait for a decoded picture in ms",         OFFSET(recv_timeout),     AV_OPT_TYPE_INT,    { .i64 = 1000 },      0, 2147483647, VD, "recvTimeout"    },
+    XMA_STATS_OPTIONS(vyu_h264_dec_ctx, stats, VD),
     { NULL },
 };
 
@@ -99,6 +120,412 @@ static av_cold int vyusynch264_decode_close (
     
     xma_dec_session_destroy(ctx->dec_session);
     
+    avpriv_xma_session_release(&ctx->slot);
+    
+    av_freep(&ctx->au_buf);
+    ctx->au_buf_size    =    0;
+    
+    av_buffer_pool_uninit(&ctx->pool);
+    
+    ff_h264_ps_uninit(&ctx->ps);
+    
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    query the card, the input buffer occupancy is only valid once it was reported
+------------------------------------------------------------------------------------------------------------------------------------------*/
+static int vyusynch264_get_properties (
+    vyu_h264_dec_ctx                         *ctx,
+    XmaFrameProperties                       *fprops
+)
+{
+    int                                       rc;
+    
+    rc    =    xma_dec_session_get_properties(ctx->dec_session, fprops);
+    if (rc != XMA_ERROR)
+        ctx->inp_buf_reported    =    1;
+    
+    return rc;
+}
+
+
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    hand a buffer to the card, never more than its input buffer reports free so the kernel does not stall on a full input queue
+------------------------------------------------------------------------------------------------------------------------------------------*/
+static int vyusynch264_send_data (
+    AVCodecContext                           *avctx,
+    uint8_t                                  *data,
+    int                                       size
+)
+{
+    vyu_h264_dec_ctx                         *ctx                                      =                         avctx->priv_data;
+    XmaFrameProperties                        fprops                                   =                                      {0};
+    XmaDataBuffer                            *buf;
+    int                                       data_used;
+    int                                       chunk;
+    int64_t                                   start;
+    int64_t                                   deadline;
+    int                                       poll_us;
+    int                                       rc;
+    
+    while (size > 0)
+    {
+        //---- a full input buffer is polled until the card has read from it, never longer than recvTimeout
+        if ((ctx->inp_buf_reported != 0) && (ctx->inp_buf_bytes_free == 0))
+        {
+            deadline    =    av_gettime_relative() + ctx->recv_timeout * 1000LL;
+            poll_us     =    50;
+            
+            while (1)
+            {
+                if (vyusynch264_get_properties(ctx, &fprops) == XMA_ERROR)
+                    return AVERROR_EXTERNAL;
+                if (ctx->inp_buf_bytes_free != 0)
+                    break;
+                if (av_gettime_relative() >= deadline)
+                {
+                    av_log(avctx, AV_LOG_ERROR, "Card input buffer still full after %d ms\n", ctx->recv_timeout);
+                    return AVERROR_EXTERNAL;
+                }
+                av_usleep(poll_us);
+                poll_us    =    FFMIN(2 * poll_us, 1000);
+            }
+        }
+        
+        chunk    =    size;
+        if ((ctx->inp_buf_reported != 0) && (ctx->inp_buf_bytes_free < (uint64_t)chunk))
+            chunk    =    ctx->inp_buf_bytes_free;
+        
+        buf    =    xma_data_from_buffer_clone(data, chunk);
+        if (!buf)
+            return AVERROR(ENOMEM);
+        ff_xma_stats_add(&ctx->stats.allocs, 1);
+        
+        data_used    =    0;
+        start        =    av_gettime_relative();
+        rc           =    xma_dec_session_send_data(ctx->dec_session, buf, &data_used);
+        ff_xma_stats_add(&ctx->stats.send_time, av_gettime_relative() - start);
+        xma_data_buffer_free(buf);
+        if ((rc != XMA_SUCCESS) || (data_used <= 0))
+        {
+            av_log(avctx, AV_LOG_ERROR, "Card did not accept %d bytes of input\n", chunk);
+            return AVERROR_EXTERNAL;
+        }
+        
+        data    +=    data_used;
+        size    -=    data_used;
+        ff_xma_stats_add(&ctx->stats.xfer_bytes, data_used);
+        
+        //---- the data just sent takes room until the card reports again
+        ctx->inp_buf_bytes_free    -=    FFMIN(ctx->inp_buf_bytes_free, (uint64_t)data_used);
+        
+        //---- refresh the input buffer occupancy before sending the rest
+        if ((size > 0) && (vyusynch264_get_properties(ctx, &fprops) == XMA_ERROR))
+            return AVERROR_EXTERNAL;
+    }
+    
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    rewrite a whole MP4 access unit to Annex B into the reusable scratch buffer, no allocation once the buffer has grown
+------------------------------------------------------------------------------------------------------------------------------------------*/
+static int vyusynch264_avcc_to_annexb (
+    AVCodecContext                           *avctx,
+    const AVPacket                           *avpkt
+)
+{
+    vyu_h264_dec_ctx                         *ctx                                      =                         avctx->priv_data;
+    const uint8_t                            *src                                      =                              avpkt->data;
+    const uint8_t                            *end                                      =                 avpkt->data + avpkt->size;
+    uint8_t                                  *dst;
+    uint64_t                                  au_size                                  =                                        0;
+    unsigned int                              buf_size                                 =                         ctx->au_buf_size;
+    unsigned int                              nalu_size;
+    int                                       i;
+    
+    //---- first pass validates the length prefixes and sizes the output
+    while (src < end)
+    {
+        if (end - src < ctx->nalu_length_size)
+            break;
+        for (nalu_size = 0, i = 0; i < ctx->nalu_length_size; i++)
+            nalu_size    =    (nalu_size << 8) | src[i];
+        src    +=    ctx->nalu_length_size;
+        
+        if (nalu_size > end - src)
+        {
+            av_log(avctx, AV_LOG_ERROR, "NAL unit of %u bytes overruns the packet\n", nalu_size);
+            return AVERROR_INVALIDDATA;
+        }
+        src        +=    nalu_size;
+        au_size    +=    4 + nalu_size;
+    }
+    
+    if (au_size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE)
+        return AVERROR_INVALIDDATA;
+    
+    av_fast_padded_malloc(&ctx->au_buf, &ctx->au_buf_size, au_size);
+    if (!ctx->au_buf)
+        return AVERROR(ENOMEM);
+    if (ctx->au_buf_size != buf_size)
+        ff_xma_stats_add(&ctx->stats.allocs, 1);
+    ff_xma_stats_add(&ctx->stats.copy_bytes, au_size);
+    
+    //---- second pass copies each NAL behind a four byte start code
+    src    =    avpkt->data;
+    dst    =    ctx->au_buf;
+    while (dst < ctx->au_buf + au_size)
+    {
+        for (nalu_size = 0, i = 0; i < ctx->nalu_length_size; i++)
+            nalu_size    =    (nalu_size << 8) | src[i];
+        src    +=    ctx->nalu_length_size;
+        
+        AV_WB32(dst, 1);
+        memcpy(dst + 4, src, nalu_size);
+        
+        dst    +=    4 + nalu_size;
+        src    +=    nalu_size;
+    }
+    
+    return au_size;
+}
+
+
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    receive the decoded picture straight into a pooled output buffer, the card writes it where the AVFrame reads it
+------------------------------------------------------------------------------------------------------------------------------------------*/
+static int vyusynch264_recv_frame (
+    AVCodecContext                           *avctx,
+    AVFrame                                  *pict,
+    const XmaFrameProperties                 *fprops
+)
+{
+    vyu_h264_dec_ctx                         *ctx                                      =                         avctx->priv_data;
+    enum AVPixelFormat                        format                                   =                           avctx->pix_fmt;
+    const AVPixFmtDescriptor                 *desc;
+    uint8_t                                  *planes[3];
+    int                                       plane_size[3];
+    int                                       size;
+    int                                       i;
+    int                                       rc;
+    
+    if (strcmp(ctx->pixel_format, "yuyv422") == 0)
+        format    =    AV_PIX_FMT_YUYV422;
+    
+    size    =    av_image_get_buffer_size(format, fprops->width, fprops->height, 1);
+    if (size < 0)
+        return size;
+    
+    if (!ctx->pool || (ctx->pool_size != size))
+    {
+        av_buffer_pool_uninit(&ctx->pool);
+        ctx->pool         =    av_buffer_pool_init2(size, &ctx->stats, avpriv_xma_stats_alloc, NULL);
+        ctx->pool_size    =    size;
+        if (!ctx->pool)
+            return AVERROR(ENOMEM);
+    }
+    
+    pict->buf[0]    =    av_buffer_pool_get(ctx->pool);
+    if (!pict->buf[0])
+        return AVERROR(ENOMEM);
+    
+    pict->width     =    fprops->width;
+    pict->height    =    fprops->height;
+    pict->format    =    format;
+    
+    rc    =    av_image_fill_arrays(pict->data, pict->linesize, pict->buf[0]->data, format, fprops->width, fprops->height, 1);
+    if (rc < 0)
+        return rc;
+    
+    if (format == AV_PIX_FMT_YUYV422)
+    {
+        //---- the kernel already packs the picture, spread over its luma and chroma buffers back to back
+        plane_size[0]    =    ctx->comn_yuv_buf_rdsz_luma ? ctx->comn_yuv_buf_rdsz_luma : fprops->width * fprops->height;
+        plane_size[1]    =    ctx->comn_yuv_buf_rdsz_cbcr ? ctx->comn_yuv_buf_rdsz_cbcr : fprops->width * fprops->height / 2;
+        plane_size[2]    =    plane_size[1];
+        if (plane_size[0] + 2 * plane_size[1] > size)
+            return AVERROR_INVALIDDATA;
+        
+        planes[0]    =    pict->data[0];
+        planes[1]    =    planes[0] + plane_size[0];
+        planes[2]    =    planes[1] + plane_size[1];
+    }
+    else
+    {
+        desc    =    av_pix_fmt_desc_get(format);
+        
+        for (i = 0; i < 3; i++)
+        {
+            planes[i]        =    pict->data[i];
+            plane_size[i]    =    pict->linesize[i] * (i ? AV_CEIL_RSHIFT(fprops->height, desc->log2_chroma_h) : fprops->height);
+        }
+    }
+    
+    for (i = 0; i < 3; i++)
+    {
+        ctx->xmaFrame->data[i].buffer        =    planes[i];
+        ctx->xmaFrame->data[i].alloc_size    =    plane_size[i];
+    }
+    ctx->xmaFrame->frame_props    =    *fprops;
+    
+    rc    =    xma_dec_session_recv_frame(ctx->dec_session, ctx->xmaFrame);
+    if (rc != XMA_SUCCESS)
+        return AVERROR_EXTERNAL;
+    
+    ff_xma_stats_add(&ctx->stats.xfer_bytes, size);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    describe the pictures of the given size and software format to the XMA frame
+------------------------------------------------------------------------------------------------------------------------------------------*/
+static void vyusynch264_set_fprops (
+    vyu_h264_dec_ctx                         *ctx,
+    int                                       width,
+    int                                       height,
+    enum AVPixelFormat                        pix_fmt
+)
+{
+    ctx->fprops.width      =    width;
+    ctx->fprops.height     =    height;
+    
+    switch (pix_fmt)
+    {
+        case AV_PIX_FMT_YUV420P      :  ctx->fprops.format = XMA_YUV420_FMT_TYPE;  ctx->fprops.bits_per_pixel =  8;  break;
+        case AV_PIX_FMT_YUVJ420P     :  ctx->fprops.format = XMA_YUV420_FMT_TYPE;  ctx->fprops.bits_per_pixel =  8;  break;
+        case AV_PIX_FMT_YUV422P      :  ctx->fprops.format = XMA_YUV422_FMT_TYPE;  ctx->fprops.bits_per_pixel =  8;  break;
+        case AV_PIX_FMT_YUV444P      :  ctx->fprops.format = XMA_YUV444_FMT_TYPE;  ctx->fprops.bits_per_pixel =  8;  break;
+        case AV_PIX_FMT_YUV420P16LE  :  ctx->fprops.format = XMA_YUV420_FMT_TYPE;  ctx->fprops.bits_per_pixel = 16;  break;
+        case AV_PIX_FMT_YUV422P16LE  :  ctx->fprops.format = XMA_YUV422_FMT_TYPE;  ctx->fprops.bits_per_pixel = 16;  break;
+        case AV_PIX_FMT_YUV444P16LE  :  ctx->fprops.format = XMA_YUV444_FMT_TYPE;  ctx->fprops.bits_per_pixel = 16;  break;
+        default                      :  break;
+    }
+}
+
+
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    switch the output to a new picture size or format, XMA frames are negotiated again so the frames context matches the pictures
+------------------------------------------------------------------------------------------------------------------------------------------*/
+static int vyusynch264_set_geometry (
+    AVCodecContext                           *avctx,
+    int                                       width,
+    int                                       height,
+    enum AVPixelFormat                        sw_format
+)
+{
+    vyu_h264_dec_ctx                         *ctx                                      =                         avctx->priv_data;
+    enum AVPixelFormat                        pix_fmts[3]                              =  {AV_PIX_FMT_XMA, sw_format, AV_PIX_FMT_NONE};
+    int                                       hw                                       =       avctx->pix_fmt == AV_PIX_FMT_XMA;
+    int                                       ret;
+    
+    if ((width == avctx->width) && (height == avctx->height) && (sw_format == (hw ? avctx->sw_pix_fmt : avctx->pix_fmt)))
+        return 0;
+    
+    av_log(avctx, AV_LOG_VERBOSE, "Output changes from %dx%d to %dx%d %s\n", avctx->width, avctx->height, width, height,
+           av_get_pix_fmt_name(sw_format));
+    
+    ret    =    ff_set_dimensions(avctx, width, height);
+    if (ret < 0)
+        return ret;
+    
+    vyusynch264_set_fprops(ctx, width, height, sw_format);
+    
+    if (!hw)
+    {
+        avctx->pix_fmt    =    sw_format;
+        return 0;
+    }
+    
+    ret    =    ff_get_format(avctx, pix_fmts);
+    if (ret < 0)
+        return ret;
+    
+    avctx->pix_fmt    =    ret;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    take the output geometry from the first sequence parameter set known, so pools are sized before the first picture comes back
+------------------------------------------------------------------------------------------------------------------------------------------*/
+static int vyusynch264_apply_sps (
+    AVCodecContext                           *avctx
+)
+{
+    vyu_h264_dec_ctx                         *ctx                                      =                         avctx->priv_data;
+    const SPS                                *sps                                      =                                     NULL;
+    enum AVPixelFormat                        sw_format;
+    int                                       i;
+    
+    for (i = 0; (i < MAX_SPS_COUNT) && !sps; i++)
+        if (ctx->ps.sps_list[i])
+            sps    =    (const SPS *)ctx->ps.sps_list[i]->data;
+    if (!sps)
+        return 0;
+    
+    switch (sps->chroma_format_idc)
+    {
+        case 2   :  sw_format = (sps->bit_depth_luma > 8) ? AV_PIX_FMT_YUV422P16LE : AV_PIX_FMT_YUV422P;  break;
+        case 3   :  sw_format = (sps->bit_depth_luma > 8) ? AV_PIX_FMT_YUV444P16LE : AV_PIX_FMT_YUV444P;  break;
+        default  :  sw_format = (sps->bit_depth_luma > 8) ? AV_PIX_FMT_YUV420P16LE : AV_PIX_FMT_YUV420P;  break;
+    }
+    
+    ctx->sps_seen          =    1;
+    avctx->profile         =    ff_h264_get_profile(sps);
+    avctx->level           =    sps->level_idc;
+    avctx->coded_width     =    16 * sps->mb_width;
+    avctx->coded_height    =    16 * sps->mb_height;
+    
+    return vyusynch264_set_geometry(avctx, 16 * sps->mb_width  - (sps->crop_left + sps->crop_right),
+                                           16 * sps->mb_height - (sps->crop_top  + sps->crop_bottom), sw_format);
+}
+
+
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    look for a sequence parameter set in Annex B data, only done until one is found for streams without extradata
+------------------------------------------------------------------------------------------------------------------------------------------*/
+static int vyusynch264_find_sps (
+    AVCodecContext                           *avctx,
+    const uint8_t                            *data,
+    int                                       size
+)
+{
+    vyu_h264_dec_ctx                         *ctx                                      =                         avctx->priv_data;
+    const uint8_t                            *end                                      =                              data + size;
+    const uint8_t                            *nal;
+    const uint8_t                            *nal_end;
+    uint32_t                                  state                                    =                                       -1;
+    uint32_t                                  next_state;
+    int                                       is_avc;
+    int                                       nal_length_size;
+    int                                       ret;
+    
+    while (data < end)
+    {
+        data    =    avpriv_find_start_code(data, end, &state);
+        if (((state & 0xffffff00) != 0x100) || ((state & 0x1f) != H264_NAL_SPS))
+            continue;
+        
+        //---- hand the NAL with its start code to the extradata parser, it ends where the next start code begins
+        nal           =    data - 4;
+        next_state    =    -1;
+        nal_end       =    avpriv_find_start_code(data, end, &next_state);
+        if ((next_state & 0xffffff00) == 0x100)
+            nal_end    -=    4;
+        
+        ret    =    ff_h264_decode_extradata(nal, nal_end - nal, &ctx->ps, &is_avc, &nal_length_size, avctx->err_recognition, avctx);
+        if (ret >= 0)
+            return vyusynch264_apply_sps(avctx);
+        
+        data    =    nal_end;
+        state   =    -1;
+    }
+    
     return 0;
 }
 
@@ -124,34 +551,58 @@ static av_cold int vyusynch264_decode_init (
     uint8_t                                   param_set_num_cnt;
     uint16_t                                  param_set_size_val;
     uint16_t                                  param_set_size_cnt;
-    XmaDataBuffer                            *buf;
-    int                                       data_used                                =                                        0;
+    XmaFrameData                              fdata                                    =                                    { { NULL } };
+    enum AVPixelFormat                        pix_fmts[3]                              =  {AV_PIX_FMT_XMA, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE};
+    int                                       is_avc;
+    int                                       nal_length_size;
+    int                                       ret;
     
     
     /*------------------------------------------------------------------------------------------------------------------------------------------
-      
+        the output geometry comes from the SPS in the extradata when there is one, not from what the caller guessed
     ------------------------------------------------------------------------------------------------------------------------------------------*/
-    ctx->fprops.width      =    avctx->width;
-    ctx->fprops.height     =    avctx->height;
-    
-    switch (avctx->pix_fmt)
+    if ((avctx->extradata != NULL) && (avctx->extradata_size > 0))
     {
-        case AV_PIX_FMT_YUV420P      :  ctx->fprops.format = XMA_YUV420_FMT_TYPE;  ctx->fprops.bits_per_pixel =  8;  break;
-        case AV_PIX_FMT_YUVJ420P     :  ctx->fprops.format = XMA_YUV420_FMT_TYPE;  ctx->fprops.bits_per_pixel =  8;  break;
-        case AV_PIX_FMT_YUV422P      :  ctx->fprops.format = XMA_YUV422_FMT_TYPE;  ctx->fprops.bits_per_pixel =  8;  break;
-        case AV_PIX_FMT_YUV444P      :  ctx->fprops.format = XMA_YUV444_FMT_TYPE;  ctx->fprops.bits_per_pixel =  8;  break;
-        case AV_PIX_FMT_YUV420P16LE  :  ctx->fprops.format = XMA_YUV420_FMT_TYPE;  ctx->fprops.bits_per_pixel = 16;  break;
-        case AV_PIX_FMT_YUV422P16LE  :  ctx->fprops.format = XMA_YUV422_FMT_TYPE;  ctx->fprops.bits_per_pixel = 16;  break;
-        case AV_PIX_FMT_YUV444P16LE  :  ctx->fprops.format = XMA_YUV444_FMT_TYPE;  ctx->fprops.bits_per_pixel = 16;  break;
+        ret    =    ff_h264_decode_extradata(avctx->extradata, avctx->extradata_size, &ctx->ps, &is_avc, &nal_length_size,
+                                             avctx->err_recognition, avctx);
+        if (ret >= 0)
+            ret    =    vyusynch264_apply_sps(avctx);
+        if (ret < 0)
+            av_log(avctx, AV_LOG_WARNING, "Could not take the picture size from the extradata\n");
     }
     
-    ctx->xmaFrame = xma_frame_alloc(&ctx->fprops);
+    vyusynch264_set_fprops(ctx, avctx->width, avctx->height, avctx->pix_fmt);
+    
+    //---- the planes are pointed at the output picture for every frame received
+    ctx->xmaFrame = xma_frame_from_buffers_clone(&ctx->fprops, &fdata);
+    if (!ctx->xmaFrame)
+        return AVERROR(ENOMEM);
+    
+    
+    /*------------------------------------------------------------------------------------------------------------------------------------------
+        decode straight into XMA frames when the caller provides a frames context for them
+    ------------------------------------------------------------------------------------------------------------------------------------------*/
+    if ((ctx->fprops.format != XMA_NONE_FMT_TYPE) && (strcmp(ctx->pixel_format, "yuyv422") != 0))
+    {
+        pix_fmts[1]    =    avctx->pix_fmt;
+        
+        ret    =    ff_get_format(avctx, pix_fmts);
+        if (ret < 0)
+            return ret;
+        
+        avctx->pix_fmt    =    ret;
+    }
     
     
     /*------------------------------------------------------------------------------------------------------------------------------------------
         create decoder sesion and set the configuraiton
     ------------------------------------------------------------------------------------------------------------------------------------------*/
-    ctx->ch_index    =    0;
+    ret    =    avpriv_xma_session_acquire(avctx, &ctx->slot, ctx->xma_device,
+                                           avpriv_xma_session_load(avctx->width, avctx->height, avctx->framerate));
+    if (ret < 0)
+        return ret;
+    
+    ctx->ch_index    =    ctx->slot.channel;
     
     strcpy(ctx->dec_params_name[ 0],         "kernel_version");    ctx->dec_params[ 0].name    =    ctx->dec_params_name[ 0];    ctx->dec_params[ 0].type    =    XMA_UINT32;    ctx->dec_params[ 0].length    =    sizeof(ctx->kernel_version        );    ctx->dec_params[ 0].value    =    &ctx->kernel_version;
     strcpy(ctx->dec_params_name[ 1],         "plugin_version");    ctx->dec_params[ 1].name    =    ctx->dec_params_name[ 1];    ctx->dec_params[ 1].type    =    XMA_UINT32;    ctx->dec_params[ 1].length    =    sizeof(ctx->plugin_version        );    ctx->dec_params[ 1].value    =    &ctx->plugin_version;
@@ -174,11 +625,14 @@ static av_cold int vyusynch264_decode_init (
     dec_props.intraOnly         =    ctx->intra_only;
     dec_props.params            =    ctx->dec_params;
     dec_props.param_cnt         =    14;
+#if HAVE_XMAENCODERPROPERTIES_DEV_INDEX
+    dec_props.dev_index         =    ctx->slot.device;
+#endif
     
     ctx->dec_session            =    xma_dec_session_create(&dec_props);
     if (!ctx->dec_session) {
-        printf("ERROR: Unable to allocate VYUSync H.264 decoder session.\n");
-        return -1;
+        av_log(avctx, AV_LOG_ERROR, "Unable to allocate VYUSync H.264 decoder session\n");
+        return AVERROR_EXTERNAL;
     }
     
     ctx->null_sent              =    0;
@@ -199,7 +653,9 @@ static av_cold int vyusynch264_decode_init (
             //---- allocate buffer to store sps and pps.
             //  Minimum number of bytes present in avctx->extradata for each sps/pps = 4 (2 for length, 1 for nal_unit_type and minimum of 1 for nal_unit_data)
             //  Four bytes of start code are added per parameter set. Therefore, in the worst case each 4-byte parameter set can result in 8-bytes of data.
-            param_set_buffer    =    malloc(avctx->extradata_size * 2);
+            param_set_buffer    =    av_malloc(avctx->extradata_size * 2);
+            if (!param_set_buffer)
+                return AVERROR(ENOMEM);
             param_set_offset    =    0;
             
             ctx->is_mp4_wrapped    =    1;
@@ -248,12 +704,11 @@ static av_cold int vyusynch264_decode_init (
             }
             
             //---- transmit the parameter sets to the decoder
-            buf    =    xma_data_from_buffer_clone(param_set_buffer, param_set_offset);
+            ret    =    vyusynch264_send_data(avctx, param_set_buffer, param_set_offset);
             
-            xma_dec_session_send_data(ctx->dec_session, buf, &data_used);
-            
-            xma_data_buffer_free(buf);
-            free (param_set_buffer);
+            av_free(param_set_buffer);
+            if (ret < 0)
+                return ret;
         }
     }
     
@@ -281,14 +736,11 @@ static int vyusynch264_decode (
     vyu_h264_dec_ctx                         *ctx                                      =                         avctx->priv_data;
     AVFrame                                  *pict                                     =                                     data;
     XmaFrameProperties                        fprops                                   =                                      {0};
-    unsigned char                            *planar_data[4]                           =                 {NULL, NULL, NULL, NULL};
-    unsigned char                            *packed_data[4]                           =                 {NULL, NULL, NULL, NULL};
     int                                       rc                                       =                                        0;
     int                                       data_used                                =                                        0;
-    int                                       offset                                   =                                        0;
-    unsigned int                              nalu_size                                =                                        0;
-    unsigned char                            *nalu_buf;
-    XmaDataBuffer                            *buf;
+    int64_t                                   start;
+    int64_t                                   deadline;
+    int                                       poll_us;
     
     
     /*------------------------------------------------------------------------------------------------------------------------------------------
@@ -296,66 +748,32 @@ static int vyusynch264_decode (
     ------------------------------------------------------------------------------------------------------------------------------------------*/
     if (avpkt->size != 0)
     {
+        //---- the whole access unit goes to the card in one submission
         if (ctx->is_mp4_wrapped == 1)
         {
-            //---- loop through all available nalu
-            while (offset < avpkt->size)
-            {
-                //---- determine the nalu size
-                switch (ctx->nalu_length_size)
-                {
-                    case 1  :  nalu_size    =      (unsigned int) avpkt->data[offset + 0];         break;
-                    
-                    case 2  :  nalu_size    =      (unsigned int)(avpkt->data[offset + 0] <<  8)
-                                                 | (unsigned int)(avpkt->data[offset + 1] <<  0);  break;
-                    
-                    case 4  :  nalu_size    =      (unsigned int)(avpkt->data[offset + 0] << 24)
-                                                 | (unsigned int)(avpkt->data[offset + 1] << 16)
-                                                 | (unsigned int)(avpkt->data[offset + 2] <<  8)
-                                                 | (unsigned int)(avpkt->data[offset + 3] <<  0);  break;
-                }
-                offset    +=    ctx->nalu_length_size;
-                
-                //---- create nalu
-                nalu_buf       =    malloc(nalu_size + 4);
-                nalu_buf[0]    =    0x00;
-                nalu_buf[1]    =    0x00;
-                nalu_buf[2]    =    0x00;
-                nalu_buf[3]    =    0x01;
-                memcpy (nalu_buf + 4, avpkt->data + offset, nalu_size);
-                offset    +=    nalu_size;
-                
-                //---- transmit nalu
-                buf    =    xma_data_from_buffer_clone(nalu_buf, nalu_size + 4);
-                
-                rc = xma_dec_session_send_data(ctx->dec_session, buf, &data_used);
-                if (rc != XMA_SUCCESS)
-                {
-                    *got_frame    =    0;
-                    return 0;
-                }
-                
-                //---- cleanup
-                xma_data_buffer_free(buf);
-                free(nalu_buf);
-            }
+            rc    =    vyusynch264_avcc_to_annexb(avctx, avpkt);
+            if (rc < 0)
+                return rc;
             
-            data_used    =    avpkt->size;
+            if (!ctx->sps_seen && (vyusynch264_find_sps(avctx, ctx->au_buf, rc) < 0))
+                return AVERROR_INVALIDDATA;
             
+            rc    =    vyusynch264_send_data(avctx, ctx->au_buf, rc);
         }
         else
         {
-            buf    =    xma_data_from_buffer_clone(avpkt->data, avpkt->size);
-            
-            rc    =    xma_dec_session_send_data(ctx->dec_session, buf, &data_used);
-            if (rc != XMA_SUCCESS)
-            {
-                *got_frame    =    0;
-                return 0;
-            }
+            if (!ctx->sps_seen && (vyusynch264_find_sps(avctx, avpkt->data, avpkt->size) < 0))
+                return AVERROR_INVALIDDATA;
             
-            xma_data_buffer_free(buf);
+            rc    =    vyusynch264_send_data(avctx, avpkt->data, avpkt->size);
         }
+        
+        if (rc < 0)
+            return rc;
+        
+        ff_xma_stats_add(&ctx->stats.frames, 1);
+        ff_xma_stats_add(&ctx->stats.in_flight, 1);
+        data_used    =    avpkt->size;
     }
     else
     if (ctx->null_sent == 0)
@@ -363,8 +781,8 @@ static int vyusynch264_decode (
         rc    =    xma_dec_session_send_data(ctx->dec_session, NULL, &data_used);
         if (rc != XMA_SUCCESS)
         {
-            *got_frame    =    0;
-            return 0;
+            av_log(avctx, AV_LOG_ERROR, "Card did not accept the end of stream\n");
+            return AVERROR_EXTERNAL;
         }
         
         ctx->null_sent    =    1;
@@ -376,82 +794,84 @@ static int vyusynch264_decode (
     ------------------------------------------------------------------------------------------------------------------------------------------*/
     *got_frame    =    0;
     
-    do {
-        rc    =    xma_dec_session_get_properties(ctx->dec_session, &fprops);
+    //---- wait while the card holds a full input buffer or drains, sleeping between polls and never longer than recvTimeout
+    start       =    av_gettime_relative();
+    deadline    =    start + ctx->recv_timeout * 1000LL;
+    poll_us     =    50;
+    
+    while (1)
+    {
+        rc    =    vyusynch264_get_properties(ctx, &fprops);
         if (rc == XMA_ERROR)
         {
-            *got_frame    =    0;
-            return 0;
+            av_log(avctx, AV_LOG_ERROR, "Failed to query the decoder state\n");
+            return AVERROR_EXTERNAL;
+        }
+        
+        if ((rc != XMA_SEND_MORE_DATA) || ((avpkt->size != 0) && (ctx->inp_buf_bytes_full == 0)))
+            break;
+        
+        //---- while draining no frame means the end of the stream, so a card that stops answering is an error, not an EOF
+        if (av_gettime_relative() >= deadline)
+        {
+            if (avpkt->size == 0)
+            {
+                av_log(avctx, AV_LOG_ERROR, "Card did not finish draining within %d ms\n", ctx->recv_timeout);
+                return AVERROR_EXTERNAL;
+            }
+            av_log(avctx, AV_LOG_WARNING, "No picture from the card within %d ms\n", ctx->recv_timeout);
+            break;
         }
         
-    } while (    ((rc == XMA_SEND_MORE_DATA) && (avpkt->size != 0) && (ctx->inp_buf_bytes_full != 0))
-              || ((rc == XMA_SEND_MORE_DATA) && (avpkt->size == 0))
-            );
+        av_usleep(poll_us);
+        poll_us    =    FFMIN(2 * poll_us, 1000);
+    }
     
     
     /*------------------------------------------------------------------------------------------------------------------------------------------
         read the decoded image
     ------------------------------------------------------------------------------------------------------------------------------------------*/
-    if (rc == XMA_SUCCESS)
+    if ((rc == XMA_SUCCESS) && (avctx->pix_fmt == AV_PIX_FMT_XMA))
     {
-        rc    =    xma_dec_session_recv_frame(ctx->dec_session, ctx->xmaFrame);
-        if (rc != XMA_SUCCESS)
-        {
-            *got_frame    =    0;
-            return 0;
-        }
+        //---- a new picture size gets a new frames context before the picture is received into it
+        rc    =    vyusynch264_set_geometry(avctx, fprops.width, fprops.height, avctx->sw_pix_fmt);
+        if (rc < 0)
+            return rc;
         
-        planar_data[0]    =    ctx->xmaFrame->data[0].buffer;
-        planar_data[1]    =    ctx->xmaFrame->data[1].buffer;
-        planar_data[2]    =    ctx->xmaFrame->data[2].buffer;
-        planar_data[3]    =    ctx->xmaFrame->data[0].buffer;
+        rc    =    ff_get_buffer(avctx, pict, 0);
+        if (rc < 0)
+            return rc;
         
-        pict->width     =    fprops.width;
-        pict->height    =    fprops.height;
-        pict->format    =    avctx->pix_fmt;
-        
-        pict->linesize[0]    =    fprops.width * ((fprops.bits_per_pixel + 7) >> 3);
-        pict->linesize[3]    =    pict->linesize[0];
-        switch (fprops.format)
+        rc    =    xma_dec_session_recv_frame(ctx->dec_session, (XmaFrame *)pict->data[3]);
+        if (rc != XMA_SUCCESS)
         {
-            case XMA_YUV420_FMT_TYPE  :  pict->linesize[1] = pict->linesize[0] / 2;  pict->linesize[2] = pict->linesize[1];  break;
-            case XMA_YUV422_FMT_TYPE  :  pict->linesize[1] = pict->linesize[0] / 2;  pict->linesize[2] = pict->linesize[1];  break;
-            case XMA_YUV444_FMT_TYPE  :  pict->linesize[1] = pict->linesize[0];      pict->linesize[2] = pict->linesize[1];  break;
-            default                   :  *got_frame = 0;  return 0;
+            av_log(avctx, AV_LOG_ERROR, "Failed to receive a picture from the card\n");
+            av_frame_unref(pict);
+            return AVERROR_EXTERNAL;
         }
         
-        if (strcmp(ctx->pixel_format, "yuyv422") == 0)
-        {
-            pict->format    =    AV_PIX_FMT_YUYV422;
-            
-            pict->linesize[0] = pict->linesize[0] * 2;
-            pict->linesize[1] = 0;
-            pict->linesize[2] = 0;
-            pict->linesize[3] = 0;
-            
-            packed_data[0] = malloc(fprops.width * fprops.height * 2);
-            packed_data[1] = NULL;
-            packed_data[2] = NULL;
-            packed_data[3] = NULL;
-            
-            memcpy(packed_data[0],                                                             planar_data[0], ctx->comn_yuv_buf_rdsz_luma);
-            memcpy(packed_data[0] + ctx->comn_yuv_buf_rdsz_luma,                               planar_data[1], ctx->comn_yuv_buf_rdsz_cbcr);
-            memcpy(packed_data[0] + ctx->comn_yuv_buf_rdsz_luma + ctx->comn_yuv_buf_rdsz_cbcr, planar_data[2], ctx->comn_yuv_buf_rdsz_cbcr);
-            
-            av_frame_get_buffer (pict, 32);
-            av_image_copy (pict->data, pict->linesize, (const uint8_t**)packed_data, pict->linesize, pict->format, fprops.width, fprops.height);
-            
-            free(packed_data[0]);
-        }
-        else
+        *got_frame    =    1;
+    }
+    else
+    if (rc == XMA_SUCCESS)
+    {
+        rc    =    vyusynch264_set_geometry(avctx, fprops.width, fprops.height, avctx->pix_fmt);
+        if (rc < 0)
+            return rc;
+        
+        rc    =    vyusynch264_recv_frame(avctx, pict, &fprops);
+        if (rc < 0)
         {
-            av_frame_get_buffer (pict, 32);
-            av_image_copy (pict->data, pict->linesize, (const uint8_t**)planar_data, pict->linesize, pict->format, fprops.width, fprops.height);
+            av_frame_unref(pict);
+            return rc;
         }
         
         *got_frame    =    1;
     }
     
+    ff_xma_stats_add(&ctx->stats.recv_time, av_gettime_relative() - start);
+    if (*got_frame && atomic_load(&ctx->stats.in_flight) > 0)
+        ff_xma_stats_add(&ctx->stats.in_flight, -1);
     
     return data_used;
 }
@@ -493,6 +913,17 @@ static const AVClass class = {
 };
 
 
+/*------------------------------------------------------------------------------------------------------------------------------------------
+    AV_PIX_FMT_XMA is set up by the decoder itself, this only lets ff_get_format() accept it
+------------------------------------------------------------------------------------------------------------------------------------------*/
+AVHWAccel ff_vyusync_h264_hwaccel = {
+    .name                =    "VYUH264",
+    .type                =    AVMEDIA_TYPE_VIDEO,
+    .id                  =    AV_CODEC_ID_H264,
+    .pix_fmt             =    AV_PIX_FMT_XMA,
+};
+
+
 /*------------------------------------------------------------------------------------------------------------------------------------------
   
 ------------------------------------------------------------------------------------------------------------------------------------------*/
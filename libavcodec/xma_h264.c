@@ -0,0 +1,509 @@
+/*
+ * H.264 HW decode acceleration through XMA
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <xma.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/hwcontext_xma_internal.h"
+#include "libavutil/time.h"
+
+#include "avcodec.h"
+#include "h264dec.h"
+#include "h264_ps.h"
+#include "internal.h"
+#include "xma_h264.h"
+
+/**
+ * @file
+ * This file implements the glue code between the native H.264 decoder and
+ * the XMA H.264 decoder kernel.
+ *
+ * The kernel takes an Annex B elementary stream and returns pictures in
+ * display order, so the slices h264dec parses are passed on unchanged
+ * (with the active parameter sets in front whenever they change) and every
+ * picture the kernel returns is stored into the surface h264dec allocated
+ * for it, found by its POC.
+ *
+ * The kernel holds some pictures before it returns the first one. After
+ * every picture h264dec's output delay is raised to cover the pictures the
+ * kernel still holds, plus the next one, which h264dec may select for
+ * output before it is sent, so that a surface is filled before it is output.
+ */
+
+#define XMA_H264_MAX_PENDING H264_MAX_PICTURE_COUNT
+
+/* waiting for the kernel, as in the NGCodec encoders */
+#define XMA_H264_SPIN      64       ///< polls before the first sleep
+#define XMA_H264_MIN_SLEEP 50       ///< first sleep, doubled on every further one
+#define XMA_H264_MAX_SLEEP 1000
+#define XMA_H264_TIMEOUT   2000000  ///< longest wait for a picture, in microseconds
+
+typedef struct XMAH264Picture {
+    AVFrame *f;
+    int      epoch;     ///< incremented at every POC reset
+    int      poc;
+} XMAH264Picture;
+
+typedef struct XMAH264Context {
+    XmaDecoderSession *session;
+    XMASlot            slot;
+    XmaParameter       params[4];
+    uint32_t           ch_index;
+    char               pixel_format[8];
+    uint64_t           inp_buf_bytes_full;
+    uint64_t           inp_buf_bytes_free;
+    int                inp_buf_reported;    ///< the kernel filled in the two above
+
+    AVBufferRef       *sps_ref;     ///< parameter sets last sent to the kernel
+    AVBufferRef       *pps_ref;
+
+    uint8_t           *au_buf;      ///< Annex B data of the current picture
+    unsigned int       au_buf_size;
+    int                au_size;
+
+    XMAH264Picture     pending[XMA_H264_MAX_PENDING];
+    int                nb_pending;
+    int                epoch;
+    int                mmco_reset;
+    int                eos_sent;
+} XMAH264Context;
+
+static int xma_h264_append(AVCodecContext *avctx, const uint8_t *data, int size)
+{
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    uint8_t *dst;
+
+    if (size > INT_MAX - 3 - AV_INPUT_BUFFER_PADDING_SIZE - ctx->au_size)
+        return AVERROR(ENOMEM);
+
+    dst = av_fast_realloc(ctx->au_buf, &ctx->au_buf_size,
+                          ctx->au_size + 3 + size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!dst)
+        return AVERROR(ENOMEM);
+    ctx->au_buf = dst;
+
+    dst += ctx->au_size;
+    dst[0] = 0;
+    dst[1] = 0;
+    dst[2] = 1;
+    memcpy(dst + 3, data, size);
+    ctx->au_size += 3 + size;
+
+    return 0;
+}
+
+/**
+ * Append a parameter set. h264dec keeps it without emulation prevention
+ * bytes, so they are put back.
+ */
+static int xma_h264_append_ps(AVCodecContext *avctx, const uint8_t *rbsp, int size)
+{
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    uint8_t *dst;
+    int i, zeros = 0, start = ctx->au_size;
+
+    /* the escaped NAL is at most 3/2 of the raw one */
+    if (size > (INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE - ctx->au_size) / 2 - 3)
+        return AVERROR(ENOMEM);
+
+    dst = av_fast_realloc(ctx->au_buf, &ctx->au_buf_size,
+                          ctx->au_size + 3 + size * 3 / 2 + 1 +
+                          AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!dst)
+        return AVERROR(ENOMEM);
+    ctx->au_buf = dst;
+
+    dst += start;
+    *dst++ = 0;
+    *dst++ = 0;
+    *dst++ = 1;
+    for (i = 0; i < size; i++) {
+        if (zeros == 2 && rbsp[i] <= 3) {
+            *dst++ = 3;
+            zeros  = 0;
+        }
+        zeros  = rbsp[i] ? 0 : zeros + 1;
+        *dst++ = rbsp[i];
+    }
+    ctx->au_size = dst - ctx->au_buf;
+
+    return 0;
+}
+
+static int xma_h264_get_properties(XMAH264Context *ctx, XmaFrameProperties *fprops)
+{
+    int rc = xma_dec_session_get_properties(ctx->session, fprops);
+
+    if (rc != XMA_ERROR)
+        ctx->inp_buf_reported = 1;
+    return rc;
+}
+
+/* wait for the kernel to read from a full input buffer */
+static int xma_h264_wait_input(AVCodecContext *avctx)
+{
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    XmaFrameProperties fprops = { 0 };
+    int64_t start = av_gettime_relative();
+    int delay = XMA_H264_MIN_SLEEP;
+    int polls = 0;
+
+    for (;;) {
+        if (xma_h264_get_properties(ctx, &fprops) == XMA_ERROR) {
+            av_log(avctx, AV_LOG_ERROR, "XMA decoder failed\n");
+            return AVERROR_EXTERNAL;
+        }
+        if (ctx->inp_buf_bytes_free)
+            return 0;
+        if (av_gettime_relative() - start > XMA_H264_TIMEOUT) {
+            av_log(avctx, AV_LOG_ERROR, "Timed out waiting for room in the "
+                   "XMA decoder input buffer\n");
+            return AVERROR_EXTERNAL;
+        }
+        if (++polls > XMA_H264_SPIN) {
+            av_usleep(delay);
+            delay = FFMIN(delay * 2, XMA_H264_MAX_SLEEP);
+        }
+    }
+}
+
+static int xma_h264_send(AVCodecContext *avctx, uint8_t *data, int size)
+{
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    XmaFrameProperties fprops = { 0 };
+    XmaDataBuffer *buf;
+    int data_used, chunk, ret, rc;
+
+    while (size > 0) {
+        /* nothing is known about the buffer until the kernel first reports */
+        if (ctx->inp_buf_reported && !ctx->inp_buf_bytes_free) {
+            ret = xma_h264_wait_input(avctx);
+            if (ret < 0)
+                return ret;
+        }
+        chunk = size;
+        if (ctx->inp_buf_reported && ctx->inp_buf_bytes_free < (uint64_t)chunk)
+            chunk = ctx->inp_buf_bytes_free;
+
+        buf = xma_data_from_buffer_clone(data, chunk);
+        if (!buf)
+            return AVERROR(ENOMEM);
+
+        data_used = 0;
+        rc = xma_dec_session_send_data(ctx->session, buf, &data_used);
+        xma_data_buffer_free(buf);
+        if (rc != XMA_SUCCESS || data_used <= 0) {
+            av_log(avctx, AV_LOG_ERROR, "XMA decoder did not accept data\n");
+            return AVERROR_EXTERNAL;
+        }
+
+        data += data_used;
+        size -= data_used;
+        ctx->inp_buf_bytes_free -= FFMIN(ctx->inp_buf_bytes_free, (uint64_t)data_used);
+
+        /* refresh the input buffer occupancy for the next chunk */
+        if (size > 0)
+            xma_h264_get_properties(ctx, &fprops);
+    }
+
+    return 0;
+}
+
+static int xma_h264_is_pending(XMAH264Context *ctx, const H264Picture *out)
+{
+    int i;
+
+    for (i = 0; i < ctx->nb_pending; i++)
+        if (ctx->pending[i].f->data[3] == out->f->data[3])
+            return 1;
+    return 0;
+}
+
+/**
+ * Store the pictures the kernel has finished into their surfaces.
+ *
+ * @param out picture h264dec outputs next, which has to be stored before
+ *            returning, or NULL; after the end of the stream all the
+ *            pictures have to be stored
+ */
+static int xma_h264_receive(AVCodecContext *avctx, const H264Picture *out)
+{
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    AVHWFramesContext *frames_ctx;
+    XmaFrameProperties fprops;
+    XMAH264Picture *pic;
+    int64_t start = 0;
+    int delay = XMA_H264_MIN_SLEEP;
+    int polls = 0;
+    int i, rc;
+
+    while (ctx->nb_pending) {
+        rc = xma_h264_get_properties(ctx, &fprops);
+        if (rc == XMA_ERROR) {
+            av_log(avctx, AV_LOG_ERROR, "XMA decoder failed\n");
+            return AVERROR_EXTERNAL;
+        }
+        if (rc == XMA_SEND_MORE_DATA) {
+            /* the kernel returns a picture without more input only once its
+             * input buffer is full or the stream has ended; a full buffer is
+             * waited on rather than covered by more delay in h264dec */
+            if (!ctx->eos_sent && !ctx->inp_buf_bytes_full) {
+                if (!out || !xma_h264_is_pending(ctx, out))
+                    break;
+                av_log(avctx, AV_LOG_ERROR, "XMA decoder needs more data "
+                       "before picture %d is ready\n", out->poc);
+                return AVERROR_EXTERNAL;
+            }
+
+            if (!polls++)
+                start = av_gettime_relative();
+            else if (av_gettime_relative() - start > XMA_H264_TIMEOUT) {
+                av_log(avctx, AV_LOG_ERROR, "Timed out waiting for the XMA "
+                       "decoder, %d pictures outstanding\n", ctx->nb_pending);
+                return AVERROR_EXTERNAL;
+            }
+            if (polls > XMA_H264_SPIN) {
+                av_usleep(delay);
+                delay = FFMIN(delay * 2, XMA_H264_MAX_SLEEP);
+            }
+            continue;
+        }
+        if (rc != XMA_SUCCESS)
+            break;
+
+        /* the kernel outputs in display order */
+        pic = &ctx->pending[0];
+        for (i = 1; i < ctx->nb_pending; i++) {
+            if (ctx->pending[i].epoch < pic->epoch ||
+                (ctx->pending[i].epoch == pic->epoch && ctx->pending[i].poc < pic->poc))
+                pic = &ctx->pending[i];
+        }
+
+        frames_ctx = (AVHWFramesContext*)pic->f->hw_frames_ctx->data;
+        if (fprops.width != frames_ctx->width || fprops.height != frames_ctx->height) {
+            av_log(avctx, AV_LOG_ERROR, "XMA decoder returned a %dx%d picture "
+                   "for a %dx%d surface\n", fprops.width, fprops.height,
+                   frames_ctx->width, frames_ctx->height);
+            return AVERROR_EXTERNAL;
+        }
+
+        rc = xma_dec_session_recv_frame(ctx->session, (XmaFrame *)pic->f->data[3]);
+        av_frame_free(&pic->f);
+        *pic = ctx->pending[--ctx->nb_pending];
+        if (rc != XMA_SUCCESS) {
+            av_log(avctx, AV_LOG_ERROR, "Failed to receive a picture from the XMA decoder\n");
+            return AVERROR_EXTERNAL;
+        }
+        polls = 0;
+        delay = XMA_H264_MIN_SLEEP;
+    }
+
+    if (ctx->nb_pending && (ctx->eos_sent || (out && xma_h264_is_pending(ctx, out)))) {
+        av_log(avctx, AV_LOG_ERROR, "XMA decoder did not return %d pictures\n",
+               ctx->nb_pending);
+        return AVERROR_EXTERNAL;
+    }
+
+    return 0;
+}
+
+static int xma_h264_start_frame(AVCodecContext *avctx,
+                                av_unused const uint8_t *buffer,
+                                av_unused uint32_t size)
+{
+    const H264Context *h = avctx->priv_data;
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    XMAH264Picture *pic;
+    int ret;
+
+    ctx->au_size = 0;
+
+    if (!ctx->sps_ref || ctx->sps_ref->data != h->ps.sps_ref->data ||
+        !ctx->pps_ref || ctx->pps_ref->data != h->ps.pps_ref->data) {
+        av_buffer_unref(&ctx->sps_ref);
+        av_buffer_unref(&ctx->pps_ref);
+        ctx->sps_ref = av_buffer_ref(h->ps.sps_ref);
+        ctx->pps_ref = av_buffer_ref(h->ps.pps_ref);
+        if (!ctx->sps_ref || !ctx->pps_ref)
+            return AVERROR(ENOMEM);
+
+        if ((ret = xma_h264_append_ps(avctx, h->ps.sps->data, h->ps.sps->data_size)) < 0 ||
+            (ret = xma_h264_append_ps(avctx, h->ps.pps->data, h->ps.pps->data_size)) < 0)
+            return ret;
+    }
+
+    /* the second field goes into the surface of the first one */
+    if (h->picture_structure != PICT_FRAME && !h->first_field)
+        return 0;
+
+    if (h->picture_idr || ctx->mmco_reset)
+        ctx->epoch++;
+
+    if (ctx->nb_pending == XMA_H264_MAX_PENDING) {
+        av_log(avctx, AV_LOG_WARNING, "XMA decoder lost a picture\n");
+        av_frame_free(&ctx->pending[0].f);
+        memmove(ctx->pending, ctx->pending + 1,
+                --ctx->nb_pending * sizeof(*ctx->pending));
+    }
+
+    pic = &ctx->pending[ctx->nb_pending];
+    pic->f = av_frame_clone(h->cur_pic_ptr->f);
+    if (!pic->f)
+        return AVERROR(ENOMEM);
+    pic->epoch = ctx->epoch;
+    pic->poc   = h->cur_pic_ptr->poc;
+    ctx->nb_pending++;
+
+    return 0;
+}
+
+static int xma_h264_decode_slice(AVCodecContext *avctx,
+                                 const uint8_t *buffer, uint32_t size)
+{
+    return xma_h264_append(avctx, buffer, size);
+}
+
+static int xma_h264_end_frame(AVCodecContext *avctx)
+{
+    const H264Context *h = avctx->priv_data;
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    int ret;
+
+    ctx->mmco_reset = h->cur_pic_ptr->mmco_reset;
+
+    ret = xma_h264_send(avctx, ctx->au_buf, ctx->au_size);
+    ctx->au_size = 0;
+    if (ret < 0)
+        return ret;
+
+    ret = xma_h264_receive(avctx, h->next_output_pic);
+    if (ret < 0)
+        return ret;
+
+    if (ctx->nb_pending + 1 > MAX_DELAYED_PIC_COUNT) {
+        av_log(avctx, AV_LOG_ERROR, "XMA decoder holds %d pictures, more "
+               "than h264dec can delay\n", ctx->nb_pending);
+        return AVERROR_EXTERNAL;
+    }
+    avctx->has_b_frames = FFMAX(avctx->has_b_frames, ctx->nb_pending + 1);
+
+    return 0;
+}
+
+int ff_xma_h264_flush(AVCodecContext *avctx)
+{
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    int data_used = 0;
+
+    if (!ctx->session || ctx->eos_sent)
+        return 0;
+
+    if (xma_dec_session_send_data(ctx->session, NULL, &data_used) != XMA_SUCCESS) {
+        av_log(avctx, AV_LOG_ERROR, "Failed to flush the XMA decoder\n");
+        return AVERROR_EXTERNAL;
+    }
+    ctx->eos_sent = 1;
+
+    return xma_h264_receive(avctx, NULL);
+}
+
+static av_cold int xma_h264_uninit(AVCodecContext *avctx)
+{
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+
+    /* h264dec may still output the pending pictures, e.g. when the
+     * hwaccel is set up again for a new picture size */
+    ff_xma_h264_flush(avctx);
+
+    while (ctx->nb_pending)
+        av_frame_free(&ctx->pending[--ctx->nb_pending].f);
+
+    if (ctx->session)
+        xma_dec_session_destroy(ctx->session);
+    ctx->session = NULL;
+    avpriv_xma_session_release(&ctx->slot);
+
+    av_buffer_unref(&ctx->sps_ref);
+    av_buffer_unref(&ctx->pps_ref);
+    av_freep(&ctx->au_buf);
+    ctx->au_buf_size = 0;
+
+    return 0;
+}
+
+static av_cold int xma_h264_init(AVCodecContext *avctx)
+{
+    XMAH264Context *ctx = avctx->internal->hwaccel_priv_data;
+    XmaDecoderProperties dec_props = { 0 };
+    int ret;
+
+    if (!avctx->hw_frames_ctx) {
+        av_log(avctx, AV_LOG_ERROR, "An XMA frames context is required\n");
+        return AVERROR(EINVAL);
+    }
+
+    ret = avpriv_xma_session_acquire(avctx, &ctx->slot, -1,
+                                     avpriv_xma_session_load(avctx->width, avctx->height,
+                                                             avctx->framerate));
+    if (ret < 0)
+        return ret;
+
+    ctx->ch_index = ctx->slot.channel;
+    av_strlcpy(ctx->pixel_format, "yuv420p", sizeof(ctx->pixel_format));
+
+    ctx->params[0] = (XmaParameter){ (char *)"ch_index",           XMA_UINT32, sizeof(ctx->ch_index),           &ctx->ch_index };
+    ctx->params[1] = (XmaParameter){ (char *)"pixel_format",       XMA_STRING, sizeof(ctx->pixel_format),        ctx->pixel_format };
+    ctx->params[2] = (XmaParameter){ (char *)"inp_buf_bytes_full", XMA_UINT64, sizeof(ctx->inp_buf_bytes_full), &ctx->inp_buf_bytes_full };
+    ctx->params[3] = (XmaParameter){ (char *)"inp_buf_bytes_free", XMA_UINT64, sizeof(ctx->inp_buf_bytes_free), &ctx->inp_buf_bytes_free };
+
+    strcpy(dec_props.hwvendor_string, "vyusync");
+    dec_props.hwdecoder_type = XMA_H264_DECODER_TYPE;
+    dec_props.params         = ctx->params;
+    dec_props.param_cnt      = FF_ARRAY_ELEMS(ctx->params);
+#if HAVE_XMAENCODERPROPERTIES_DEV_INDEX
+    dec_props.dev_index      = ctx->slot.device;
+#endif
+
+    ctx->session = xma_dec_session_create(&dec_props);
+    if (!ctx->session) {
+        av_log(avctx, AV_LOG_ERROR, "Unable to create an XMA H.264 decoder session\n");
+        avpriv_xma_session_release(&ctx->slot);
+        return AVERROR_EXTERNAL;
+    }
+
+    /* h264dec selects the first picture for output before it is sent */
+    avctx->has_b_frames = FFMAX(avctx->has_b_frames, 1);
+
+    return 0;
+}
+
+AVHWAccel ff_h264_xma_hwaccel = {
+    .name           = "h264_xma",
+    .type           = AVMEDIA_TYPE_VIDEO,
+    .id             = AV_CODEC_ID_H264,
+    .pix_fmt        = AV_PIX_FMT_XMA,
+    .start_frame    = xma_h264_start_frame,
+    .end_frame      = xma_h264_end_frame,
+    .decode_slice   = xma_h264_decode_slice,
+    .init           = xma_h264_init,
+    .uninit         = xma_h264_uninit,
+    .priv_data_size = sizeof(XMAH264Context),
+};
@@ -1177,16 +1177,6 @@ int avfilter_graph_request_oldest(AVFilterGraph *graph);
 
 
 
-/**
- * Flush XMA abrscaler filter.
- *
- * @param AVFilter link to pass on to filter frame to flush device buffers.
- *
- */
-#if CONFIG_LIBXMAAPI
-void xma_abrscaler_filter_flush(AVFilterLink *link);
-#endif
-
 /**
  * @}
  */
@@ -28,43 +28,171 @@
 #include <xmaplugin.h>
 
 #include "libavutil/attributes.h"
+#include "libavutil/avstring.h"
+#include "libavutil/fifo.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/hwcontext_xma_internal.h"
 #include "libavutil/internal.h"
 #include "libavutil/mem.h"
 #include "libavutil/opt.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/parseutils.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
 
 #include "avfilter.h"
+#include "filters.h"
 #include "formats.h"
 #include "internal.h"
 #include "video.h"
 
-//MAX_OUTS is dependant on corresponding XCLBIN used and can have 4 or 8.
-#define MAX_OUTS 4
-
-static int xma_filter_frame(AVFilterLink *link, AVFrame *frame);
+//MAX_OUTS is the most the XMA API allows, the XCLBIN used may support only 4.
+#define MAX_OUTS MAX_SCALER_OUTPUTS
+
+/* One output of the scaler */
+typedef struct ScaleXMARung {
+    int                width, height;
+    enum AVPixelFormat pix_fmt;
+    int                decimation;  ///< only every decimation-th frame is output
+} ScaleXMARung;
+
+static const struct {
+    enum AVPixelFormat pix_fmt;
+    XmaFormatType      format;
+    int                bits_per_pixel;
+} rung_formats[] = {
+    { AV_PIX_FMT_YUV420P,     XMA_YUV420_FMT_TYPE,  8 },
+    { AV_PIX_FMT_YUV422P,     XMA_YUV422_FMT_TYPE,  8 },
+    { AV_PIX_FMT_YUV444P,     XMA_YUV444_FMT_TYPE,  8 },
+    { AV_PIX_FMT_YUV420P16LE, XMA_YUV420_FMT_TYPE, 16 },
+    { AV_PIX_FMT_YUV422P16LE, XMA_YUV422_FMT_TYPE, 16 },
+    { AV_PIX_FMT_YUV444P16LE, XMA_YUV444_FMT_TYPE, 16 },
+};
 
 typedef struct AbrScalerContext {
     const AVClass    *class;
     int               nb_outputs;
     int               out_width[MAX_OUTS];
     int               out_height[MAX_OUTS];
+    char             *ladder;
 
-    int              *copyOutLink;
-    int               flush;
+    ScaleXMARung      rungs[MAX_OUTS];
+    int               in_format;    ///< index of the input format in rung_formats
+
+    XmaFrame         *flush_frame;  ///< frame without data, asks the scaler to flush
+    AVFifoBuffer     *props_fifo;   ///< properties of the frames in the scaler, in send order
     int               send_status;	
     int               frames_out;
+    int               eof;          ///< status of the input once it ended
+    int64_t           eof_pts;
+
+    int               xma_device;
+    XMASlot           slot;
+    XMAStats          stats;
 
     XmaScalerSession *session; 
 } AbrScalerContext;
 
 static int output_config_props(AVFilterLink *outlink);
 
+static int rung_format(enum AVPixelFormat pix_fmt)
+{
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(rung_formats); i++)
+        if (rung_formats[i].pix_fmt == pix_fmt)
+            return i;
+    return AVERROR(ENOSYS);
+}
+
+/* WxH[@pix_fmt][/decimation] */
+static int parse_rung(AVFilterContext *ctx, ScaleXMARung *r, char *str)
+{
+    char *fmt, *div, *end;
+
+    if ((div = strchr(str, '/')))
+        *div++ = 0;
+    if ((fmt = strchr(str, '@')))
+        *fmt++ = 0;
+
+    if (av_parse_video_size(&r->width, &r->height, str) < 0) {
+        av_log(ctx, AV_LOG_ERROR, "Invalid rung size '%s'\n", str);
+        return AVERROR(EINVAL);
+    }
+
+    r->pix_fmt = fmt ? av_get_pix_fmt(fmt) : AV_PIX_FMT_YUV420P;
+    if (rung_format(r->pix_fmt) < 0) {
+        av_log(ctx, AV_LOG_ERROR, "Unsupported rung format '%s'\n", fmt);
+        return AVERROR(EINVAL);
+    }
+
+    r->decimation = 1;
+    if (div) {
+        r->decimation = strtol(div, &end, 10);
+        if (*end || r->decimation < 1) {
+            av_log(ctx, AV_LOG_ERROR, "Invalid rung decimation '%s'\n", div);
+            return AVERROR(EINVAL);
+        }
+    }
+
+    return 0;
+}
+
+static int parse_ladder(AVFilterContext *ctx)
+{
+    AbrScalerContext *s = ctx->priv;
+    char *ladder, *rung, *saveptr = NULL;
+    int ret = 0;
+
+    ladder = av_strdup(s->ladder);
+    if (!ladder)
+        return AVERROR(ENOMEM);
+
+    s->nb_outputs = 0;
+    for (rung = av_strtok(ladder, "|", &saveptr); rung;
+         rung = av_strtok(NULL, "|", &saveptr)) {
+        if (s->nb_outputs == MAX_OUTS) {
+            av_log(ctx, AV_LOG_ERROR, "More than %d rungs in the ladder\n", MAX_OUTS);
+            ret = AVERROR(EINVAL);
+            break;
+        }
+        ret = parse_rung(ctx, &s->rungs[s->nb_outputs++], rung);
+        if (ret < 0)
+            break;
+    }
+    if (!ret && !s->nb_outputs) {
+        av_log(ctx, AV_LOG_ERROR, "Empty ladder\n");
+        ret = AVERROR(EINVAL);
+    }
+
+    av_free(ladder);
+    return ret;
+}
+
 static av_cold int scale_xma_init(AVFilterContext *ctx)
 {
     int               i = 0;
     AbrScalerContext *s = ctx->priv;
+    int               ret;
     s->frames_out       = 0;
 
+    s->props_fifo = av_fifo_alloc(4 * sizeof(AVFrame *));
+    if (!s->props_fifo)
+        return AVERROR(ENOMEM);
+
+    if (s->ladder) {
+        ret = parse_ladder(ctx);
+        if (ret < 0)
+            return ret;
+    } else {
+        for (i = 0; i < s->nb_outputs; i++) {
+            s->rungs[i].width      = s->out_width[i];
+            s->rungs[i].height     = s->out_height[i];
+            s->rungs[i].pix_fmt    = AV_PIX_FMT_YUV420P;
+            s->rungs[i].decimation = 1;
+        }
+    }
+
     for (i = 0; i < s->nb_outputs; i++) {
         char name[32];
         AVFilterPad pad = { 0 };
@@ -91,7 +219,17 @@ static av_cold void scale_xma_uninit(AVFilterContext *ctx)
     
     if (s->session)
         xma_scaler_session_destroy(s->session);
+    avpriv_xma_session_release(&s->slot);
 
+    xma_frame_free(s->flush_frame);
+
+    while (s->props_fifo && av_fifo_size(s->props_fifo) > 0) {
+        AVFrame *props;
+
+        av_fifo_generic_read(s->props_fifo, &props, sizeof(props), NULL);
+        av_frame_free(&props);
+    }
+    av_fifo_freep(&s->props_fifo);
 }
 
 int output_config_props(AVFilterLink *outlink)
@@ -100,10 +238,46 @@ int output_config_props(AVFilterLink *outlink)
     AbrScalerContext    *s           = ctx->priv;
     const int            outlink_idx = FF_OUTLINK_IDX(outlink);
     AVFilterLink        *out         = outlink->src->outputs[outlink_idx];
+    AVFilterLink        *inlink      = ctx->inputs[0];
+    const ScaleXMARung  *rung        = &s->rungs[outlink_idx];
 
-    out->w = s->out_width[outlink_idx];
-    out->h = s->out_height[outlink_idx];	   
+    out->w = rung->width;
+    out->h = rung->height;
     outlink->sample_aspect_ratio= (AVRational) {1, 1};
+    if (inlink->frame_rate.num > 0 && inlink->frame_rate.den > 0)
+        outlink->frame_rate = av_div_q(inlink->frame_rate,
+                                       (AVRational){ rung->decimation, 1 });
+
+    if (outlink->format == AV_PIX_FMT_XMA) {
+        AVHWFramesContext *out_frames_ctx;
+        AVBufferRef       *device_ref;
+        int                ret;
+
+        /* host input can still be scaled into frames left on the card */
+        if (inlink->hw_frames_ctx)
+            device_ref = ((AVHWFramesContext*)inlink->hw_frames_ctx->data)->device_ref;
+        else
+            device_ref = ctx->hw_device_ctx;
+        if (!device_ref) {
+            av_log(ctx, AV_LOG_ERROR, "No XMA device for output %d\n", outlink_idx);
+            return AVERROR(EINVAL);
+        }
+
+        av_buffer_unref(&outlink->hw_frames_ctx);
+        outlink->hw_frames_ctx = av_hwframe_ctx_alloc(device_ref);
+        if (!outlink->hw_frames_ctx)
+            return AVERROR(ENOMEM);
+
+        out_frames_ctx            = (AVHWFramesContext*)outlink->hw_frames_ctx->data;
+        out_frames_ctx->format    = AV_PIX_FMT_XMA;
+        out_frames_ctx->sw_format = rung->pix_fmt;
+        out_frames_ctx->width     = out->w;
+        out_frames_ctx->height    = out->h;
+
+        ret = av_hwframe_ctx_init(outlink->hw_frames_ctx);
+        if (ret < 0)
+            return ret;
+    }
 
     return 0;
 }
@@ -114,80 +288,56 @@ static int xma_config_props(AVFilterLink *outlink)
     AVFilterLink        *inlink = outlink->dst->inputs[0];
     XmaScalerProperties  props;
     AbrScalerContext    *s      = ctx->priv;
+    enum AVPixelFormat   in_pix_fmt = inlink->format;
     int n                       = 0;
+    int ret;
+
+    if (inlink->format == AV_PIX_FMT_XMA) {
+        AVHWFramesContext *frames_ctx;
+
+        if (!inlink->hw_frames_ctx) {
+            av_log(ctx, AV_LOG_ERROR, "No hw context provided on input\n");
+            return AVERROR(EINVAL);
+        }
+        frames_ctx = (AVHWFramesContext*)inlink->hw_frames_ctx->data;
+        in_pix_fmt = frames_ctx->sw_format;
+    }
+    s->in_format = rung_format(in_pix_fmt);
+    if (s->in_format < 0) {
+        av_log(ctx, AV_LOG_ERROR, "Unsupported input format %s\n",
+               av_get_pix_fmt_name(in_pix_fmt));
+        return AVERROR(ENOSYS);
+    }
 
     props.hwscaler_type = XMA_POLYPHASE_SCALER_TYPE;
     strcpy(props.hwvendor_string, "Xilinx");
     props.num_outputs   = s->nb_outputs;
 
 
-    props.input.format = XMA_YUV420_FMT_TYPE;
+    props.input.format = rung_formats[s->in_format].format;
+    props.input.bits_per_pixel = rung_formats[s->in_format].bits_per_pixel;
     props.input.width  = inlink->w;
     props.input.height = inlink->h;
     props.input.stride = inlink->w; 
 
 
-    props.output[0].format = XMA_YUV420_FMT_TYPE;
-    props.output[0].bits_per_pixel = 8;
-    props.output[0].width  = s->out_width[0];
-    props.output[0].height = s->out_height[0];
-    props.output[0].stride = s->out_width[0];
-    props.output[0].coeffLoad = 0;
-	
-	
-    props.output[1].format = XMA_YUV420_FMT_TYPE;
-    props.output[1].bits_per_pixel = 8;
-    props.output[1].width  = s->out_width[1];
-    props.output[1].height = s->out_height[1];
-    props.output[1].stride = s->out_width[1];
-    props.output[1].coeffLoad = 0;
-    
-    props.output[2].format = XMA_YUV420_FMT_TYPE;
-    props.output[2].bits_per_pixel = 8;
-    props.output[2].width  = s->out_width[2];
-    props.output[2].height = s->out_height[2];
-    props.output[2].stride = s->out_width[2];
-    props.output[2].coeffLoad = 0;
-
-    props.output[3].format = XMA_YUV420_FMT_TYPE;
-    props.output[3].bits_per_pixel = 8;
-    props.output[3].width  = s->out_width[3];
-    props.output[3].height = s->out_height[3];
-    props.output[3].stride = s->out_width[3];
-    props.output[3].coeffLoad = 0;
-   
-#if MAX_OUTS ==8
-    props.output[4].format = XMA_YUV420_FMT_TYPE;
-    props.output[4].bits_per_pixel = 8;
-    props.output[4].width  = s->out_width[4];
-    props.output[4].height = s->out_height[4];
-    props.output[4].stride = s->out_width[4];
-    props.output[4].coeffLoad = 0;
-
-    props.output[5].format = XMA_YUV420_FMT_TYPE;
-    props.output[5].bits_per_pixel = 8;
-    props.output[5].width  = s->out_width[5];
-    props.output[5].height = s->out_height[5];
-    props.output[5].stride = s->out_width[5];
-    props.output[5].coeffLoad = 0;
-
-    props.output[6].format = XMA_YUV420_FMT_TYPE;
-    props.output[6].bits_per_pixel = 8;
-    props.output[6].width  = s->out_width[6];
-    props.output[6].height = s->out_height[6];
-    props.output[6].stride = s->out_width[6];
-    props.output[6].coeffLoad = 0;
-
-    props.output[7].format = XMA_YUV420_FMT_TYPE;
-    props.output[7].bits_per_pixel = 8;
-    props.output[7].width  = s->out_width[7];
-    props.output[7].height = s->out_height[7];
-    props.output[7].stride = s->out_width[7];
-    props.output[7].coeffLoad = 0;	
-#endif
+    memset(props.output, 0, sizeof(props.output));
+    for (n = 0; n < s->nb_outputs; n++) {
+        const ScaleXMARung *rung = &s->rungs[n];
+        int f = rung_format(rung->pix_fmt);
+
+        props.output[n].format         = rung_formats[f].format;
+        props.output[n].bits_per_pixel = rung_formats[f].bits_per_pixel;
+        props.output[n].width          = rung->width;
+        props.output[n].height         = rung->height;
+        props.output[n].stride         = rung->width;
+        props.output[n].coeffLoad      = 0;
+        props.output[n].framerate.numerator   = inlink->frame_rate.num;
+        props.output[n].framerate.denominator = inlink->frame_rate.den * rung->decimation;
+    }
 
  //When coeffLoad is set to 2, app expects a FilterCoeff.txt to load coefficients from 
-    for (n=0; n<MAX_OUTS;n++)
+    for (n=0; n<s->nb_outputs;n++)
     {
       if (props.output[n].coeffLoad==2) 
       {
@@ -195,169 +345,368 @@ static int xma_config_props(AVFilterLink *outlink)
         break;
       }        
     }
-	
+
+    ret = avpriv_xma_session_acquire(ctx, &s->slot, s->xma_device,
+                                     avpriv_xma_session_load(inlink->w, inlink->h,
+                                                             inlink->frame_rate));
+    if (ret < 0)
+        return ret;
+#if HAVE_XMAENCODERPROPERTIES_DEV_INDEX
+    props.dev_index = s->slot.device;
+#endif
+
+    if (!s->flush_frame) {
+        XmaFrameProperties fprops = {
+            .format         = props.input.format,
+            .width          = props.input.width,
+            .height         = props.input.height,
+            .bits_per_pixel = props.input.bits_per_pixel,
+        };
+        XmaFrameData fdata = { { NULL } };
+
+        s->flush_frame = xma_frame_from_buffers_clone(&fprops, &fdata);
+        if (!s->flush_frame)
+            return AVERROR(ENOMEM);
+    }
+
     s->session = xma_scaler_session_create(&props);
-    if (!s->session)
-    {
-        printf("ERROR:session creation failed.\n");
-        return -1;
+    if (!s->session) {
+        av_log(ctx, AV_LOG_ERROR, "Failed to create the scaler session\n");
+        return AVERROR_EXTERNAL;
     }
 
     return 0;
 }
 
-void xma_abrscaler_filter_flush(AVFilterLink *link)
+/* Queue the properties of a frame sent to the scaler, which returns it later */
+static int push_props(AbrScalerContext *s, const AVFrame *in_frame)
 {
-    AVFilterContext     *ctx            = link->dst; 	
-    AbrScalerContext    *s              = ctx->priv;
-    int                  ret            = s->send_status;
-    int                  rtt            = -1;
-    int                 *outLink        = (int *)link;
-    AVFrame             *nframe         = av_frame_alloc();
-
-    nframe->format = XMA_YUV420_FMT_TYPE;
-    nframe->width  = 1920;
-    nframe->height = 1080;
-
-    rtt =  av_frame_get_buffer(nframe, 32);   
-    if (rtt<0) printf("Issue getting av_frame_get_buffer()\n");
-
-    if (outLink == s->copyOutLink)  
-    {	   
-       s->flush        = 1;
-       nframe->data[0] = NULL;
-       nframe->data[1] = NULL;
-       nframe->data[2] = NULL;
-   
-       while (ret !=XMA_EOS)
-       {	  
-         xma_filter_frame(link, nframe);
-         ret = s->send_status;
-       }
+    AVFrame *props;
+    int ret;
+
+    if (!av_fifo_space(s->props_fifo) &&
+        (ret = av_fifo_grow(s->props_fifo, av_fifo_size(s->props_fifo))) < 0)
+        return ret;
+
+    props = av_frame_alloc();
+    if (!props)
+        return AVERROR(ENOMEM);
+    ret = av_frame_copy_props(props, in_frame);
+    if (ret < 0) {
+        av_frame_free(&props);
+        return ret;
     }
+    props->pts = in_frame->pts;
+    av_fifo_generic_write(s->props_fifo, &props, sizeof(props), NULL);
+    return 0;
+}
 
-    av_freep(&nframe->data[0]);
-    av_freep(&nframe->data[1]);
-    av_freep(&nframe->data[2]);
-    av_frame_free(&nframe);
+/* Take the properties of the input the scaler returned with this pts, along
+ * with those of any earlier input it dropped */
+static AVFrame *pop_props(AbrScalerContext *s, int64_t pts)
+{
+    int i, nb = av_fifo_size(s->props_fifo) / sizeof(AVFrame *);
+    AVFrame *props;
+
+    for (i = 0; i < nb; i++) {
+        av_fifo_generic_peek_at(s->props_fifo, &props, i * sizeof(props),
+                                sizeof(props), NULL);
+        if (props->pts == pts)
+            break;
+    }
+    if (i == nb)
+        return NULL;
+    for (; i >= 0; i--) {
+        av_fifo_generic_read(s->props_fifo, &props, sizeof(props), NULL);
+        if (i)
+            av_frame_free(&props);
+    }
+    return props;
 }
 
-static int xma_filter_frame(AVFilterLink *link, AVFrame *frame)
+/* Send a frame to the scaler, or a flush request if in_frame is NULL, and
+ * pass the frames it returns on to the outputs. */
+static int scale_frame(AVFilterContext *ctx, AVFrame *in_frame)
 {
-    AVFilterContext     *ctx           = link->dst;
     AbrScalerContext    *s             = ctx->priv;
-    AVFrame             *in_frame      = frame;
     XmaFrame            *xframe        = NULL; 
+    XmaFrame             surface;
+    AVFrame             *props         = NULL;
     int                  ret           = 0;
     int                  i             = 0;
 
-    AVFrame             *a_frame_list[MAX_OUTS];
+    AVFrame             *a_frame_list[MAX_OUTS] = { NULL };
     XmaFrame            *x_frame_list[MAX_OUTS];
+    XmaFrame            *x_clone_list[MAX_OUTS] = { NULL };
     XmaFrameData         frame_data;
     XmaFrameProperties   frame_props;
-	
-    s->copyOutLink	= (int*)link;	
-	
-    // Clone input frame from an AVFrame to an XmaFrame
-    frame_props.format = XMA_YUV420_FMT_TYPE;
-    frame_props.width = in_frame->width;
-    frame_props.height = in_frame->height;
-    frame_props.bits_per_pixel = 8;
-	
-    //set the stride	
-    in_frame->linesize[0] = in_frame->width;
-    in_frame->linesize[1] = in_frame->width>>1;
-    in_frame->linesize[2] = in_frame->width>>1;
-
-    frame_data.data[0] = in_frame->data[0];
-    frame_data.data[1] = in_frame->data[1];
-    frame_data.data[2] = in_frame->data[2];
-
-    xframe = xma_frame_from_buffers_clone(&frame_props, 
-                                          &frame_data);
+    int64_t              start;
+
+    if (!in_frame) {
+        xframe = s->flush_frame;
+    } else if (in_frame->format == AV_PIX_FMT_XMA) {
+        // Device frames are handed to the scaler as they are, the pts is
+        // set on a copy of the header since the XmaFrame may be shared
+        surface = *(XmaFrame *)in_frame->data[3];
+        xframe  = &surface;
+    } else {
+        int linesize[4];
+
+        frame_props.format = rung_formats[s->in_format].format;
+        frame_props.width = in_frame->width;
+        frame_props.height = in_frame->height;
+        frame_props.bits_per_pixel = rung_formats[s->in_format].bits_per_pixel;
+
+        // The card reads the planes without padding
+        av_image_fill_linesizes(linesize, in_frame->format, in_frame->width);
+        if (!memcmp(linesize, in_frame->linesize, 3 * sizeof(*linesize))) {
+            // Clone input frame from an AVFrame to an XmaFrame
+            frame_data.data[0] = in_frame->data[0];
+            frame_data.data[1] = in_frame->data[1];
+            frame_data.data[2] = in_frame->data[2];
+
+            xframe = xma_frame_from_buffers_clone(&frame_props,
+                                                  &frame_data);
+        } else {
+            xframe = xma_frame_alloc(&frame_props);
+            if (xframe) {
+                uint8_t *dst[4] = { xframe->data[0].buffer, xframe->data[1].buffer,
+                                    xframe->data[2].buffer };
+
+                av_image_copy(dst, linesize, (const uint8_t **)in_frame->data,
+                              in_frame->linesize, in_frame->format,
+                              in_frame->width, in_frame->height);
+            }
+        }
+        if (!xframe) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ff_xma_stats_add(&s->stats.allocs, 1);
+        ff_xma_stats_add(&s->stats.xfer_bytes,
+                         av_image_get_buffer_size(in_frame->format, in_frame->width,
+                                                  in_frame->height, 1));
+    }
 
-    xframe->pts = in_frame->pts;
-    // Create output frames
+    if (in_frame) {
+        xframe->pts = in_frame->pts;
+        ret = push_props(s, in_frame);
+        if (ret < 0)
+            goto fail;
+    }
+    // Create output frames, rungs skipping this frame are left out of the list
     for (i = 0; i < ctx->nb_outputs; i++) 
     {
+        const ScaleXMARung *rung = &s->rungs[i];
+        int                 f    = rung_format(rung->pix_fmt);
         XmaFrameProperties fprops;
         XmaFrameData       fdata;
 
+        if (s->frames_out % rung->decimation) {
+            x_frame_list[i] = NULL;
+            continue;
+        }
+
         a_frame_list[i] = ff_get_video_buffer(ctx->outputs[i],
                                               ctx->outputs[i]->w,
                                               ctx->outputs[i]->h); 
+        if (!a_frame_list[i]) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+
+        if (a_frame_list[i]->format == AV_PIX_FMT_XMA) {
+            x_frame_list[i] = (XmaFrame *)a_frame_list[i]->data[3];
+            continue;
+        }
 
-        fprops.format = XMA_YUV420_FMT_TYPE;
+        fprops.format = rung_formats[f].format;
         fprops.width = ctx->outputs[i]->w;
         fprops.height = ctx->outputs[i]->h;
-        fprops.bits_per_pixel = 8;
+        fprops.bits_per_pixel = rung_formats[f].bits_per_pixel;
 
         fdata.data[0] = a_frame_list[i]->data[0];
         fdata.data[1] = a_frame_list[i]->data[1];
         fdata.data[2] = a_frame_list[i]->data[2];
         
-        x_frame_list[i] = xma_frame_from_buffers_clone(&fprops, &fdata);
+        x_frame_list[i] = x_clone_list[i] = xma_frame_from_buffers_clone(&fprops, &fdata);
+        if (!x_clone_list[i]) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ff_xma_stats_add(&s->stats.allocs, 1);
     } 
 
+    start = av_gettime_relative();
     s->send_status = xma_scaler_session_send_frame(s->session, xframe);
+    ff_xma_stats_add(&s->stats.send_time, av_gettime_relative() - start);
+    if (in_frame)
+        ff_xma_stats_add(&s->stats.frames, 1);
+    ff_xma_stats_set(&s->stats.in_flight,
+                     FFMAX(atomic_load(&s->stats.frames) - s->frames_out, 0));
 	
     if((s->send_status== XMA_SUCCESS) || (s->send_status == XMA_FLUSH_AGAIN)) // only receive output frame after XMA_SUCESS or XMA_FLUSH_AGAIN.
     { 
-        xma_scaler_session_recv_frame_list(s->session, x_frame_list);
-									
+        start = av_gettime_relative();
+        ret = xma_scaler_session_recv_frame_list(s->session, x_frame_list);
+        ff_xma_stats_add(&s->stats.recv_time, av_gettime_relative() - start);
+        if (ret != XMA_SUCCESS) {
+            av_log(ctx, AV_LOG_ERROR, "Error receiving frames from the scaler\n");
+            ret = AVERROR_EXTERNAL;
+            goto fail;
+        }
+        ret = 0;
+
+        // the scaler is pipelined, the outputs belong to an earlier input
+        for (i = 0; i < ctx->nb_outputs; i++)
+            if (a_frame_list[i]) {
+                props = pop_props(s, x_frame_list[i]->pts);
+                break;
+            }
+
         for (i = 0; i < ctx->nb_outputs; i++) 
         {
-           //av_frame_copy_props(a_frame_list[i], in_frame);
-           av_frame_copy_props(a_frame_list[i], in_frame);
+           if (!a_frame_list[i])
+               continue;
+
+           if (props)
+               av_frame_copy_props(a_frame_list[i], props);
            a_frame_list[i]->width = ctx->outputs[i]->w;
            a_frame_list[i]->height = ctx->outputs[i]->h;
            a_frame_list[i]->pts = x_frame_list[i]->pts;
 		
-           //set the stride
-           a_frame_list[i]->linesize[0] = a_frame_list[i]->width;
-           a_frame_list[i]->linesize[1] = (a_frame_list[i]->width)>>1;
-           a_frame_list[i]->linesize[2] = (a_frame_list[i]->width)>>1;
+           //set the stride, the card writes the planes without padding
+           if (a_frame_list[i]->format != AV_PIX_FMT_XMA) {
+               av_image_fill_linesizes(a_frame_list[i]->linesize,
+                                       a_frame_list[i]->format,
+                                       a_frame_list[i]->width);
+               ff_xma_stats_add(&s->stats.xfer_bytes,
+                                av_image_get_buffer_size(a_frame_list[i]->format,
+                                                         a_frame_list[i]->width,
+                                                         a_frame_list[i]->height, 1));
+           }
            ret = ff_filter_frame(ctx->outputs[i], a_frame_list[i]);
+           a_frame_list[i] = NULL;
            if (ret < 0)
            {
-               printf("xma_filter_frame: ff_filter_frame failed: ret=%d\n", ret);
-               break;
+               av_log(ctx, AV_LOG_ERROR, "Error sending frame to output %d\n", i);
+               goto fail;
            }
         }
         s->frames_out++;
+        ff_xma_stats_set(&s->stats.in_flight,
+                         FFMAX(atomic_load(&s->stats.frames) - s->frames_out, 0));
 		
     }
-    else // skip ff_filter_frame until output is available to support pipe-lining
-        ret = 0;
-		
-    if (s->flush == 0) 
-      av_frame_free(&frame);
+    else if (s->send_status != XMA_SEND_MORE_DATA && s->send_status != XMA_EOS)
+    {
+        av_log(ctx, AV_LOG_ERROR, "Error sending frame to the scaler: %d\n", s->send_status);
+        ret = AVERROR_EXTERNAL;
+    }
+    // otherwise skip ff_filter_frame until output is available to support pipe-lining
+
+fail:
+    av_frame_free(&props);
+    for (i = 0; i < ctx->nb_outputs; i++) {
+        xma_frame_free(x_clone_list[i]);
+        av_frame_free(&a_frame_list[i]);
+    }
+    if (in_frame && in_frame->format != AV_PIX_FMT_XMA)
+        xma_frame_free(xframe);
 	
     return ret;
 }
 
-static int xma_query_formats(AVFilterContext *ctx)
+static int xma_activate(AVFilterContext *ctx)
 {
-    static const enum AVPixelFormat pixel_formats[] = {
-        AV_PIX_FMT_YUV420P, 
-        AV_PIX_FMT_NONE,
-    };
+    AbrScalerContext    *s      = ctx->priv;
+    AVFilterLink        *inlink = ctx->inputs[0];
+    AVFrame             *in;
+    int64_t              pts;
+    int                  i, ret, status;
+
+    if (!s->eof) {
+        ret = ff_inlink_consume_frame(inlink, &in);
+        if (ret < 0)
+            return ret;
+        if (ret > 0) {
+            ret = scale_frame(ctx, in);
+            av_frame_free(&in);
+            if (ret < 0)
+                return ret;
+            /* come back even with nothing queued: a decimated output that
+             * skipped this frame is still waiting and needs more input */
+            ff_filter_set_ready(ctx, ff_inlink_check_available_frame(inlink) ? 300 : 100);
+            return 0;
+        }
+
+        if (ff_inlink_acknowledge_status(inlink, &status, &pts) > 0) {
+            s->eof     = status;
+            s->eof_pts = pts;
+        }
+    }
 
-    AVFilterFormats *pix_fmts;
-    int              ret;
+    if (s->eof) {
+        /* drain one frame per activation, so the outputs are consumed while
+         * the scaler empties and other branches of the graph keep running */
+        if (s->send_status != XMA_EOS) {
+            ret = scale_frame(ctx, NULL);
+            if (ret < 0)
+                return ret;
+            ff_filter_set_ready(ctx, 100);
+            return 0;
+        }
+        for (i = 0; i < ctx->nb_outputs; i++)
+            ff_avfilter_link_set_in_status(ctx->outputs[i], s->eof, s->eof_pts);
+        return 0;
+    }
+
+    for (i = 0; i < ctx->nb_outputs; i++) {
+        if (ctx->outputs[i]->frame_wanted_out) {
+            ff_inlink_request_frame(inlink);
+            return 0;
+        }
+    }
 
-    pix_fmts = ff_make_format_list(pixel_formats);
+    return FFERROR_NOT_READY;
+}
 
-    if ((ret = ff_set_common_formats(ctx, pix_fmts)) < 0)
+static int xma_query_formats(AVFilterContext *ctx)
+{
+    AbrScalerContext *s = ctx->priv;
+    AVFilterFormats  *pix_fmts = NULL;
+    int               i, ret;
+
+    // the input can be in any of the formats the scaler outputs
+    for (i = 0; i < FF_ARRAY_ELEMS(rung_formats); i++)
+        if ((ret = ff_add_format(&pix_fmts, rung_formats[i].pix_fmt)) < 0)
+            return ret;
+    if ((ret = ff_add_format(&pix_fmts, AV_PIX_FMT_XMA)) < 0 ||
+        (ret = ff_formats_ref(pix_fmts, &ctx->inputs[0]->out_formats)) < 0)
         return ret;
 
+    // each rung is output in its own format, in host memory or on the card
+    for (i = 0; i < ctx->nb_outputs; i++) {
+        enum AVPixelFormat out_formats[] = {
+            s->rungs[i].pix_fmt,
+            AV_PIX_FMT_XMA,
+            AV_PIX_FMT_NONE,
+        };
+
+        pix_fmts = ff_make_format_list(out_formats);
+        if ((ret = ff_formats_ref(pix_fmts, &ctx->outputs[i]->in_formats)) < 0)
+            return ret;
+    }
+
     return 0;
 }
 
 #define OFFSET(x) offsetof(AbrScalerContext, x)
 #define FLAGS (AV_OPT_FLAG_VIDEO_PARAM | AV_OPT_FLAG_FILTERING_PARAM)
 static const AVOption options[] = {
-    { "outputs", "set number of outputs", OFFSET(nb_outputs), AV_OPT_TYPE_INT, { .i64 = 4 }, 1, INT_MAX, FLAGS },
+    { "outputs", "set number of outputs", OFFSET(nb_outputs), AV_OPT_TYPE_INT, { .i64 = 4 }, 1, MAX_OUTS, FLAGS },
+    { "ladder", "set the outputs as WxH[@pix_fmt][/decimation] rungs separated by '|'", OFFSET(ladder), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, FLAGS },
+    { "xma_device", "set card to scale on, -1 for the least loaded", OFFSET(xma_device), AV_OPT_TYPE_INT, { .i64 = -1 }, -1, INT_MAX, FLAGS },
     { "out_1_width", "set width of output 1", OFFSET(out_width[0]), AV_OPT_TYPE_INT, { .i64 = 1280 }, 424, INT_MAX, FLAGS },
     { "out_1_height", "set height of output 1", OFFSET(out_height[0]), AV_OPT_TYPE_INT, { .i64 = 720 }, 240, INT_MAX, FLAGS },
     { "out_2_width", "set width of output 2", OFFSET(out_width[1]), AV_OPT_TYPE_INT, { .i64 = 852 }, 424, INT_MAX, FLAGS },
@@ -366,7 +715,6 @@ static const AVOption options[] = {
     { "out_3_height", "set height of output 3", OFFSET(out_height[2]), AV_OPT_TYPE_INT, { .i64 = 360 }, 240, INT_MAX, FLAGS },
     { "out_4_width", "set width of output 4", OFFSET(out_width[3]), AV_OPT_TYPE_INT, { .i64 = 424 }, 424, INT_MAX, FLAGS },
     { "out_4_height", "set height of output 4", OFFSET(out_height[3]), AV_OPT_TYPE_INT, { .i64 = 240 }, 240, INT_MAX, FLAGS },
-#if MAX_OUTS ==8
     { "out_5_width", "set width of output 5", OFFSET(out_width[4]), AV_OPT_TYPE_INT, { .i64 = 424 }, 424, INT_MAX, FLAGS },
     { "out_5_height", "set height of output 5", OFFSET(out_height[4]), AV_OPT_TYPE_INT, { .i64 = 240 }, 240, INT_MAX, FLAGS },
     { "out_6_width", "set width of output 6", OFFSET(out_width[5]), AV_OPT_TYPE_INT, { .i64 = 424 }, 424, INT_MAX, FLAGS },
@@ -375,7 +723,7 @@ static const AVOption options[] = {
     { "out_7_height", "set height of output 7", OFFSET(out_height[6]), AV_OPT_TYPE_INT, { .i64 = 240 }, 240, INT_MAX, FLAGS },
     { "out_8_width", "set width of output 8", OFFSET(out_width[7]), AV_OPT_TYPE_INT, { .i64 = 424 }, 424, INT_MAX, FLAGS },
     { "out_8_height", "set height of output 8", OFFSET(out_height[7]), AV_OPT_TYPE_INT, { .i64 = 240 }, 240, INT_MAX, FLAGS },	
-#endif
+    XMA_STATS_OPTIONS(AbrScalerContext, stats, FLAGS),
     { NULL }
 };
 
@@ -386,7 +734,6 @@ static const AVFilterPad avfilter_vf_scale_xma_inputs[] = {
     {
         .name         = "default",
         .type         = AVMEDIA_TYPE_VIDEO,
-        .filter_frame = xma_filter_frame,
         .config_props = xma_config_props,
     },
     { NULL }
@@ -400,7 +747,9 @@ AVFilter ff_vf_scale_xma = {
     .query_formats = xma_query_formats,
     .init          = scale_xma_init,
     .uninit        = scale_xma_uninit,
+    .activate      = xma_activate,
     .inputs        = avfilter_vf_scale_xma_inputs,
     .outputs       = NULL,
     .flags         = AVFILTER_FLAG_DYNAMIC_OUTPUTS,
+    .flags_internal = FF_FILTER_FLAG_HWFRAME_AWARE,
 };
@@ -1,5 +1,5 @@
 /*
- * Input async protocol.
+ * Input and output async protocol.
  * Copyright (c) 2015 Zhang Rui <bbcallen@gmail.com>
  *
  * This file is part of FFmpeg.
@@ -44,6 +44,7 @@
 #define BUFFER_CAPACITY         (4 * 1024 * 1024)
 #define READ_BACK_CAPACITY      (4 * 1024 * 1024)
 #define SHORT_SEEK_THRESHOLD    (256 * 1024)
+#define WRITE_CHUNK_SIZE        (64 * 1024)
 
 typedef struct RingBuffer
 {
@@ -78,6 +79,12 @@ typedef struct Context {
 
     int             abort_request;
     AVIOInterruptCB interrupt_callback;
+
+    int             write_flag;
+    int             nb_write_waits;
+
+    /* options */
+    int             write_buffer_size;
 } Context;
 
 static int ring_init(RingBuffer *ring, unsigned int capacity, int read_back_capacity)
@@ -237,6 +244,68 @@ static void *async_buffer_task(void *arg)
     return NULL;
 }
 
+static void wrapped_url_write(void *dst, void *src, int size)
+{
+    URLContext *h   = dst;
+    Context    *c   = h->priv_data;
+    int         ret;
+
+    if (c->inner_io_error < 0)
+        return;
+
+    ret = ffurl_write(c->inner, src, size);
+    c->inner_io_error = ret < 0 ? ret : 0;
+}
+
+static void *async_write_task(void *arg)
+{
+    URLContext   *h    = arg;
+    Context      *c    = h->priv_data;
+    RingBuffer   *ring = &c->ring;
+
+    while (1) {
+        int fifo_size, to_copy;
+
+        pthread_mutex_lock(&c->mutex);
+        if (async_check_interrupt(h)) {
+            c->io_error = AVERROR_EXIT;
+            pthread_cond_signal(&c->cond_wakeup_main);
+            pthread_mutex_unlock(&c->mutex);
+            break;
+        }
+
+        fifo_size = ring_size(ring);
+        if (fifo_size <= 0) {
+            pthread_cond_signal(&c->cond_wakeup_main);
+            /* the writer is closing and everything has been written */
+            if (c->io_eof_reached) {
+                pthread_mutex_unlock(&c->mutex);
+                break;
+            }
+            pthread_cond_wait(&c->cond_wakeup_background, &c->mutex);
+            pthread_mutex_unlock(&c->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&c->mutex);
+
+        to_copy = FFMIN(WRITE_CHUNK_SIZE, fifo_size);
+        ring_generic_read(ring, (void *)h, to_copy, wrapped_url_write);
+
+        pthread_mutex_lock(&c->mutex);
+        if (c->inner_io_error < 0) {
+            c->io_error = c->inner_io_error;
+            pthread_cond_signal(&c->cond_wakeup_main);
+            pthread_mutex_unlock(&c->mutex);
+            break;
+        }
+
+        pthread_cond_signal(&c->cond_wakeup_main);
+        pthread_mutex_unlock(&c->mutex);
+    }
+
+    return NULL;
+}
+
 static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **options)
 {
     Context         *c = h->priv_data;
@@ -245,7 +314,16 @@ static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **
 
     av_strstart(arg, "async:", &arg);
 
-    ret = ring_init(&c->ring, BUFFER_CAPACITY, READ_BACK_CAPACITY);
+    if ((flags & AVIO_FLAG_READ_WRITE) == AVIO_FLAG_READ_WRITE) {
+        av_log(h, AV_LOG_ERROR, "Reading and writing at the same time is not supported\n");
+        return AVERROR(ENOSYS);
+    }
+    c->write_flag = !!(flags & AVIO_FLAG_WRITE);
+
+    if (c->write_flag)
+        ret = ring_init(&c->ring, c->write_buffer_size, 0);
+    else
+        ret = ring_init(&c->ring, BUFFER_CAPACITY, READ_BACK_CAPACITY);
     if (ret < 0)
         goto fifo_fail;
 
@@ -257,7 +335,14 @@ static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **
         goto url_fail;
     }
 
-    c->logical_size = ffurl_size(c->inner);
+    if (c->write_flag && c->inner->max_packet_size) {
+        av_log(h, AV_LOG_ERROR, "Writing to a packet based protocol is not supported\n");
+        ret = AVERROR(ENOSYS);
+        goto mutex_fail;
+    }
+
+    if (!c->write_flag)
+        c->logical_size = ffurl_size(c->inner);
     h->is_streamed  = c->inner->is_streamed;
 
     ret = pthread_mutex_init(&c->mutex, NULL);
@@ -278,7 +363,8 @@ static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **
         goto cond_wakeup_background_fail;
     }
 
-    ret = pthread_create(&c->async_buffer_thread, NULL, async_buffer_task, h);
+    ret = pthread_create(&c->async_buffer_thread, NULL,
+                         c->write_flag ? async_write_task : async_buffer_task, h);
     if (ret) {
         av_log(h, AV_LOG_ERROR, "pthread_create failed : %s\n", av_err2str(ret));
         goto thread_fail;
@@ -306,7 +392,11 @@ static int async_close(URLContext *h)
     int      ret;
 
     pthread_mutex_lock(&c->mutex);
-    c->abort_request = 1;
+    /* let the writing thread flush the buffer before it exits */
+    if (c->write_flag)
+        c->io_eof_reached = 1;
+    else
+        c->abort_request = 1;
     pthread_cond_signal(&c->cond_wakeup_background);
     pthread_mutex_unlock(&c->mutex);
 
@@ -314,13 +404,19 @@ static int async_close(URLContext *h)
     if (ret != 0)
         av_log(h, AV_LOG_ERROR, "pthread_join(): %s\n", av_err2str(ret));
 
+    if (c->write_flag && c->nb_write_waits)
+        av_log(h, AV_LOG_VERBOSE, "Waited %d times for the write buffer to drain\n",
+               c->nb_write_waits);
+
     pthread_cond_destroy(&c->cond_wakeup_background);
     pthread_cond_destroy(&c->cond_wakeup_main);
     pthread_mutex_destroy(&c->mutex);
-    ffurl_close(c->inner);
+    ret = ffurl_close(c->inner);
     ring_destroy(&c->ring);
 
-    return 0;
+    if (!c->write_flag)
+        return 0;
+    return c->io_error < 0 ? c->io_error : ret;
 }
 
 static int async_read_internal(URLContext *h, void *dest, int size, int read_complete,
@@ -375,6 +471,83 @@ static int async_read(URLContext *h, unsigned char *buf, int size)
     return async_read_internal(h, buf, size, 0, NULL);
 }
 
+static int async_write(URLContext *h, const unsigned char *buf, int size)
+{
+    Context      *c        = h->priv_data;
+    RingBuffer   *ring     = &c->ring;
+    int           to_write = size;
+    int           ret      = 0;
+
+    pthread_mutex_lock(&c->mutex);
+
+    while (to_write > 0) {
+        int fifo_space, to_copy;
+        if (async_check_interrupt(h)) {
+            ret = AVERROR_EXIT;
+            break;
+        }
+        /* report the error of an earlier write on the next call */
+        if (c->io_error < 0) {
+            ret = c->io_error;
+            break;
+        }
+        fifo_space = ring_space(ring);
+        to_copy    = FFMIN(to_write, fifo_space);
+        if (to_copy > 0) {
+            ring_generic_write(ring, (void *)buf, to_copy, NULL);
+            buf            += to_copy;
+            c->logical_pos += to_copy;
+            to_write       -= to_copy;
+            ret             = size - to_write;
+            pthread_cond_signal(&c->cond_wakeup_background);
+            continue;
+        }
+        /* the buffer is full, wait for the writing thread */
+        c->nb_write_waits++;
+        pthread_cond_signal(&c->cond_wakeup_background);
+        pthread_cond_wait(&c->cond_wakeup_main, &c->mutex);
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+
+    return ret;
+}
+
+/* wait for the buffered data to be written, then seek the inner protocol */
+static int64_t async_write_seek(URLContext *h, int64_t pos, int whence)
+{
+    Context      *c    = h->priv_data;
+    RingBuffer   *ring = &c->ring;
+    int64_t       ret;
+
+    pthread_mutex_lock(&c->mutex);
+
+    while (1) {
+        if (async_check_interrupt(h)) {
+            ret = AVERROR_EXIT;
+            break;
+        }
+        if (c->io_error < 0) {
+            ret = c->io_error;
+            break;
+        }
+        if (ring_size(ring) <= 0) {
+            /* the writing thread does not access the inner protocol
+             * while the buffer is empty and the lock is held */
+            ret = ffurl_seek(c->inner, pos, whence);
+            if (ret >= 0 && whence != AVSEEK_SIZE)
+                c->logical_pos = ret;
+            break;
+        }
+        pthread_cond_signal(&c->cond_wakeup_background);
+        pthread_cond_wait(&c->cond_wakeup_main, &c->mutex);
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+
+    return ret;
+}
+
 static void fifo_do_not_copy_func(void* dest, void* src, int size) {
     // do not copy
 }
@@ -388,6 +561,9 @@ static int64_t async_seek(URLContext *h, int64_t pos, int whence)
     int fifo_size;
     int fifo_size_of_read_back;
 
+    if (c->write_flag)
+        return async_write_seek(h, pos, whence);
+
     if (whence == AVSEEK_SIZE) {
         av_log(h, AV_LOG_TRACE, "async_seek: AVSEEK_SIZE: %"PRId64"\n", (int64_t)c->logical_size);
         return c->logical_size;
@@ -464,11 +640,15 @@ static int64_t async_seek(URLContext *h, int64_t pos, int whence)
 
 #define OFFSET(x) offsetof(Context, x)
 #define D AV_OPT_FLAG_DECODING_PARAM
+#define E AV_OPT_FLAG_ENCODING_PARAM
 
 static const AVOption options[] = {
+    { "write_buffer_size", "size of the buffer holding the data waiting to be written",
+        OFFSET(write_buffer_size), AV_OPT_TYPE_INT, { .i64 = BUFFER_CAPACITY }, 4096, INT_MAX / 2, .flags = E },
     {NULL},
 };
 
+#undef E
 #undef D
 #undef OFFSET
 
@@ -483,6 +663,7 @@ const URLProtocol ff_async_protocol = {
     .name                = "async",
     .url_open2           = async_open,
     .url_read            = async_read,
+    .url_write           = async_write,
     .url_seek            = async_seek,
     .url_close           = async_close,
     .priv_data_size      = sizeof(Context),
@@ -38,6 +38,7 @@
 #include "internal.h"
 #include "isom.h"
 #include "os_support.h"
+#include "uploadpool.h"
 #include "url.h"
 
 // See ISO/IEC 23009-1:2014 5.3.9.4.4
@@ -70,7 +71,10 @@ typedef struct OutputStream {
     int init_range_length;
     int nb_segments, segments_size, segment_index;
     Segment **segments;
-    int64_t first_pts, start_pts, max_pts;
+    int segment_open;
+    int64_t segment_start_pos;
+    char segment_file[1024], full_path[1024], temp_path[1024];
+    int64_t first_pts, start_pts, max_pts, frag_start_pts;
     int64_t last_dts;
     int bit_rate;
     char bandwidth_str[64];
@@ -98,6 +102,12 @@ typedef struct DASHContext {
     const char *media_seg_name;
     AVRational min_frame_rate, max_frame_rate;
     int ambiguous_frame_rate;
+    int streaming;
+    int64_t frag_duration;
+    int64_t max_frag_duration; // longest fragment written in streaming mode
+    const char *method;
+    int upload_threads;
+    FFUploadPool *upload_pool;
 } DASHContext;
 
 static int dash_write(void *opaque, uint8_t *buf, int buf_size)
@@ -174,6 +184,12 @@ static void set_codec_str(AVFormatContext *s, AVCodecParameters *par,
     }
 }
 
+static void set_http_options(AVDictionary **options, DASHContext *c)
+{
+    if (c->method)
+        av_dict_set(options, "method", c->method, 0);
+}
+
 static void dash_free(AVFormatContext *s)
 {
     DASHContext *c = s->priv_data;
@@ -186,7 +202,7 @@ static void dash_free(AVFormatContext *s)
             av_write_trailer(os->ctx);
         if (os->ctx && os->ctx->pb)
             av_free(os->ctx->pb);
-        ff_format_io_close(s, &os->out);
+        ff_upload_pool_close(c->upload_pool, s, &os->out, 0);
         if (os->ctx)
             avformat_free_context(os->ctx);
         for (j = 0; j < os->nb_segments; j++)
@@ -194,9 +210,11 @@ static void dash_free(AVFormatContext *s)
         av_free(os->segments);
     }
     av_freep(&c->streams);
+    ff_upload_pool_free(&c->upload_pool);
 }
 
-static void output_segment_list(OutputStream *os, AVIOContext *out, DASHContext *c)
+static void output_segment_list(OutputStream *os, AVIOContext *out, DASHContext *c,
+                                int final)
 {
     int i, start_index = 0, start_number = 1;
     if (c->window_size) {
@@ -209,7 +227,14 @@ static void output_segment_list(OutputStream *os, AVIOContext *out, DASHContext
         avio_printf(out, "\t\t\t\t<SegmentTemplate timescale=\"%d\" ", timescale);
         if (!c->use_timeline)
             avio_printf(out, "duration=\"%"PRId64"\" ", c->last_duration);
-        avio_printf(out, "initialization=\"%s\" media=\"%s\" startNumber=\"%d\">\n", c->init_seg_name, c->media_seg_name, c->use_timeline ? start_number : 1);
+        avio_printf(out, "initialization=\"%s\" media=\"%s\" startNumber=\"%d\"", c->init_seg_name, c->media_seg_name, c->use_timeline ? start_number : 1);
+        if (c->streaming && !final) {
+            /* a segment can be fetched once its first fragment is written */
+            int64_t offset = FFMAX(c->last_duration - c->max_frag_duration, 0);
+            avio_printf(out, " availabilityTimeOffset=\"%.3f\" availabilityTimeComplete=\"false\"",
+                        (double)offset / AV_TIME_BASE);
+        }
+        avio_printf(out, ">\n");
         if (c->use_timeline) {
             int64_t cur_time = 0;
             avio_printf(out, "\t\t\t\t\t<SegmentTimeline>\n");
@@ -448,12 +473,15 @@ static int write_manifest(AVFormatContext *s, int final)
     int use_rename = proto && !strcmp(proto, "file");
     static unsigned int warned_non_file = 0;
     AVDictionaryEntry *title = av_dict_get(s->metadata, "title", NULL, 0);
+    AVDictionary *opts = NULL;
 
     if (!use_rename && !warned_non_file++)
         av_log(s, AV_LOG_ERROR, "Cannot use rename on non file protocol, this may lead to races and temporary partial files\n");
 
     snprintf(temp_filename, sizeof(temp_filename), use_rename ? "%s.tmp" : "%s", s->filename);
-    ret = s->io_open(s, &out, temp_filename, AVIO_FLAG_WRITE, NULL);
+    set_http_options(&opts, c);
+    ret = ff_upload_pool_open(c->upload_pool, s, &out, temp_filename, &opts);
+    av_dict_free(&opts);
     if (ret < 0) {
         av_log(s, AV_LOG_ERROR, "Unable to open %s for writing\n", temp_filename);
         return ret;
@@ -529,7 +557,7 @@ static int write_manifest(AVFormatContext *s, int final)
                 avio_printf(out, " frameRate=\"%d/%d\"", st->avg_frame_rate.num, st->avg_frame_rate.den);
             avio_printf(out, ">\n");
 
-            output_segment_list(&c->streams[i], out, c);
+            output_segment_list(&c->streams[i], out, c, final);
             avio_printf(out, "\t\t\t</Representation>\n");
         }
         avio_printf(out, "\t\t</AdaptationSet>\n");
@@ -545,7 +573,7 @@ static int write_manifest(AVFormatContext *s, int final)
 
             avio_printf(out, "\t\t\t<Representation id=\"%d\" mimeType=\"audio/mp4\" codecs=\"%s\"%s audioSamplingRate=\"%d\">\n", i, os->codec_str, os->bandwidth_str, st->codecpar->sample_rate);
             avio_printf(out, "\t\t\t\t<AudioChannelConfiguration schemeIdUri=\"urn:mpeg:dash:23003:3:audio_channel_configuration:2011\" value=\"%d\" />\n", st->codecpar->channels);
-            output_segment_list(&c->streams[i], out, c);
+            output_segment_list(&c->streams[i], out, c, final);
             avio_printf(out, "\t\t\t</Representation>\n");
         }
         avio_printf(out, "\t\t</AdaptationSet>\n");
@@ -553,7 +581,10 @@ static int write_manifest(AVFormatContext *s, int final)
     avio_printf(out, "\t</Period>\n");
     avio_printf(out, "</MPD>\n");
     avio_flush(out);
-    ff_format_io_close(s, &out);
+    // The manifest must not be uploaded before the segments it lists
+    ret = ff_upload_pool_close(c->upload_pool, s, &out, 1);
+    if (ret < 0)
+        return ret;
 
     if (use_rename)
         return avpriv_io_move(temp_filename, s->filename);
@@ -625,6 +656,19 @@ static int dash_init(AVFormatContext *s)
     if (ret < 0)
         return ret;
 
+    if (c->upload_threads) {
+        const char *proto = avio_find_protocol_name(s->filename);
+        if (!proto || (strcmp(proto, "http") && strcmp(proto, "https")) ||
+            c->single_file || c->streaming) {
+            av_log(s, AV_LOG_WARNING, "upload_threads is only supported for "
+                   "HTTP output without single_file and streaming\n");
+        } else if ((ret = ff_upload_pool_alloc(&c->upload_pool, s, c->upload_threads)) < 0) {
+            if (ret != AVERROR(ENOSYS))
+                return ret;
+            av_log(s, AV_LOG_WARNING, "upload_threads requires threads, uploading synchronously\n");
+        }
+    }
+
     for (i = 0; i < s->nb_streams; i++) {
         OutputStream *os = &c->streams[i];
         AVFormatContext *ctx;
@@ -663,7 +707,9 @@ static int dash_init(AVFormatContext *s)
             dash_fill_tmpl_params(os->initfile, sizeof(os->initfile), c->init_seg_name, i, 0, os->bit_rate, 0);
         }
         snprintf(filename, sizeof(filename), "%s%s", c->dirname, os->initfile);
-        ret = s->io_open(s, &os->out, filename, AVIO_FLAG_WRITE, NULL);
+        set_http_options(&opts, c);
+        ret = ff_upload_pool_open(c->upload_pool, s, &os->out, filename, &opts);
+        av_dict_free(&opts);
         if (ret < 0)
             return ret;
         os->init_start_pos = 0;
@@ -722,6 +768,10 @@ static int dash_write_header(AVFormatContext *s)
             return ret;
         }
     }
+    // The init segments are only uploaded along with the first segments, a
+    // manifest listing them must not be uploaded before
+    if (c->upload_pool)
+        return 0;
     ret = write_manifest(s, 0);
     if (!ret)
         av_log(s, AV_LOG_VERBOSE, "Manifest written to: %s\n", s->filename);
@@ -818,13 +868,61 @@ static int update_stream_extradata(AVFormatContext *s, OutputStream *os,
     return 0;
 }
 
+static int dash_open_segment(AVFormatContext *s, OutputStream *os, int i)
+{
+    DASHContext *c = s->priv_data;
+    AVDictionary *opts = NULL;
+    const char *proto = avio_find_protocol_name(s->filename);
+    int use_rename = proto && !strcmp(proto, "file") && !c->streaming;
+    int ret;
+
+    if (!os->init_range_length) {
+        av_write_frame(os->ctx, NULL);
+        os->init_range_length = avio_tell(os->ctx->pb);
+        if (!c->single_file &&
+            (ret = ff_upload_pool_close(c->upload_pool, s, &os->out, 0)) < 0)
+            return ret;
+    }
+
+    if (os->segment_open)
+        return 0;
+
+    os->segment_start_pos = avio_tell(os->ctx->pb);
+
+    if (!c->single_file) {
+        dash_fill_tmpl_params(os->segment_file, sizeof(os->segment_file), c->media_seg_name, i, os->segment_index, os->bit_rate, os->start_pts);
+        if (snprintf(os->full_path, sizeof(os->full_path), "%s%s", c->dirname,
+                     os->segment_file) >= sizeof(os->full_path) ||
+            snprintf(os->temp_path, sizeof(os->temp_path), use_rename ? "%s.tmp" : "%s",
+                     os->full_path) >= sizeof(os->temp_path))
+            goto path_too_long;
+        set_http_options(&opts, c);
+        ret = ff_upload_pool_open(c->upload_pool, s, &os->out, os->temp_path, &opts);
+        av_dict_free(&opts);
+        if (ret < 0)
+            return ret;
+        write_styp(os->ctx->pb);
+    } else {
+        os->segment_file[0] = '\0';
+        if (snprintf(os->full_path, sizeof(os->full_path), "%s%s", c->dirname,
+                     os->initfile) >= sizeof(os->full_path))
+            goto path_too_long;
+    }
+    os->segment_open = 1;
+    return 0;
+
+path_too_long:
+    av_log(s, AV_LOG_ERROR, "Path of the segment of representation %d is too long\n", i);
+    return AVERROR(EINVAL);
+}
+
 static int dash_flush(AVFormatContext *s, int final, int stream)
 {
     DASHContext *c = s->priv_data;
     int i, ret = 0;
 
     const char *proto = avio_find_protocol_name(s->filename);
-    int use_rename = proto && !strcmp(proto, "file");
+    int use_rename = proto && !strcmp(proto, "file") && !c->streaming;
 
     int cur_flush_segment_index = 0;
     if (stream >= 0)
@@ -832,8 +930,6 @@ static int dash_flush(AVFormatContext *s, int final, int stream)
 
     for (i = 0; i < s->nb_streams; i++) {
         OutputStream *os = &c->streams[i];
-        char filename[1024] = "", full_path[1024], temp_path[1024];
-        int64_t start_pos;
         int range_length, index_length = 0;
 
         if (!os->packets_written)
@@ -851,45 +947,29 @@ static int dash_flush(AVFormatContext *s, int final, int stream)
                 continue;
         }
 
-        if (!os->init_range_length) {
-            av_write_frame(os->ctx, NULL);
-            os->init_range_length = avio_tell(os->ctx->pb);
-            if (!c->single_file)
-                ff_format_io_close(s, &os->out);
-        }
-
-        start_pos = avio_tell(os->ctx->pb);
-
-        if (!c->single_file) {
-            dash_fill_tmpl_params(filename, sizeof(filename), c->media_seg_name, i, os->segment_index, os->bit_rate, os->start_pts);
-            snprintf(full_path, sizeof(full_path), "%s%s", c->dirname, filename);
-            snprintf(temp_path, sizeof(temp_path), use_rename ? "%s.tmp" : "%s", full_path);
-            ret = s->io_open(s, &os->out, temp_path, AVIO_FLAG_WRITE, NULL);
-            if (ret < 0)
-                break;
-            write_styp(os->ctx->pb);
-        } else {
-            snprintf(full_path, sizeof(full_path), "%s%s", c->dirname, os->initfile);
-        }
+        if ((ret = dash_open_segment(s, os, i)) < 0)
+            break;
 
         av_write_frame(os->ctx, NULL);
         avio_flush(os->ctx->pb);
         os->packets_written = 0;
+        os->segment_open = 0;
 
-        range_length = avio_tell(os->ctx->pb) - start_pos;
+        range_length = avio_tell(os->ctx->pb) - os->segment_start_pos;
         if (c->single_file) {
-            find_index_range(s, full_path, start_pos, &index_length);
+            find_index_range(s, os->full_path, os->segment_start_pos, &index_length);
         } else {
-            ff_format_io_close(s, &os->out);
+            if ((ret = ff_upload_pool_close(c->upload_pool, s, &os->out, 0)) < 0)
+                break;
 
             if (use_rename) {
-                ret = avpriv_io_move(temp_path, full_path);
+                ret = avpriv_io_move(os->temp_path, os->full_path);
                 if (ret < 0)
                     break;
             }
         }
-        add_segment(os, filename, os->start_pts, os->max_pts - os->start_pts, start_pos, range_length, index_length);
-        av_log(s, AV_LOG_VERBOSE, "Representation %d media segment %d written to: %s\n", i, os->segment_index, full_path);
+        add_segment(os, os->segment_file, os->start_pts, os->max_pts - os->start_pts, os->segment_start_pos, range_length, index_length);
+        av_log(s, AV_LOG_VERBOSE, "Representation %d media segment %d written to: %s\n", i, os->segment_index, os->full_path);
     }
 
     if (c->window_size || (final && c->remove_at_exit)) {
@@ -984,18 +1064,41 @@ static int dash_write_packet(AVFormatContext *s, AVPacket *pkt)
             os->start_pts = os->max_pts;
         else
             os->start_pts = pkt->pts;
+        os->frag_start_pts = os->start_pts;
     }
     if (os->max_pts == AV_NOPTS_VALUE)
         os->max_pts = pkt->pts + pkt->duration;
     else
         os->max_pts = FFMAX(os->max_pts, pkt->pts + pkt->duration);
     os->packets_written++;
-    return ff_write_chained(os->ctx, 0, pkt, s, 0);
+    if ((ret = ff_write_chained(os->ctx, 0, pkt, s, 0)) < 0)
+        return ret;
+
+    // In streaming mode, cut a fragment out of the running segment as soon
+    // as frag_duration worth of data has been muxed, and push it out to the
+    // segment file (or the ongoing HTTP upload) right away.
+    if (c->streaming &&
+        av_compare_ts(os->max_pts - os->frag_start_pts, st->time_base,
+                      c->frag_duration, AV_TIME_BASE_Q) >= 0) {
+        int64_t frag_duration = av_rescale_q(os->max_pts - os->frag_start_pts,
+                                             st->time_base, AV_TIME_BASE_Q);
+
+        if ((ret = dash_open_segment(s, os, pkt->stream_index)) < 0)
+            return ret;
+        av_write_frame(os->ctx, NULL);
+        avio_flush(os->ctx->pb);
+        if (os->out)
+            avio_flush(os->out);
+        os->frag_start_pts = os->max_pts;
+        c->max_frag_duration = FFMAX(c->max_frag_duration, frag_duration);
+    }
+    return 0;
 }
 
 static int dash_write_trailer(AVFormatContext *s)
 {
     DASHContext *c = s->priv_data;
+    int ret;
 
     set_bitrate(s);
 
@@ -1012,6 +1115,7 @@ static int dash_write_trailer(AVFormatContext *s)
                                          AV_TIME_BASE_Q);
     }
     dash_flush(s, 1, -1);
+    ret = ff_upload_pool_flush(c->upload_pool);
 
     if (c->remove_at_exit) {
         char filename[1024];
@@ -1024,7 +1128,7 @@ static int dash_write_trailer(AVFormatContext *s)
         unlink(s->filename);
     }
 
-    return 0;
+    return ret;
 }
 
 static int dash_check_bitstream(struct AVFormatContext *s, const AVPacket *avpkt)
@@ -1063,6 +1167,10 @@ static const AVOption options[] = {
     { "single_file_name", "DASH-templated name to be used for baseURL. Implies storing all segments in one file, accessed using byte ranges", OFFSET(single_file_name), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, E },
     { "init_seg_name", "DASH-templated name to used for the initialization segment", OFFSET(init_seg_name), AV_OPT_TYPE_STRING, {.str = "init-stream$RepresentationID$.m4s"}, 0, 0, E },
     { "media_seg_name", "DASH-templated name to used for the media segments", OFFSET(media_seg_name), AV_OPT_TYPE_STRING, {.str = "chunk-stream$RepresentationID$-$Number%05d$.m4s"}, 0, 0, E },
+    { "streaming", "Write each fragment out as soon as it is complete, for low latency live streaming", OFFSET(streaming), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, E },
+    { "frag_duration", "target duration of the fragments written in streaming mode (in microseconds), 0 writes one fragment per frame", OFFSET(frag_duration), AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, E },
+    { "method", "set the HTTP method", OFFSET(method), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "upload_threads", "number of threads uploading the finished files in the background, reusing their HTTP connections", OFFSET(upload_threads), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 64, E },
     { NULL },
 };
 
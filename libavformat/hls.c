@@ -1234,7 +1234,7 @@ static int update_init_section(struct playlist *pls, struct segment *seg)
     av_fast_malloc(&pls->init_sec_buf, &pls->init_sec_buf_size, sec_size);
 
     ret = read_from_url(pls, seg->init_section, pls->init_sec_buf,
-                        pls->init_sec_buf_size, READ_COMPLETE);
+                        sec_size, READ_COMPLETE);
     ff_format_io_close(pls->parent, &pls->input);
 
     if (ret < 0)
@@ -38,6 +38,7 @@
 #include "avio_internal.h"
 #include "internal.h"
 #include "os_support.h"
+#include "uploadpool.h"
 
 typedef enum {
   HLS_START_SEQUENCE_AS_START_NUMBER = 0,
@@ -79,6 +80,11 @@ typedef enum HLSFlags {
     HLS_TEMP_FILE = (1 << 11),
 } HLSFlags;
 
+typedef enum {
+    SEGMENT_TYPE_MPEGTS,
+    SEGMENT_TYPE_FMP4,
+} SegmentType;
+
 typedef enum {
     PLAYLIST_TYPE_NONE,
     PLAYLIST_TYPE_EVENT,
@@ -107,6 +113,10 @@ typedef struct HLSContext {
     uint32_t flags;        // enum HLSFlags
     uint32_t pl_type;      // enum PlaylistType
     char *segment_filename;
+    int segment_type;      // enum SegmentType
+    char *fmp4_init_filename;
+    char *fmp4_init_path;  // fmp4_init_filename in the playlist directory
+    int init_written;
 
     int use_localtime;      ///< flag to expand filename with localtime
     int use_localtime_mkdir;///< flag to mkdir dirname in timebased filename
@@ -150,6 +160,21 @@ typedef struct HLSContext {
 
     double initial_prog_date_time;
     char current_segment_final_filename_fmt[1024]; // when renaming segments
+
+    char *var_stream_map;   // Set by a private option.
+    char *master_pl_name;   // Set by a private option.
+    AVFormatContext **variants;
+    int nb_variants;
+    int *stream_variant;        // variant of each input stream
+    int *stream_variant_index;  // index of each input stream in its variant
+    int ref_stream;             // stream whose keyframes cut all the variants
+    int nb_cuts;                // segment boundaries passed to the variants
+    int follow_cuts;            // set in a variant, cut only where the parent says
+    int64_t cut_pts;            // next boundary set by the parent, in cut_tb
+    AVRational cut_tb;
+
+    int upload_threads;
+    FFUploadPool *upload_pool;  // shared by the variants, owned if upload_threads is set
 } HLSContext;
 
 static int get_int_from_double(double val)
@@ -819,7 +844,7 @@ static int hls_window(AVFormatContext *s, int last)
     HLSContext *hls = s->priv_data;
     HLSSegment *en;
     int target_duration = 0;
-    int ret = 0;
+    int ret = 0, err;
     AVIOContext *out = NULL;
     AVIOContext *sub_out = NULL;
     char temp_filename[1024];
@@ -838,13 +863,15 @@ static int hls_window(AVFormatContext *s, int last)
         version = 4;
         sequence = 0;
     }
+    if (hls->segment_type == SEGMENT_TYPE_FMP4)
+        version = 7;
 
     if (!use_rename && !warned_non_file++)
         av_log(s, AV_LOG_ERROR, "Cannot use rename on non file protocol, this may lead to races and temporary partial files\n");
 
     set_http_options(s, &options, hls);
     snprintf(temp_filename, sizeof(temp_filename), use_rename ? "%s.tmp" : "%s", s->filename);
-    if ((ret = s->io_open(s, &out, temp_filename, AVIO_FLAG_WRITE, &options)) < 0)
+    if ((ret = ff_upload_pool_open(hls->upload_pool, s, &out, temp_filename, &options)) < 0)
         goto fail;
 
     for (en = hls->segments; en; en = en->next) {
@@ -859,6 +886,9 @@ static int hls_window(AVFormatContext *s, int last)
     } else if (hls->pl_type == PLAYLIST_TYPE_VOD) {
         avio_printf(out, "#EXT-X-PLAYLIST-TYPE:VOD\n");
     }
+    if (hls->segment_type == SEGMENT_TYPE_FMP4)
+        avio_printf(out, "#EXT-X-MAP:URI=\"%s%s\"\n", hls->baseurl ? hls->baseurl : "",
+                    hls->fmp4_init_filename);
 
     if((hls->flags & HLS_DISCONT_START) && sequence==hls->start_sequence && hls->discontinuity_set==0 ){
         avio_printf(out, "#EXT-X-DISCONTINUITY\n");
@@ -919,7 +949,7 @@ static int hls_window(AVFormatContext *s, int last)
         avio_printf(out, "#EXT-X-ENDLIST\n");
 
     if( hls->vtt_m3u8_name ) {
-        if ((ret = s->io_open(s, &sub_out, hls->vtt_m3u8_name, AVIO_FLAG_WRITE, &options)) < 0)
+        if ((ret = ff_upload_pool_open(hls->upload_pool, s, &sub_out, hls->vtt_m3u8_name, &options)) < 0)
             goto fail;
         write_m3u8_head_block(hls, sub_out, version, target_duration, sequence);
 
@@ -940,8 +970,13 @@ static int hls_window(AVFormatContext *s, int last)
 
 fail:
     av_dict_free(&options);
-    ff_format_io_close(s, &out);
-    ff_format_io_close(s, &sub_out);
+    // Playlists are uploaded after the segments they list
+    err = ff_upload_pool_close(hls->upload_pool, s, &out, 1);
+    if (ret >= 0)
+        ret = err;
+    err = ff_upload_pool_close(hls->upload_pool, s, &sub_out, 1);
+    if (ret >= 0)
+        ret = err;
     if (ret >= 0 && use_rename)
         ff_rename(temp_filename, s->filename, s);
     return ret;
@@ -1054,17 +1089,17 @@ static int hls_start(AVFormatContext *s)
         if (err < 0)
             return err;
     } else
-        if ((err = s->io_open(s, &oc->pb, oc->filename, AVIO_FLAG_WRITE, &options)) < 0)
+        if ((err = ff_upload_pool_open(c->upload_pool, s, &oc->pb, oc->filename, &options)) < 0)
             goto fail;
     if (c->vtt_basename) {
         set_http_options(s, &options, c);
-        if ((err = s->io_open(s, &vtt_oc->pb, vtt_oc->filename, AVIO_FLAG_WRITE, &options)) < 0)
+        if ((err = ff_upload_pool_open(c->upload_pool, s, &vtt_oc->pb, vtt_oc->filename, &options)) < 0)
             goto fail;
     }
     av_dict_free(&options);
 
     /* We only require one PAT/PMT per segment. */
-    if (oc->oformat->priv_class && oc->priv_data) {
+    if (c->segment_type == SEGMENT_TYPE_MPEGTS && oc->oformat->priv_class && oc->priv_data) {
         char period[21];
 
         snprintf(period, sizeof(period), "%d", (INT_MAX / 2) - 1);
@@ -1087,15 +1122,428 @@ fail:
     return err;
 }
 
-static const char * get_default_pattern_localtime_fmt(void)
+/* movenc holds the moov back until the first fragment is flushed, so flush
+ * it into the init file before the first segment is flushed. */
+static int hls_write_init_file(AVFormatContext *s)
+{
+    HLSContext *hls = s->priv_data;
+    AVFormatContext *oc = hls->avf;
+    AVIOContext *segment_pb = oc->pb;
+    AVDictionary *options = NULL;
+    int ret;
+
+    set_http_options(s, &options, hls);
+    ret = ff_upload_pool_open(hls->upload_pool, s, &oc->pb, hls->fmp4_init_path, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Failed to open init file %s\n", hls->fmp4_init_path);
+        oc->pb = segment_pb;
+        return ret;
+    }
+
+    av_write_frame(oc, NULL);
+    ret = ff_upload_pool_close(hls->upload_pool, s, &oc->pb, 0);
+    oc->pb = segment_pb;
+    hls->init_written = 1;
+
+    return ret;
+}
+
+static const char * get_default_pattern_localtime_fmt(AVFormatContext *s)
 {
+    HLSContext *hls = s->priv_data;
     char b[21];
     time_t t = time(NULL);
     struct tm *p, tmbuf;
     p = localtime_r(&t, &tmbuf);
     // no %s support when strftime returned error or left format string unchanged
     // also no %s support on MSVC, which invokes the invalid parameter handler on unsupported format strings, instead of returning an error
-    return (HAVE_LIBC_MSVCRT || !strftime(b, sizeof(b), "%s", p) || !strcmp(b, "%s")) ? "-%Y%m%d%H%M%S.ts" : "-%s.ts";
+    if (HAVE_LIBC_MSVCRT || !strftime(b, sizeof(b), "%s", p) || !strcmp(b, "%s"))
+        return hls->segment_type == SEGMENT_TYPE_FMP4 ? "-%Y%m%d%H%M%S.m4s" : "-%Y%m%d%H%M%S.ts";
+    return hls->segment_type == SEGMENT_TYPE_FMP4 ? "-%s.m4s" : "-%s.ts";
+}
+
+static int format_variant_name(char *buf, int buf_size, const char *name, int variant)
+{
+    const char *p = strstr(name, "%v");
+
+    if (!p)
+        return AVERROR(EINVAL);
+    snprintf(buf, buf_size, "%.*s%d%s", (int)(p - name), name, variant, p + 2);
+    return 0;
+}
+
+static int parse_variant_stream_map(AVFormatContext *s)
+{
+    HLSContext *hls = s->priv_data;
+    char *map, *varstr, *spec, *saveptr1 = NULL, *saveptr2 = NULL;
+    int i, ret = 0;
+
+    hls->stream_variant       = av_malloc_array(s->nb_streams, sizeof(*hls->stream_variant));
+    hls->stream_variant_index = av_malloc_array(s->nb_streams, sizeof(*hls->stream_variant_index));
+    map = av_strdup(hls->var_stream_map);
+    if (!hls->stream_variant || !hls->stream_variant_index || !map) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    for (i = 0; i < s->nb_streams; i++)
+        hls->stream_variant[i] = -1;
+
+    for (varstr = av_strtok(map, " \t", &saveptr1); varstr;
+         varstr = av_strtok(NULL, " \t", &saveptr1)) {
+        int nb_streams = 0;
+
+        for (spec = av_strtok(varstr, ",", &saveptr2); spec;
+             spec = av_strtok(NULL, ",", &saveptr2)) {
+            enum AVMediaType type;
+            const char *p;
+            char *end;
+            int n;
+
+            if (av_strstart(spec, "v:", &p))
+                type = AVMEDIA_TYPE_VIDEO;
+            else if (av_strstart(spec, "a:", &p))
+                type = AVMEDIA_TYPE_AUDIO;
+            else if (av_strstart(spec, "s:", &p))
+                type = AVMEDIA_TYPE_SUBTITLE;
+            else
+                p = NULL;
+            n = p ? strtol(p, &end, 10) : -1;
+            if (n < 0 || end == p || *end) {
+                av_log(s, AV_LOG_ERROR, "Invalid stream '%s' in var_stream_map\n", spec);
+                ret = AVERROR(EINVAL);
+                goto fail;
+            }
+
+            for (i = 0; i < s->nb_streams; i++)
+                if (s->streams[i]->codecpar->codec_type == type && !n--)
+                    break;
+            if (i == s->nb_streams || hls->stream_variant[i] >= 0) {
+                av_log(s, AV_LOG_ERROR, "Stream '%s' in var_stream_map %s\n", spec,
+                       i == s->nb_streams ? "does not exist" : "is used twice");
+                ret = AVERROR(EINVAL);
+                goto fail;
+            }
+            hls->stream_variant[i]       = hls->nb_variants;
+            hls->stream_variant_index[i] = nb_streams++;
+        }
+        hls->nb_variants++;
+    }
+
+    for (i = 0; i < s->nb_streams; i++) {
+        if (hls->stream_variant[i] < 0) {
+            av_log(s, AV_LOG_ERROR, "Stream %d is not part of any variant in var_stream_map\n", i);
+            ret = AVERROR(EINVAL);
+            goto fail;
+        }
+    }
+    if (!hls->nb_variants) {
+        av_log(s, AV_LOG_ERROR, "No variants in var_stream_map\n");
+        ret = AVERROR(EINVAL);
+    }
+
+fail:
+    av_free(map);
+    return ret;
+}
+
+/* Write the master playlist next to the variant playlists, in the directory
+ * of the output name up to its first %v. */
+static int hls_write_master_playlist(AVFormatContext *s, AVFormatContext **variants,
+                                     int nb_variants)
+{
+    HLSContext *hls = s->priv_data;
+    AVIOContext *out = NULL;
+    AVDictionary *options = NULL;
+    const char *p = strstr(s->filename, "%v");
+    char *master_name;
+    int i, j, prefix_len = 0, ret;
+
+    for (i = 0; s->filename + i < (p ? p : s->filename + strlen(s->filename)); i++)
+        if (s->filename[i] == '/' || s->filename[i] == '\\')
+            prefix_len = i + 1;
+
+    master_name = av_asprintf("%.*s%s", prefix_len, s->filename, hls->master_pl_name);
+    if (!master_name)
+        return AVERROR(ENOMEM);
+
+    set_http_options(s, &options, hls);
+    ret = ff_upload_pool_open(hls->upload_pool, s, &out, master_name, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Failed to open master playlist %s\n", master_name);
+        av_free(master_name);
+        return ret;
+    }
+
+    avio_printf(out, "#EXTM3U\n");
+    avio_printf(out, "#EXT-X-VERSION:%d\n", hls->segment_type == SEGMENT_TYPE_FMP4 ? 7 : 3);
+    for (i = 0; i < nb_variants; i++) {
+        AVFormatContext *vs = variants[i];
+        AVCodecParameters *video = NULL;
+        int64_t bandwidth = 0;
+
+        for (j = 0; j < vs->nb_streams; j++) {
+            AVCodecParameters *par = vs->streams[j]->codecpar;
+            bandwidth += par->bit_rate;
+            if (par->codec_type == AVMEDIA_TYPE_VIDEO && !video)
+                video = par;
+        }
+        if (!bandwidth) {
+            av_log(s, AV_LOG_WARNING, "No bitrate known for variant %d, "
+                   "leaving it out of the master playlist\n", i);
+            continue;
+        }
+        if (hls->segment_type == SEGMENT_TYPE_MPEGTS)
+            bandwidth += bandwidth / 10; // MPEG-TS overhead
+
+        avio_printf(out, "#EXT-X-STREAM-INF:BANDWIDTH=%"PRId64, bandwidth);
+        if (video && video->width > 0 && video->height > 0)
+            avio_printf(out, ",RESOLUTION=%dx%d", video->width, video->height);
+        avio_printf(out, "\n%s\n", vs->filename + prefix_len);
+    }
+
+    ret = ff_upload_pool_close(hls->upload_pool, s, &out, 1);
+    av_free(master_name);
+    return ret;
+}
+
+static int hls_init_upload_pool(AVFormatContext *s)
+{
+    HLSContext *hls = s->priv_data;
+    const char *proto = avio_find_protocol_name(s->filename);
+    int ret;
+
+    if (!hls->upload_threads || hls->upload_pool)
+        return 0;
+    if (!proto || (av_strcasecmp(proto, "http") && av_strcasecmp(proto, "https")) ||
+        (hls->flags & HLS_SINGLE_FILE) || hls->max_seg_size > 0 || hls->key_info_file) {
+        av_log(s, AV_LOG_WARNING, "upload_threads is only supported for HTTP output "
+               "without single_file, hls_segment_size and encryption\n");
+        return 0;
+    }
+    ret = ff_upload_pool_alloc(&hls->upload_pool, s, hls->upload_threads);
+    if (ret == AVERROR(ENOSYS)) {
+        av_log(s, AV_LOG_WARNING, "upload_threads requires threads, uploading synchronously\n");
+        return 0;
+    }
+    return ret;
+}
+
+static void hls_free_variants(HLSContext *hls)
+{
+    int i;
+
+    for (i = 0; i < hls->nb_variants; i++)
+        if (hls->variants)
+            avformat_free_context(hls->variants[i]);
+    av_freep(&hls->variants);
+    av_freep(&hls->stream_variant);
+    av_freep(&hls->stream_variant_index);
+    hls->nb_variants = 0;
+}
+
+/* Run one chained hls muxer per variant. The segments of all variants are
+ * cut on the keyframes of a single reference stream, the first video stream,
+ * so that a player can switch between the variants at any segment. */
+static int hls_variants_write_header(AVFormatContext *s)
+{
+    HLSContext *hls = s->priv_data;
+    int i, j, v, ret;
+
+    if ((ret = parse_variant_stream_map(s)) < 0)
+        goto fail;
+
+    if (hls->nb_variants > 1 && !strstr(s->filename, "%v")) {
+        av_log(s, AV_LOG_ERROR, "The playlist name '%s' must contain %%v "
+               "with more than one variant\n", s->filename);
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+    if (hls->nb_variants > 1 && hls->segment_filename &&
+        !strstr(hls->segment_filename, "%v")) {
+        av_log(s, AV_LOG_ERROR, "The segment filename '%s' must contain %%v "
+               "with more than one variant\n", hls->segment_filename);
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    hls->variants = av_mallocz_array(hls->nb_variants, sizeof(*hls->variants));
+    if (!hls->variants) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (v = 0; v < hls->nb_variants; v++) {
+        AVFormatContext *vs;
+        HLSContext *vhls;
+        char name[1024];
+
+        ret = avformat_alloc_output_context2(&hls->variants[v], s->oformat, NULL, NULL);
+        if (ret < 0)
+            goto fail;
+        vs = hls->variants[v];
+        vhls = vs->priv_data;
+        if ((ret = av_opt_copy(vhls, hls)) < 0)
+            goto fail;
+        av_freep(&vhls->var_stream_map);
+        av_freep(&vhls->master_pl_name);
+        vhls->upload_threads = 0;
+        vhls->upload_pool    = hls->upload_pool;
+        vhls->follow_cuts    = 1;
+        vhls->cut_pts        = AV_NOPTS_VALUE;
+
+        if (format_variant_name(vs->filename, sizeof(vs->filename), s->filename, v) < 0)
+            av_strlcpy(vs->filename, s->filename, sizeof(vs->filename));
+        if (hls->segment_filename &&
+            !format_variant_name(name, sizeof(name), hls->segment_filename, v)) {
+            av_free(vhls->segment_filename);
+            if (!(vhls->segment_filename = av_strdup(name))) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+        }
+        if (hls->subtitle_filename &&
+            !format_variant_name(name, sizeof(name), hls->subtitle_filename, v)) {
+            av_free(vhls->subtitle_filename);
+            if (!(vhls->subtitle_filename = av_strdup(name))) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+        }
+        if (hls->segment_type == SEGMENT_TYPE_FMP4 && hls->nb_variants > 1) {
+            const char *init = hls->fmp4_init_filename;
+            const char *ext  = strrchr(init, '.');
+
+            if (format_variant_name(name, sizeof(name), init, v) < 0)
+                snprintf(name, sizeof(name), "%.*s_%d%s", ext ? (int)(ext - init) : (int)strlen(init),
+                         init, v, ext ? ext : "");
+            av_free(vhls->fmp4_init_filename);
+            if (!(vhls->fmp4_init_filename = av_strdup(name))) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+        }
+
+        vs->interrupt_callback = s->interrupt_callback;
+        vs->max_delay          = s->max_delay;
+        vs->flags              = s->flags;
+        vs->opaque             = s->opaque;
+        vs->io_open            = s->io_open;
+        vs->io_close           = s->io_close;
+        av_dict_copy(&vs->metadata, s->metadata, 0);
+
+        for (j = 0; ; j++) {
+            AVStream *st;
+
+            for (i = 0; i < s->nb_streams; i++)
+                if (hls->stream_variant[i] == v && hls->stream_variant_index[i] == j)
+                    break;
+            if (i == s->nb_streams)
+                break;
+            if (!(st = avformat_new_stream(vs, NULL))) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            if ((ret = avcodec_parameters_copy(st->codecpar, s->streams[i]->codecpar)) < 0)
+                goto fail;
+            st->sample_aspect_ratio = s->streams[i]->sample_aspect_ratio;
+            st->time_base           = s->streams[i]->time_base;
+            av_dict_copy(&st->metadata, s->streams[i]->metadata, 0);
+        }
+
+        if ((ret = avformat_write_header(vs, NULL)) < 0)
+            goto fail;
+    }
+
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *inner_st = hls->variants[hls->stream_variant[i]]->streams[hls->stream_variant_index[i]];
+        avpriv_set_pts_info(s->streams[i], inner_st->pts_wrap_bits,
+                            inner_st->time_base.num, inner_st->time_base.den);
+    }
+    hls->start_pts  = AV_NOPTS_VALUE;
+    hls->ref_stream = 0;
+    for (i = 0; i < s->nb_streams; i++)
+        if (s->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            hls->ref_stream = i;
+            break;
+        }
+
+    if (hls->master_pl_name &&
+        (ret = hls_write_master_playlist(s, hls->variants, hls->nb_variants)) < 0)
+        goto fail;
+
+    return 0;
+fail:
+    hls_free_variants(hls);
+    ff_upload_pool_free(&hls->upload_pool);
+    return ret;
+}
+
+/* Time at which segment n, counted from 1, ends as a single playlist would
+ * cut it: the first hls_list_size segments last hls_init_time, if it is set. */
+static int64_t hls_variants_cut_time(HLSContext *hls, int n)
+{
+    int nb_init = 0;
+
+    if (hls->init_time > 0)
+        nb_init = hls->max_nb_segments > 0 ? FFMIN(n, hls->max_nb_segments) : n;
+
+    return (int64_t)((nb_init * hls->init_time + (n - nb_init) * hls->time) * AV_TIME_BASE);
+}
+
+static int hls_variants_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    HLSContext *hls = s->priv_data;
+    AVStream *st = s->streams[pkt->stream_index];
+    AVFormatContext *vs = hls->variants[hls->stream_variant[pkt->stream_index]];
+    HLSContext *vhls = vs->priv_data;
+    int i;
+
+    if (hls->start_pts == AV_NOPTS_VALUE && pkt->pts != AV_NOPTS_VALUE)
+        hls->start_pts = av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q);
+
+    /* the boundary reaches the other variants before their packets of the
+     * same time, the interleaving orders them by dts */
+    if (pkt->stream_index == hls->ref_stream && pkt->pts != AV_NOPTS_VALUE &&
+        hls->start_pts != AV_NOPTS_VALUE &&
+        ((pkt->flags & AV_PKT_FLAG_KEY) || (hls->flags & HLS_SPLIT_BY_TIME) ||
+         st->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) &&
+        av_compare_ts(pkt->pts, st->time_base,
+                      hls->start_pts + hls_variants_cut_time(hls, hls->nb_cuts + 1),
+                      AV_TIME_BASE_Q) >= 0) {
+        for (i = 0; i < hls->nb_variants; i++) {
+            HLSContext *c = hls->variants[i]->priv_data;
+            if (c->cut_pts != AV_NOPTS_VALUE)
+                av_log(s, AV_LOG_WARNING, "Variant %d was not cut at the last "
+                       "keyframe of the reference stream, the keyframes of the "
+                       "variants are not aligned\n", i);
+            c->cut_pts = pkt->pts;
+            c->cut_tb  = st->time_base;
+        }
+        hls->nb_cuts++;
+    }
+    if (vhls->start_pts == AV_NOPTS_VALUE && hls->start_pts != AV_NOPTS_VALUE) {
+        vhls->start_pts = av_rescale_q(hls->start_pts, AV_TIME_BASE_Q, st->time_base);
+        vhls->end_pts   = vhls->start_pts;
+    }
+
+    return ff_write_chained(vs, hls->stream_variant_index[pkt->stream_index], pkt, s, 0);
+}
+
+static int hls_variants_write_trailer(AVFormatContext *s)
+{
+    HLSContext *hls = s->priv_data;
+    int i, ret = 0;
+
+    for (i = 0; i < hls->nb_variants; i++) {
+        int err = av_write_trailer(hls->variants[i]);
+        if (err < 0 && ret >= 0)
+            ret = err;
+    }
+    hls_free_variants(hls);
+    ff_upload_pool_free(&hls->upload_pool);
+    return ret;
 }
 
 static int hls_write_header(AVFormatContext *s)
@@ -1104,12 +1552,17 @@ static int hls_write_header(AVFormatContext *s)
     int ret, i;
     char *p;
     const char *pattern = "%d.ts";
-    const char *pattern_localtime_fmt = get_default_pattern_localtime_fmt();
+    const char *pattern_localtime_fmt = get_default_pattern_localtime_fmt(s);
     const char *vtt_pattern = "%d.vtt";
     AVDictionary *options = NULL;
     int basename_size;
     int vtt_basename_size;
 
+    if ((ret = hls_init_upload_pool(s)) < 0)
+        return ret;
+    if (hls->var_stream_map)
+        return hls_variants_write_header(s);
+
     if ((hls->start_sequence_source_type == HLS_START_SEQUENCE_AS_SECONDS_SINCE_EPOCH) ||
         (hls->start_sequence_source_type == HLS_START_SEQUENCE_AS_FORMATTED_DATETIME)) {
         time_t t = time(NULL); // we will need it in either case
@@ -1158,7 +1611,11 @@ static int hls_write_header(AVFormatContext *s)
                "More than a single video stream present, "
                "expect issues decoding it.\n");
 
-    hls->oformat = av_guess_format("mpegts", NULL, NULL);
+    if (hls->segment_type == SEGMENT_TYPE_FMP4) {
+        pattern = "%d.m4s";
+        hls->oformat = av_guess_format("mp4", NULL, NULL);
+    } else
+        hls->oformat = av_guess_format("mpegts", NULL, NULL);
 
     if (!hls->oformat) {
         ret = AVERROR_MUXER_NOT_FOUND;
@@ -1181,7 +1638,7 @@ static int hls_write_header(AVFormatContext *s)
         }
     } else {
         if (hls->flags & HLS_SINGLE_FILE)
-            pattern = ".ts";
+            pattern = hls->segment_type == SEGMENT_TYPE_FMP4 ? ".m4s" : ".ts";
 
         if (hls->use_localtime) {
             basename_size = strlen(s->filename) + strlen(pattern_localtime_fmt) + 1;
@@ -1216,6 +1673,14 @@ static int hls_write_header(AVFormatContext *s)
              goto fail;
         }
     }
+    if (hls->segment_type == SEGMENT_TYPE_FMP4) {
+        hls->fmp4_init_path = av_asprintf("%.*s%s", (int)(av_basename(s->filename) - s->filename),
+                                          s->filename, hls->fmp4_init_filename);
+        if (!hls->fmp4_init_path) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
     if(hls->has_subtitle) {
 
         if (hls->flags & HLS_SINGLE_FILE)
@@ -1263,6 +1728,8 @@ static int hls_write_header(AVFormatContext *s)
         goto fail;
 
     av_dict_copy(&options, hls->format_options, 0);
+    if (hls->segment_type == SEGMENT_TYPE_FMP4)
+        av_dict_set(&options, "movflags", "frag_custom+dash+delay_moov+skip_trailer", 0);
     ret = avformat_write_header(hls->avf, &options);
     if (av_dict_count(options)) {
         av_log(s, AV_LOG_ERROR, "Some of provided format options in '%s' are not recognized\n", hls->format_options_str);
@@ -1294,17 +1761,22 @@ static int hls_write_header(AVFormatContext *s)
         }
         avpriv_set_pts_info(outer_st, inner_st->pts_wrap_bits, inner_st->time_base.num, inner_st->time_base.den);
     }
+
+    if (ret >= 0 && hls->master_pl_name)
+        ret = hls_write_master_playlist(s, &s, 1);
 fail:
 
     av_dict_free(&options);
     if (ret < 0) {
         av_freep(&hls->basename);
         av_freep(&hls->vtt_basename);
+        av_freep(&hls->fmp4_init_path);
         if (hls->avf)
             avformat_free_context(hls->avf);
         if (hls->vtt_avf)
             avformat_free_context(hls->vtt_avf);
-
+        if (hls->upload_threads)
+            ff_upload_pool_free(&hls->upload_pool);
     }
     return ret;
 }
@@ -1319,6 +1791,9 @@ static int hls_write_packet(AVFormatContext *s, AVPacket *pkt)
     int ret, can_split = 1;
     int stream_index = 0;
 
+    if (hls->var_stream_map)
+        return hls_variants_write_packet(s, pkt);
+
     if (hls->sequence - hls->nb_entries > hls->start_sequence && hls->init_time > 0) {
         /* reset end_pts, hls->recording_time at end of the init hls list */
         int init_list_dur = hls->init_time * hls->nb_entries * AV_TIME_BASE;
@@ -1334,6 +1809,16 @@ static int hls_write_packet(AVFormatContext *s, AVPacket *pkt)
         oc = hls->avf;
         stream_index = pkt->stream_index;
     }
+    if (hls->segment_type == SEGMENT_TYPE_FMP4 && !oc->streams[stream_index]->codecpar->extradata_size) {
+        int side_size;
+        uint8_t *side = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &side_size);
+        if (side && side_size > 0) {
+            AVCodecParameters *par = oc->streams[stream_index]->codecpar;
+            if ((ret = ff_alloc_extradata(par, side_size)) < 0)
+                return ret;
+            memcpy(par->extradata, side, side_size);
+        }
+    }
     if (hls->start_pts == AV_NOPTS_VALUE) {
         hls->start_pts = pkt->pts;
         hls->end_pts   = pkt->pts;
@@ -1363,8 +1848,14 @@ static int hls_write_packet(AVFormatContext *s, AVPacket *pkt)
         }
 
     }
-    if (can_split && av_compare_ts(pkt->pts - hls->start_pts, st->time_base,
-                                   end_pts, AV_TIME_BASE_Q) >= 0) {
+    if (hls->follow_cuts)
+        can_split = can_split && hls->cut_pts != AV_NOPTS_VALUE &&
+                    av_compare_ts(pkt->pts, st->time_base, hls->cut_pts, hls->cut_tb) >= 0;
+    else
+        can_split = can_split && av_compare_ts(pkt->pts - hls->start_pts, st->time_base,
+                                               end_pts, AV_TIME_BASE_Q) >= 0;
+
+    if (can_split) {
         int64_t new_start_pos;
         char *old_filename = av_strdup(hls->avf->filename);
         int byterange_mode = (hls->flags & HLS_SINGLE_FILE) || (hls->max_seg_size > 0);
@@ -1373,20 +1864,30 @@ static int hls_write_packet(AVFormatContext *s, AVPacket *pkt)
             return AVERROR(ENOMEM);
         }
 
+        if (hls->segment_type == SEGMENT_TYPE_FMP4 && !hls->init_written &&
+            (ret = hls_write_init_file(s)) < 0) {
+            av_free(old_filename);
+            return ret;
+        }
+
         av_write_frame(oc, NULL); /* Flush any buffered data */
 
         new_start_pos = avio_tell(hls->avf->pb);
         hls->size = new_start_pos - hls->start_pos;
 
         if (!byterange_mode) {
-            ff_format_io_close(s, &oc->pb);
-            if (hls->vtt_avf) {
-                ff_format_io_close(s, &hls->vtt_avf->pb);
+            ret = ff_upload_pool_close(hls->upload_pool, s, &oc->pb, 0);
+            if (hls->vtt_avf && ret >= 0)
+                ret = ff_upload_pool_close(hls->upload_pool, s, &hls->vtt_avf->pb, 0);
+            if (ret < 0) {
+                av_free(old_filename);
+                return ret;
             }
         }
         if ((hls->flags & HLS_TEMP_FILE) && oc->filename[0]) {
             if (!(hls->flags & HLS_SINGLE_FILE) || (hls->max_seg_size <= 0))
-                if (hls->avf->oformat->priv_class && hls->avf->priv_data)
+                if (hls->segment_type == SEGMENT_TYPE_MPEGTS &&
+                    hls->avf->oformat->priv_class && hls->avf->priv_data)
                     av_opt_set(hls->avf->priv_data, "mpegts_flags", "resend_headers", 0);
             hls_rename_temp_file(s, oc);
         }
@@ -1400,6 +1901,7 @@ static int hls_write_packet(AVFormatContext *s, AVPacket *pkt)
 
         hls->end_pts = pkt->pts;
         hls->duration = 0;
+        hls->cut_pts = AV_NOPTS_VALUE;
 
         if (hls->flags & HLS_SINGLE_FILE) {
             hls->number++;
@@ -1440,17 +1942,24 @@ static int hls_write_trailer(struct AVFormatContext *s)
     HLSContext *hls = s->priv_data;
     AVFormatContext *oc = hls->avf;
     AVFormatContext *vtt_oc = hls->vtt_avf;
-    char *old_filename = av_strdup(hls->avf->filename);
+    char *old_filename;
+    int ret = 0, err;
+
+    if (hls->var_stream_map)
+        return hls_variants_write_trailer(s);
 
+    old_filename = av_strdup(hls->avf->filename);
     if (!old_filename) {
         return AVERROR(ENOMEM);
     }
 
+    if (hls->segment_type == SEGMENT_TYPE_FMP4 && !hls->init_written && oc->pb)
+        hls_write_init_file(s);
 
     av_write_trailer(oc);
     if (oc->pb) {
         hls->size = avio_tell(hls->avf->pb) - hls->start_pos;
-        ff_format_io_close(s, &oc->pb);
+        ret = ff_upload_pool_close(hls->upload_pool, s, &oc->pb, 0);
 
         if ((hls->flags & HLS_TEMP_FILE) && oc->filename[0]) {
             hls_rename_temp_file(s, oc);
@@ -1466,13 +1975,23 @@ static int hls_write_trailer(struct AVFormatContext *s)
         if (vtt_oc->pb)
             av_write_trailer(vtt_oc);
         hls->size = avio_tell(hls->vtt_avf->pb) - hls->start_pos;
-        ff_format_io_close(s, &vtt_oc->pb);
+        err = ff_upload_pool_close(hls->upload_pool, s, &vtt_oc->pb, 0);
+        if (ret >= 0)
+            ret = err;
     }
     av_freep(&hls->basename);
+    av_freep(&hls->fmp4_init_path);
     avformat_free_context(oc);
 
     hls->avf = NULL;
-    hls_window(s, 1);
+    err = hls_window(s, 1);
+    if (ret >= 0)
+        ret = err;
+    err = ff_upload_pool_flush(hls->upload_pool);
+    if (ret >= 0)
+        ret = err;
+    if (hls->upload_threads)
+        ff_upload_pool_free(&hls->upload_pool);
 
     if (vtt_oc) {
         av_freep(&hls->vtt_basename);
@@ -1483,7 +2002,22 @@ static int hls_write_trailer(struct AVFormatContext *s)
     hls_free_segments(hls->segments);
     hls_free_segments(hls->old_segments);
     av_free(old_filename);
-    return 0;
+    return ret;
+}
+
+static int hls_check_bitstream(struct AVFormatContext *s, const AVPacket *pkt)
+{
+    HLSContext *hls = s->priv_data;
+    AVCodecParameters *par = s->streams[pkt->stream_index]->codecpar;
+
+    /* the init file needs the parameter sets that encoders without a global
+     * header only send in band */
+    if (hls->segment_type == SEGMENT_TYPE_FMP4 && !hls->var_stream_map &&
+        !par->extradata_size &&
+        (par->codec_id == AV_CODEC_ID_H264 || par->codec_id == AV_CODEC_ID_HEVC))
+        return ff_stream_add_bitstream_filter(s->streams[pkt->stream_index],
+                                              "extract_extradata", NULL);
+    return 1;
 }
 
 #define OFFSET(x) offsetof(HLSContext, x)
@@ -1501,6 +2035,10 @@ static const AVOption options[] = {
     {"hls_allow_cache", "explicitly set whether the client MAY (1) or MUST NOT (0) cache media segments", OFFSET(allowcache), AV_OPT_TYPE_INT, {.i64 = -1}, INT_MIN, INT_MAX, E},
     {"hls_base_url",  "url to prepend to each playlist entry",   OFFSET(baseurl), AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,       E},
     {"hls_segment_filename", "filename template for segment files", OFFSET(segment_filename),   AV_OPT_TYPE_STRING, {.str = NULL},            0,       0,         E},
+    {"hls_segment_type", "set the type of the segment files", OFFSET(segment_type), AV_OPT_TYPE_INT, {.i64 = SEGMENT_TYPE_MPEGTS }, 0, SEGMENT_TYPE_FMP4, E, "segment_type"},
+    {"mpegts", "MPEG-TS segments (default)", 0, AV_OPT_TYPE_CONST, {.i64 = SEGMENT_TYPE_MPEGTS }, 0, UINT_MAX, E, "segment_type"},
+    {"fmp4", "fragmented MP4 segments with a separate init file", 0, AV_OPT_TYPE_CONST, {.i64 = SEGMENT_TYPE_FMP4 }, 0, UINT_MAX, E, "segment_type"},
+    {"hls_fmp4_init_filename", "set the name of the fragmented MP4 init file", OFFSET(fmp4_init_filename), AV_OPT_TYPE_STRING, {.str = "init.mp4"}, 0, 0, E},
     {"hls_segment_size", "maximum size per segment file, (in bytes)",  OFFSET(max_seg_size),    AV_OPT_TYPE_INT,    {.i64 = 0},               0,       INT_MAX,   E},
     {"hls_key_info_file",    "file with key URI and key file path", OFFSET(key_info_file),      AV_OPT_TYPE_STRING, {.str = NULL},            0,       0,         E},
     {"hls_subtitle_path",     "set path of hls subtitles", OFFSET(subtitle_filename), AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,    E},
@@ -1527,6 +2065,9 @@ static const AVOption options[] = {
     {"generic", "start_number value (default)", 0, AV_OPT_TYPE_CONST, {.i64 = HLS_START_SEQUENCE_AS_START_NUMBER }, INT_MIN, INT_MAX, E, "start_sequence_source_type" },
     {"epoch", "seconds since epoch", 0, AV_OPT_TYPE_CONST, {.i64 = HLS_START_SEQUENCE_AS_SECONDS_SINCE_EPOCH }, INT_MIN, INT_MAX, E, "start_sequence_source_type" },
     {"datetime", "current datetime as YYYYMMDDhhmmss", 0, AV_OPT_TYPE_CONST, {.i64 = HLS_START_SEQUENCE_AS_FORMATTED_DATETIME }, INT_MIN, INT_MAX, E, "start_sequence_source_type" },
+    {"var_stream_map", "variant streams, e.g. \"v:0,a:0 v:1,a:1\", each written to its own playlist", OFFSET(var_stream_map), AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,    E},
+    {"master_pl_name", "write a master playlist with this name next to the variant playlists", OFFSET(master_pl_name), AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,    E},
+    {"upload_threads", "number of threads uploading the finished files in the background, reusing their HTTP connections", OFFSET(upload_threads), AV_OPT_TYPE_INT, {.i64 = 0}, 0, 64, E},
     { NULL },
 };
 
@@ -1550,5 +2091,6 @@ AVOutputFormat ff_hls_muxer = {
     .write_header   = hls_write_header,
     .write_packet   = hls_write_packet,
     .write_trailer  = hls_write_trailer,
+    .check_bitstream = hls_check_bitstream,
     .priv_class     = &hls_class,
 };
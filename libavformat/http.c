@@ -299,12 +299,33 @@ fail:
     return ff_http_averror(s->http_code, AVERROR(EIO));
 }
 
+static int http_shutdown(URLContext *h, int flags);
+
 int ff_http_do_new_request(URLContext *h, const char *uri)
 {
     HTTPContext *s = h->priv_data;
     AVDictionary *options = NULL;
     int ret;
 
+    if ((h->flags & AVIO_FLAG_WRITE) && !s->post_data) {
+        char proto1[10], proto2[10], hostname1[1024], hostname2[1024];
+        int port1, port2;
+
+        /* Finish the previous upload. The connection can only be reused
+         * if its reply has been read, which requires chunked encoding and
+         * persistent connections, and only for the same server. */
+        if (!s->end_chunked_post && (ret = http_shutdown(h, h->flags)) < 0)
+            return ret;
+        av_url_split(proto1, sizeof(proto1), NULL, 0, hostname1, sizeof(hostname1),
+                     &port1, NULL, 0, s->location);
+        av_url_split(proto2, sizeof(proto2), NULL, 0, hostname2, sizeof(hostname2),
+                     &port2, NULL, 0, uri);
+        if (!s->multiple_requests || !s->chunked_post || s->willclose ||
+            strcmp(proto1, proto2) || strcmp(hostname1, hostname2) ||
+            port1 != port2)
+            ffurl_closep(&s->hd);
+    }
+
     s->off           = 0;
     s->icy_data_read = 0;
     av_free(s->location);
@@ -1533,6 +1554,36 @@ static int http_write(URLContext *h, const uint8_t *buf, int size)
     return size;
 }
 
+/* read the reply to an upload, so that the connection can be reused */
+static int http_read_reply(URLContext *h)
+{
+    HTTPContext *s = h->priv_data;
+    uint8_t buf[1024];
+    int new_location = 0, ret;
+
+    ret = http_read_header(h, &new_location);
+    if (ret >= 0 && s->http_code >= 300)
+        ret = ff_http_averror(s->http_code, AVERROR(EIO));
+    if (ret < 0) {
+        s->willclose = 1;
+        return ret;
+    }
+
+    if (s->chunksize == UINT64_MAX && s->filesize == UINT64_MAX) {
+        /* the reply body ends with the connection */
+        if (s->http_code != 204)
+            s->willclose = 1;
+        return 0;
+    }
+    while ((ret = http_buf_read(h, buf, sizeof(buf))) > 0)
+        ;
+    if (ret < 0 && ret != AVERROR_EOF) {
+        s->willclose = 1;
+        return ret;
+    }
+    return 0;
+}
+
 static int http_shutdown(URLContext *h, int flags)
 {
     int ret = 0;
@@ -1545,6 +1596,12 @@ static int http_shutdown(URLContext *h, int flags)
         ret = ffurl_write(s->hd, footer, sizeof(footer) - 1);
         ret = ret > 0 ? 0 : ret;
         s->end_chunked_post = 1;
+
+        /* with persistent connections, wait for the server to accept the
+         * upload before the connection is used for the next request */
+        if (!ret && (flags & AVIO_FLAG_WRITE) && s->multiple_requests &&
+            !s->listen && !s->post_data)
+            ret = http_read_reply(h);
     }
 
     return ret;
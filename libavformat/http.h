@@ -40,6 +40,10 @@ void ff_http_init_auth_state(URLContext *dest, const URLContext *src);
 /**
  * Send a new HTTP request, reusing the old connection.
  *
+ * For an upload, the previous request is finished first. Its connection is
+ * only reused with multiple_requests and chunked_post set and for the same
+ * server; otherwise a new connection is opened.
+ *
  * @param h pointer to the resource
  * @param uri uri used to perform the request
  * @return a negative value if an error condition occurred, 0
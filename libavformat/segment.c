@@ -32,6 +32,7 @@
 #include "avformat.h"
 #include "avio_internal.h"
 #include "internal.h"
+#include "uploadpool.h"
 
 #include "libavutil/avassert.h"
 #include "libavutil/internal.h"
@@ -126,6 +127,9 @@ typedef struct SegmentContext {
     SegmentListEntry cur_entry;
     SegmentListEntry *segment_list_entries;
     SegmentListEntry *segment_list_entries_end;
+
+    int upload_threads;
+    FFUploadPool *upload_pool;
 } SegmentContext;
 
 static void print_csv_escaped_str(AVIOContext *ctx, const char *str)
@@ -247,7 +251,7 @@ static int segment_start(AVFormatContext *s, int write_header)
     if ((err = set_segment_filename(s)) < 0)
         return err;
 
-    if ((err = s->io_open(s, &oc->pb, oc->filename, AVIO_FLAG_WRITE, NULL)) < 0) {
+    if ((err = ff_upload_pool_open(seg->upload_pool, s, &oc->pb, oc->filename, NULL)) < 0) {
         av_log(s, AV_LOG_ERROR, "Failed to open segment '%s'\n", oc->filename);
         return err;
     }
@@ -277,7 +281,9 @@ static int segment_list_open(AVFormatContext *s)
     int ret;
 
     snprintf(seg->temp_list_filename, sizeof(seg->temp_list_filename), seg->use_rename ? "%s.tmp" : "%s", seg->list);
-    ret = s->io_open(s, &seg->list_pb, seg->temp_list_filename, AVIO_FLAG_WRITE, NULL);
+    /* a list that is appended to stays open, it is only uploaded when rewritten */
+    ret = ff_upload_pool_open(seg->list_size || seg->list_type == LIST_TYPE_M3U8 ? seg->upload_pool : NULL,
+                              s, &seg->list_pb, seg->temp_list_filename, NULL);
     if (ret < 0) {
         av_log(s, AV_LOG_ERROR, "Failed to open segment list '%s'\n", seg->list);
         return ret;
@@ -364,6 +370,12 @@ static int segment_end(AVFormatContext *s, int write_trailer, int is_last)
         av_log(s, AV_LOG_ERROR, "Failure occurred when ending segment '%s'\n",
                oc->filename);
 
+    /* close the segment before the list referencing it is written, so that
+     * it is also queued first when uploading in the background */
+    err = ff_upload_pool_close(seg->upload_pool, oc, &oc->pb, 0);
+    if (ret >= 0)
+        ret = err;
+
     if (seg->list) {
         if (seg->list_size || seg->list_type == LIST_TYPE_M3U8) {
             SegmentListEntry *entry = av_mallocz(sizeof(*entry));
@@ -395,7 +407,8 @@ static int segment_end(AVFormatContext *s, int write_trailer, int is_last)
                 segment_list_print_entry(seg->list_pb, seg->list_type, entry, s);
             if (seg->list_type == LIST_TYPE_M3U8 && is_last)
                 avio_printf(seg->list_pb, "#EXT-X-ENDLIST\n");
-            ff_format_io_close(s, &seg->list_pb);
+            if ((ret = ff_upload_pool_close(seg->upload_pool, s, &seg->list_pb, 1)) < 0)
+                goto end;
             if (seg->use_rename)
                 ff_rename(seg->temp_list_filename, seg->list, s);
         } else {
@@ -432,8 +445,6 @@ static int segment_end(AVFormatContext *s, int write_trailer, int is_last)
     }
 
 end:
-    ff_format_io_close(oc, &oc->pb);
-
     return ret;
 }
 
@@ -634,9 +645,10 @@ static int select_reference_stream(AVFormatContext *s)
 static void seg_free(AVFormatContext *s)
 {
     SegmentContext *seg = s->priv_data;
-    ff_format_io_close(seg->avf, &seg->list_pb);
+    ff_upload_pool_close(seg->upload_pool, seg->avf, &seg->list_pb, 0);
     avformat_free_context(seg->avf);
     seg->avf = NULL;
+    ff_upload_pool_free(&seg->upload_pool);
 }
 
 static int seg_init(AVFormatContext *s)
@@ -702,6 +714,17 @@ static int seg_init(AVFormatContext *s)
         }
     }
 
+    if (seg->upload_threads) {
+        const char *proto = avio_find_protocol_name(s->filename);
+        if (!proto || (strcmp(proto, "http") && strcmp(proto, "https"))) {
+            av_log(s, AV_LOG_WARNING, "upload_threads is only supported for HTTP output\n");
+        } else if ((ret = ff_upload_pool_alloc(&seg->upload_pool, s, seg->upload_threads)) < 0) {
+            if (ret != AVERROR(ENOSYS))
+                return ret;
+            av_log(s, AV_LOG_WARNING, "upload_threads requires threads, uploading synchronously\n");
+        }
+    }
+
     if (seg->list) {
         if (seg->list_type == LIST_TYPE_UNDEFINED) {
             if      (av_match_ext(seg->list, "csv" )) seg->list_type = LIST_TYPE_CSV;
@@ -746,9 +769,9 @@ static int seg_init(AVFormatContext *s)
     oc = seg->avf;
 
     if (seg->write_header_trailer) {
-        if ((ret = s->io_open(s, &oc->pb,
-                              seg->header_filename ? seg->header_filename : oc->filename,
-                              AVIO_FLAG_WRITE, NULL)) < 0) {
+        if ((ret = ff_upload_pool_open(seg->upload_pool, s, &oc->pb,
+                                       seg->header_filename ? seg->header_filename : oc->filename,
+                                       NULL)) < 0) {
             av_log(s, AV_LOG_ERROR, "Failed to open segment '%s'\n", oc->filename);
             return ret;
         }
@@ -771,7 +794,7 @@ static int seg_init(AVFormatContext *s)
     av_dict_free(&options);
 
     if (ret < 0) {
-        ff_format_io_close(oc, &oc->pb);
+        ff_upload_pool_close(seg->upload_pool, oc, &oc->pb, 0);
         return ret;
     }
     seg->segment_frame_count = 0;
@@ -828,11 +851,12 @@ static int seg_write_header(AVFormatContext *s)
     if (!seg->write_header_trailer || seg->header_filename) {
         if (seg->header_filename) {
             av_write_frame(oc, NULL);
-            ff_format_io_close(oc, &oc->pb);
+            if ((ret = ff_upload_pool_close(seg->upload_pool, oc, &oc->pb, 0)) < 0)
+                return ret;
         } else {
             close_null_ctxp(&oc->pb);
         }
-        if ((ret = oc->io_open(oc, &oc->pb, oc->filename, AVIO_FLAG_WRITE, NULL)) < 0)
+        if ((ret = ff_upload_pool_open(seg->upload_pool, oc, &oc->pb, oc->filename, NULL)) < 0)
             return ret;
         if (!seg->individual_header_trailer)
             oc->pb->seekable = 0;
@@ -957,7 +981,7 @@ static int seg_write_trailer(struct AVFormatContext *s)
     SegmentContext *seg = s->priv_data;
     AVFormatContext *oc = seg->avf;
     SegmentListEntry *cur, *next;
-    int ret = 0;
+    int ret = 0, err;
 
     if (!oc)
         goto fail;
@@ -972,9 +996,12 @@ static int seg_write_trailer(struct AVFormatContext *s)
     } else {
         ret = segment_end(s, 1, 1);
     }
+    err = ff_upload_pool_flush(seg->upload_pool);
+    if (ret >= 0)
+        ret = err;
 fail:
     if (seg->list)
-        ff_format_io_close(s, &seg->list_pb);
+        ff_upload_pool_close(seg->upload_pool, s, &seg->list_pb, 0);
 
     av_dict_free(&seg->format_options);
     av_opt_free(seg);
@@ -1057,6 +1084,7 @@ static const AVOption options[] = {
     { "reset_timestamps", "reset timestamps at the begin of each segment", OFFSET(reset_timestamps), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, E },
     { "initial_offset", "set initial timestamp offset", OFFSET(initial_offset), AV_OPT_TYPE_DURATION, {.i64 = 0}, -INT64_MAX, INT64_MAX, E },
     { "write_empty_segments", "allow writing empty 'filler' segments", OFFSET(write_empty), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, E },
+    { "upload_threads", "number of threads uploading the finished files in the background, reusing their HTTP connections", OFFSET(upload_threads), AV_OPT_TYPE_INT, {.i64 = 0}, 0, 64, E },
     { NULL },
 };
 
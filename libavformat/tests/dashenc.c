@@ -0,0 +1,475 @@
+/*
+ * DASH uploading over HTTP
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Mux a stream with the dash muxer to a local HTTP server.
+ *
+ * Without arguments, the muxer runs in streaming mode and the server prints
+ * every request it gets and how its body was chunked. Each fragment of a
+ * segment must be uploaded as its own chunk.
+ *
+ * With "upload", the files are uploaded by 2 threads over kept alive
+ * connections, which the server drops after every 2 requests, so that the
+ * uploads have to be retried on new connections. The server checks that
+ * every manifest arrives after the segments it lists. The muxing is then
+ * repeated with a server failing the upload of a segment, which must fail
+ * the muxing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/channel_layout.h"
+#include "libavutil/thread.h"
+#include "libavformat/avformat.h"
+#include "libavformat/network.h"
+
+#define MAX_REQUESTS    64
+#define MAX_CONNECTIONS 64
+#define UPLOAD_THREADS  2
+
+typedef struct Request {
+    char line[256];     /* method and path */
+    int chunked;
+    int nb_chunks;
+    int64_t size;
+    int early;          /* a manifest listing a segment not received yet */
+} Request;
+
+typedef struct Server {
+    int fd;
+    int serial;         /* serve the connections one after the other */
+    int keep;           /* requests served per connection, 0 for no limit */
+    const char *fail;   /* path replied to with an error */
+
+    pthread_mutex_t lock;
+    Request requests[MAX_REQUESTS];
+    int nb_requests;
+    pthread_t threads[MAX_CONNECTIONS];
+    int nb_connections;
+    int nb_open, max_open;
+    int reused;         /* a connection served several requests */
+    int stop_port;      /* port of the connection made once the muxer is done */
+} Server;
+
+typedef struct Connection {
+    Server *server;
+    int fd;
+} Connection;
+
+typedef struct Reader {
+    int fd;
+    uint8_t buf[4096];
+    int pos, len;
+} Reader;
+
+static int read_byte(Reader *r)
+{
+    if (r->pos == r->len) {
+        r->len = recv(r->fd, r->buf, sizeof(r->buf), 0);
+        r->pos = 0;
+        if (r->len <= 0) {
+            r->len = 0;
+            return -1;
+        }
+    }
+    return r->buf[r->pos++];
+}
+
+/* Read a line without its CRLF, return its length or -1 at the end. */
+static int read_line(Reader *r, char *line, int size)
+{
+    int c, len = 0;
+
+    while ((c = read_byte(r)) >= 0 && c != '\n')
+        if (c != '\r' && len < size - 1)
+            line[len++] = c;
+    line[len] = '\0';
+    return c < 0 && !len ? -1 : len;
+}
+
+/* Read size bytes of body, keeping what fits in body. */
+static int read_body(Reader *r, char *body, int *body_len, int body_size, int64_t size)
+{
+    int c;
+
+    for (; size > 0; size--) {
+        if ((c = read_byte(r)) < 0)
+            return -1;
+        if (*body_len < body_size - 1)
+            body[(*body_len)++] = c;
+    }
+    body[*body_len] = '\0';
+    return 0;
+}
+
+static int read_request(Reader *r, Request *req, char *body, int body_size)
+{
+    char line[1024];
+    int64_t size = 0;
+    int body_len = 0;
+
+    body[0] = '\0';
+    if (read_line(r, req->line, sizeof(req->line)) <= 0)
+        return -1;
+    /* drop the HTTP version */
+    if (strrchr(req->line, ' '))
+        *strrchr(req->line, ' ') = '\0';
+
+    while (read_line(r, line, sizeof(line)) > 0) {
+        if (!av_strncasecmp(line, "Transfer-Encoding: chunked", 26))
+            req->chunked = 1;
+        else if (!av_strncasecmp(line, "Content-Length:", 15))
+            size = strtoll(line + 15, NULL, 10);
+    }
+
+    if (!req->chunked) {
+        req->size = size;
+        return read_body(r, body, &body_len, body_size, size);
+    }
+    for (;;) {
+        if (read_line(r, line, sizeof(line)) < 0)
+            return -1;
+        /* the last chunk is followed by the empty line ending the trailer */
+        if (!(size = strtoll(line, NULL, 16)))
+            return read_line(r, line, sizeof(line)) < 0 ? -1 : 0;
+        req->nb_chunks++;
+        req->size += size;
+        if (read_body(r, body, &body_len, body_size, size) < 0 ||
+            read_line(r, line, sizeof(line)) < 0)
+            return -1;
+    }
+}
+
+static int is_received(Server *server, const char *name)
+{
+    int i;
+
+    for (i = 0; i < server->nb_requests; i++) {
+        const char *path = strrchr(server->requests[i].line, '/');
+        if (path && !strcmp(path + 1, name))
+            return 1;
+    }
+    return 0;
+}
+
+/* Check that the files listed by a manifest were all received. */
+static int is_early(Server *server, const char *body)
+{
+    static const char *const attrs[] = { "sourceURL=\"", "media=\"" };
+    char name[256];
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(attrs); i++) {
+        const char *p = body;
+
+        while ((p = strstr(p, attrs[i]))) {
+            int len;
+
+            p  += strlen(attrs[i]);
+            len = strcspn(p, "\"");
+            av_strlcpy(name, p, FFMIN(len + 1, sizeof(name)));
+            if (!is_received(server, name))
+                return 1;
+            p += len;
+        }
+    }
+    return 0;
+}
+
+static void *connection_thread(void *arg)
+{
+    Connection *conn = arg;
+    Server *server = conn->server;
+    static const char reply[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    static const char error[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+    Reader r = { 0 };
+    char body[8192];
+    int n;
+
+    r.fd = conn->fd;
+    for (n = 0; !server->keep || n < server->keep; n++) {
+        Request req = { { 0 } };
+        int fail;
+
+        if (read_request(&r, &req, body, sizeof(body)) < 0)
+            break;
+
+        fail = server->fail && strstr(req.line, server->fail);
+        pthread_mutex_lock(&server->lock);
+        if (n)
+            server->reused = 1;
+        /* a dropped connection is counted as closed with its last reply,
+         * after which the client may already open a new one */
+        if (n + 1 == server->keep)
+            server->nb_open--;
+        if (!fail && server->nb_requests < MAX_REQUESTS) {
+            if (strstr(req.line, ".mpd"))
+                req.early = is_early(server, body);
+            server->requests[server->nb_requests++] = req;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        if (fail)
+            send(r.fd, error, sizeof(error) - 1, 0);
+        else
+            send(r.fd, reply, sizeof(reply) - 1, 0);
+    }
+    closesocket(r.fd);
+
+    if (!server->keep || n < server->keep) {
+        pthread_mutex_lock(&server->lock);
+        server->nb_open--;
+        pthread_mutex_unlock(&server->lock);
+    }
+    av_free(conn);
+    return NULL;
+}
+
+static void *server_thread(void *arg)
+{
+    Server *server = arg;
+
+    for (;;) {
+        Connection *conn;
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd, stop;
+
+        if ((fd = accept(server->fd, (struct sockaddr *)&peer, &peer_len)) < 0)
+            break;
+        pthread_mutex_lock(&server->lock);
+        stop = peer.sin_port == server->stop_port ||
+               server->nb_connections == MAX_CONNECTIONS;
+        if (!stop) {
+            server->nb_open++;
+            server->max_open = FFMAX(server->max_open, server->nb_open);
+        }
+        pthread_mutex_unlock(&server->lock);
+        if (stop || !(conn = av_mallocz(sizeof(*conn)))) {
+            closesocket(fd);
+            break;
+        }
+
+        conn->server = server;
+        conn->fd     = fd;
+        if (server->serial) {
+            connection_thread(conn);
+            continue;
+        }
+        if (pthread_create(&server->threads[server->nb_connections], NULL,
+                           connection_thread, conn)) {
+            closesocket(fd);
+            av_free(conn);
+            break;
+        }
+        server->nb_connections++;
+    }
+    return NULL;
+}
+
+static int mux(const char *url, int upload)
+{
+    AVFormatContext *oc = NULL;
+    AVDictionary *opts = NULL;
+    AVStream *st;
+    AVPacket pkt;
+    uint8_t data[209];
+    int i, ret;
+
+    if ((ret = avformat_alloc_output_context2(&oc, NULL, "dash", url)) < 0)
+        return ret;
+    oc->flags |= AVFMT_FLAG_BITEXACT;
+
+    if (!(st = avformat_new_stream(oc, NULL))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    st->time_base                 = (AVRational){ 1, 44100 };
+    st->codecpar->codec_type      = AVMEDIA_TYPE_AUDIO;
+    st->codecpar->codec_id        = AV_CODEC_ID_MP2;
+    st->codecpar->sample_rate     = 44100;
+    st->codecpar->channels        = 1;
+    st->codecpar->channel_layout  = AV_CH_LAYOUT_MONO;
+    st->codecpar->frame_size      = 1152;
+    st->codecpar->bit_rate        = 64000;
+
+    av_dict_set(&opts, "method",           "PUT",     0);
+    av_dict_set(&opts, "use_timeline",     "0",       0);
+    av_dict_set(&opts, "init_seg_name",    "init.m4s", 0);
+    av_dict_set(&opts, "media_seg_name",   "chunk-$Number%05d$.m4s", 0);
+    if (upload) {
+        /* the manifests list the segments by name */
+        av_dict_set(&opts, "use_template",     "0",       0);
+        av_dict_set(&opts, "min_seg_duration", "250000",  0);
+        av_dict_set_int(&opts, "upload_threads", UPLOAD_THREADS, 0);
+    } else {
+        av_dict_set(&opts, "streaming",        "1",       0);
+        av_dict_set(&opts, "frag_duration",    "250000",  0);
+        av_dict_set(&opts, "min_seg_duration", "1000000", 0);
+    }
+    ret = avformat_write_header(oc, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
+        goto end;
+
+    /* 2 seconds of fake MP2 frames */
+    for (i = 0; i < 77; i++) {
+        memset(data, i, sizeof(data));
+        av_init_packet(&pkt);
+        pkt.data     = data;
+        pkt.size     = sizeof(data);
+        pkt.pts      = pkt.dts = i * 1152;
+        pkt.duration = 1152;
+        pkt.flags    = AV_PKT_FLAG_KEY;
+        if ((ret = av_write_frame(oc, &pkt)) < 0)
+            goto end;
+    }
+    ret = av_write_trailer(oc);
+
+end:
+    avformat_free_context(oc);
+    return ret;
+}
+
+/* Mux to a new server, return the result of the muxing. */
+static int serve(Server *server, int upload)
+{
+    struct sockaddr_in addr = { 0 }, stop_addr = { 0 };
+    socklen_t addr_len = sizeof(addr);
+    pthread_t thread;
+    char url[64];
+    int i, fd, ret;
+
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    stop_addr = addr;
+    if ((server->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server->fd, 16) < 0 ||
+        getsockname(server->fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        fprintf(stderr, "Cannot listen on the loopback interface\n");
+        exit(1);
+    }
+    pthread_mutex_init(&server->lock, NULL);
+    if ((ret = pthread_create(&thread, NULL, server_thread, server))) {
+        fprintf(stderr, "pthread_create failed: %s.\n", strerror(ret));
+        exit(1);
+    }
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/live.mpd", ntohs(addr.sin_port));
+    ret = mux(url, upload);
+
+    /* let the server know the muxer is done, once it has accepted the
+     * connections of the muxer still waiting */
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(fd, (struct sockaddr *)&stop_addr, sizeof(stop_addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&stop_addr, &addr_len) < 0) {
+        fprintf(stderr, "Cannot stop the server\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&server->lock);
+    server->stop_port = stop_addr.sin_port;
+    pthread_mutex_unlock(&server->lock);
+    connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    closesocket(fd);
+    pthread_join(thread, NULL);
+    for (i = 0; i < server->nb_connections; i++)
+        pthread_join(server->threads[i], NULL);
+    closesocket(server->fd);
+    pthread_mutex_destroy(&server->lock);
+    return ret;
+}
+
+static int test_streaming(void)
+{
+    static Server server;
+    int i, ret;
+
+    /* requests are printed in the order the muxer opened them */
+    server.serial = 1;
+    if ((ret = serve(&server, 0)) < 0) {
+        fprintf(stderr, "Muxing failed: %s\n", av_err2str(ret));
+        return 1;
+    }
+
+    for (i = 0; i < server.nb_requests; i++) {
+        Request *req = &server.requests[i];
+        printf("%s: %s", req->line, req->chunked ? "chunked" : "not chunked");
+        /* the manifest size depends on the time it is written at */
+        if (!strstr(req->line, ".mpd"))
+            printf(", chunks: %d, bytes: %"PRId64, req->nb_chunks, req->size);
+        printf("\n");
+    }
+    return 0;
+}
+
+static int test_upload(void)
+{
+    static Server server, failing;
+    int i, segments = 0, manifests = 0, early = 0, ret;
+
+    server.keep = 2;
+    if ((ret = serve(&server, 1)) < 0) {
+        fprintf(stderr, "Muxing failed: %s\n", av_err2str(ret));
+        return 1;
+    }
+
+    /* which thread uploads which file varies, only the totals are printed */
+    for (i = 0; i < server.nb_requests; i++) {
+        Request *req = &server.requests[i];
+        if (strstr(req->line, ".mpd"))
+            manifests++;
+        else
+            segments++;
+        early |= req->early;
+    }
+    printf("segments: %d, manifests: %d\n", segments, manifests);
+    printf("manifests after their segments: %s\n", early ? "no" : "yes");
+    printf("connections reused: %s\n", server.reused ? "yes" : "no");
+    if (server.max_open <= UPLOAD_THREADS)
+        printf("connections open at once: at most %d\n", UPLOAD_THREADS);
+    else
+        printf("connections open at once: %d\n", server.max_open);
+
+    failing.fail = "/chunk-00003.m4s";
+    ret = serve(&failing, 1);
+    printf("failed upload: %s\n", ret < 0 ? av_err2str(ret) : "not reported");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    av_log_set_level(AV_LOG_QUIET);
+    avformat_network_init();
+    av_register_all();
+
+    if (argc > 1 && !strcmp(argv[1], "upload"))
+        ret = test_upload();
+    else
+        ret = test_streaming();
+
+    avformat_network_deinit();
+    return ret;
+}
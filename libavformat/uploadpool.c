@@ -0,0 +1,383 @@
+/*
+ * Background upload of muxer output files
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libavutil/avstring.h"
+#include "libavutil/mem.h"
+#include "libavutil/thread.h"
+#include "avformat.h"
+#if CONFIG_HTTP_PROTOCOL
+#include "http.h"
+#endif
+#include "internal.h"
+#include "uploadpool.h"
+#include "url.h"
+
+/* maximum number of closed files waiting for an upload thread */
+#define MAX_QUEUED_UPLOADS 32
+
+typedef struct UploadJob {
+    char *url;
+    AVDictionary *options;
+    AVIOContext *pb;        ///< memory buffer written by the muxer
+    uint8_t *buf;
+    int size;
+    int ordered;
+    struct UploadJob *next;
+} UploadJob;
+
+static void upload_job_free(UploadJob **pjob)
+{
+    UploadJob *job = *pjob;
+
+    if (!job)
+        return;
+    if (job->pb) {
+        uint8_t *buf;
+        avio_close_dyn_buf(job->pb, &buf);
+        av_free(buf);
+    }
+    av_freep(&job->url);
+    av_dict_free(&job->options);
+    av_freep(&job->buf);
+    av_freep(pjob);
+}
+
+#if HAVE_THREADS
+
+typedef struct UploadThread {
+    struct FFUploadPool *pool;
+    pthread_t thread;
+    URLContext *uc;         ///< connection kept open between HTTP uploads
+} UploadThread;
+
+struct FFUploadPool {
+    AVFormatContext *avf;
+    UploadJob *opened;      ///< files currently written by the muxer
+
+    UploadThread *threads;
+    int nb_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UploadJob *queue, **queue_tail;
+    int nb_queued, nb_running;
+    int error;
+    int exit;
+};
+
+static int is_http(const char *url)
+{
+    const char *proto = avio_find_protocol_name(url);
+    return proto && (!strcmp(proto, "http") || !strcmp(proto, "https"));
+}
+
+static int upload_send(UploadThread *t, UploadJob *job, int http, int reuse)
+{
+    AVFormatContext *s = t->pool->avf;
+    int ret;
+
+#if CONFIG_HTTP_PROTOCOL
+    if (reuse) {
+        ret = ff_http_do_new_request(t->uc, job->url);
+    } else
+#endif
+    {
+        AVDictionary *opts = NULL;
+
+        ffurl_closep(&t->uc);
+        av_dict_copy(&opts, job->options, 0);
+        if (http)
+            av_dict_set(&opts, "multiple_requests", "1", 0);
+        ret = ffurl_open_whitelist(&t->uc, job->url, AVIO_FLAG_WRITE,
+                                   &s->interrupt_callback, &opts,
+                                   s->protocol_whitelist, s->protocol_blacklist,
+                                   NULL);
+        av_dict_free(&opts);
+    }
+    if (ret >= 0 && job->size > 0)
+        ret = ffurl_write(t->uc, job->buf, job->size);
+    /* for HTTP, this waits for the reply of the server */
+    if (ret >= 0 && http)
+        ret = ffurl_shutdown(t->uc, AVIO_FLAG_WRITE);
+    if (ret < 0 || !http)
+        ffurl_closep(&t->uc);
+    return ret;
+}
+
+static int upload_job(UploadThread *t, UploadJob *job)
+{
+    int http  = is_http(job->url);
+    int reuse = CONFIG_HTTP_PROTOCOL && http && t->uc;
+    int ret;
+
+    ret = upload_send(t, job, http, reuse);
+    /* the server may have closed the idle connection, retry on a new one */
+    if (ret < 0 && reuse)
+        ret = upload_send(t, job, http, 0);
+
+    if (ret < 0)
+        av_log(t->pool->avf, AV_LOG_ERROR, "Failed to upload '%s': %s\n",
+               job->url, av_err2str(ret));
+    else
+        av_log(t->pool->avf, AV_LOG_DEBUG, "Uploaded %d bytes to '%s'%s\n",
+               job->size, job->url, reuse ? " over a kept alive connection" : "");
+    return ret;
+}
+
+static void *upload_thread(void *arg)
+{
+    UploadThread *t = arg;
+    FFUploadPool *pool = t->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        UploadJob *job = pool->queue;
+        int ret;
+
+        if (!job || (job->ordered && pool->nb_running)) {
+            if (!job && pool->exit)
+                break;
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        pool->queue = job->next;
+        if (!pool->queue)
+            pool->queue_tail = &pool->queue;
+        pool->nb_queued--;
+        pool->nb_running++;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        ret = upload_job(t, job);
+        upload_job_free(&job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->nb_running--;
+        if (ret < 0 && !pool->error)
+            pool->error = ret;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    ffurl_closep(&t->uc);
+    return NULL;
+}
+
+int ff_upload_pool_alloc(FFUploadPool **ppool, AVFormatContext *s, int nb_threads)
+{
+    FFUploadPool *pool;
+    int i, ret;
+
+    *ppool = NULL;
+    pool = av_mallocz(sizeof(*pool));
+    if (!pool)
+        return AVERROR(ENOMEM);
+    pool->threads = av_mallocz_array(nb_threads, sizeof(*pool->threads));
+    if (!pool->threads) {
+        av_free(pool);
+        return AVERROR(ENOMEM);
+    }
+    pool->avf        = s;
+    pool->queue_tail = &pool->queue;
+
+    if ((ret = pthread_mutex_init(&pool->lock, NULL))) {
+        av_free(pool->threads);
+        av_free(pool);
+        return AVERROR(ret);
+    }
+    if ((ret = pthread_cond_init(&pool->cond, NULL))) {
+        pthread_mutex_destroy(&pool->lock);
+        av_free(pool->threads);
+        av_free(pool);
+        return AVERROR(ret);
+    }
+
+    for (i = 0; i < nb_threads; i++) {
+        pool->threads[i].pool = pool;
+        if ((ret = pthread_create(&pool->threads[i].thread, NULL,
+                                  upload_thread, &pool->threads[i]))) {
+            av_log(s, AV_LOG_ERROR, "Failed to create upload thread: %s\n",
+                   av_err2str(AVERROR(ret)));
+            break;
+        }
+        pool->nb_threads++;
+    }
+    *ppool = pool;
+    if (!pool->nb_threads) {
+        ff_upload_pool_free(ppool);
+        return AVERROR(ret);
+    }
+    return 0;
+}
+
+static int upload_pool_queue(FFUploadPool *pool, UploadJob *job)
+{
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nb_queued >= MAX_QUEUED_UPLOADS && !pool->error)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    ret = pool->error;
+    if (!ret) {
+        *pool->queue_tail = job;
+        pool->queue_tail  = &job->next;
+        pool->nb_queued++;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+int ff_upload_pool_flush(FFUploadPool *pool)
+{
+    int ret;
+
+    if (!pool)
+        return 0;
+    pthread_mutex_lock(&pool->lock);
+    while ((pool->nb_queued || pool->nb_running) && !pool->error)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    ret = pool->error;
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+void ff_upload_pool_free(FFUploadPool **ppool)
+{
+    FFUploadPool *pool = *ppool;
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->exit = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i].thread, NULL);
+
+    /* leftovers of a failed or aborted muxing */
+    while (pool->queue) {
+        UploadJob *job = pool->queue;
+        pool->queue = job->next;
+        upload_job_free(&job);
+    }
+    while (pool->opened) {
+        UploadJob *job = pool->opened;
+        pool->opened = job->next;
+        upload_job_free(&job);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    av_freep(&pool->threads);
+    av_freep(ppool);
+}
+
+#else
+
+struct FFUploadPool {
+    UploadJob *opened;
+};
+
+int ff_upload_pool_alloc(FFUploadPool **ppool, AVFormatContext *s, int nb_threads)
+{
+    *ppool = NULL;
+    return AVERROR(ENOSYS);
+}
+
+static int upload_pool_queue(FFUploadPool *pool, UploadJob *job)
+{
+    return AVERROR(ENOSYS);
+}
+
+int ff_upload_pool_flush(FFUploadPool *pool)
+{
+    return 0;
+}
+
+void ff_upload_pool_free(FFUploadPool **ppool)
+{
+}
+
+#endif /* HAVE_THREADS */
+
+int ff_upload_pool_open(FFUploadPool *pool, AVFormatContext *s,
+                        AVIOContext **pb, const char *url,
+                        AVDictionary **options)
+{
+    UploadJob *job;
+    int ret;
+
+    if (!pool)
+        return s->io_open(s, pb, url, AVIO_FLAG_WRITE, options);
+
+    job = av_mallocz(sizeof(*job));
+    if (!job)
+        return AVERROR(ENOMEM);
+    if (!(job->url = av_strdup(url))) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if (options && (ret = av_dict_copy(&job->options, *options, 0)) < 0)
+        goto fail;
+    if ((ret = avio_open_dyn_buf(&job->pb)) < 0)
+        goto fail;
+
+    *pb = job->pb;
+    job->next    = pool->opened;
+    pool->opened = job;
+    return 0;
+fail:
+    upload_job_free(&job);
+    return ret;
+}
+
+int ff_upload_pool_close(FFUploadPool *pool, AVFormatContext *s,
+                         AVIOContext **pb, int ordered)
+{
+    UploadJob **pjob = NULL, *job;
+    int ret;
+
+    if (!*pb)
+        return 0;
+
+    if (pool)
+        for (pjob = &pool->opened; *pjob && (*pjob)->pb != *pb; pjob = &(*pjob)->next)
+            ;
+    if (!pjob || !*pjob) {
+        ff_format_io_close(s, pb);
+        return 0;
+    }
+
+    job   = *pjob;
+    *pjob = job->next;
+    job->next = NULL;
+    job->size = avio_close_dyn_buf(job->pb, &job->buf);
+    job->pb   = NULL;
+    job->ordered = ordered;
+    *pb = NULL;
+
+    ret = upload_pool_queue(pool, job);
+    if (ret < 0)
+        upload_job_free(&job);
+    return ret;
+}
@@ -0,0 +1,77 @@
+/*
+ * Background upload of muxer output files
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFORMAT_UPLOADPOOL_H
+#define AVFORMAT_UPLOADPOOL_H
+
+#include "avformat.h"
+
+/**
+ * A pool of threads uploading the files written by a segmenting muxer.
+ *
+ * Files opened through the pool are buffered in memory, and handed to a
+ * pool thread when they are closed, so that the muxer does not wait for
+ * the upload of one segment before it can start writing the next one.
+ * Each thread keeps its HTTP connection open between uploads.
+ */
+typedef struct FFUploadPool FFUploadPool;
+
+/**
+ * Create an upload pool for the muxer s.
+ *
+ * @param nb_threads number of upload threads
+ * @return 0 on success, a negative AVERROR code on failure, in particular
+ *         AVERROR(ENOSYS) if threads are not available
+ */
+int ff_upload_pool_alloc(FFUploadPool **ppool, AVFormatContext *s, int nb_threads);
+
+/**
+ * Open a file for writing. Without a pool, this is the same as
+ * s->io_open().
+ */
+int ff_upload_pool_open(FFUploadPool *pool, AVFormatContext *s,
+                        AVIOContext **pb, const char *url,
+                        AVDictionary **options);
+
+/**
+ * Close a file opened with ff_upload_pool_open() and queue its upload.
+ * Blocks while the queue of pending uploads is full.
+ *
+ * @param ordered if set, the upload does not start before all the uploads
+ *                queued before it have completed, e.g. for a playlist
+ *                referencing the segments queued before it
+ * @return the error of a failed upload, 0 otherwise
+ */
+int ff_upload_pool_close(FFUploadPool *pool, AVFormatContext *s,
+                         AVIOContext **pb, int ordered);
+
+/**
+ * Wait for all the queued uploads to complete.
+ *
+ * @return the error of a failed upload, 0 otherwise
+ */
+int ff_upload_pool_flush(FFUploadPool *pool);
+
+/**
+ * Wait for the queued uploads, stop the threads and free the pool.
+ */
+void ff_upload_pool_free(FFUploadPool **ppool);
+
+#endif /* AVFORMAT_UPLOADPOOL_H */
@@ -43,6 +43,9 @@ static const HWContextType *hw_table[] = {
 #endif
 #if CONFIG_VDPAU
     &ff_hwcontext_type_vdpau,
+#endif
+#if CONFIG_LIBXMAAPI
+    &ff_hwcontext_type_xma,
 #endif
     NULL,
 };
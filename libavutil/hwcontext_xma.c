@@ -0,0 +1,361 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "common.h"
+#include "dict.h"
+#include "hwcontext.h"
+#include "hwcontext_internal.h"
+#include "hwcontext_xma.h"
+#include "hwcontext_xma_internal.h"
+#include "imgutils.h"
+#include "mem.h"
+#include "pixdesc.h"
+#include "pixfmt.h"
+#include "thread.h"
+
+typedef struct XMAFramesContext {
+    XmaFrameProperties props;
+} XMAFramesContext;
+
+/* Process-wide session placement, see hwcontext_xma_internal.h. */
+static struct {
+    AVMutex  lock;
+    int      devices[AV_XMA_MAX_DEVICES];
+    int      nb_devices;
+    int64_t  load[AV_XMA_MAX_DEVICES];
+    uint64_t channels[AV_XMA_MAX_DEVICES];
+} sched = { .nb_devices = 1 };
+
+static AVOnce sched_once = AV_ONCE_INIT;
+
+static void sched_init(void)
+{
+    ff_mutex_init(&sched.lock, NULL);
+}
+
+static void sched_set_devices(const int *devices, int nb_devices)
+{
+    ff_thread_once(&sched_once, sched_init);
+    ff_mutex_lock(&sched.lock);
+    memcpy(sched.devices, devices, nb_devices * sizeof(*devices));
+    sched.nb_devices = nb_devices;
+    ff_mutex_unlock(&sched.lock);
+}
+
+int64_t avpriv_xma_session_load(int width, int height, AVRational framerate)
+{
+    if (framerate.num <= 0 || framerate.den <= 0)
+        framerate = (AVRational){ 25, 1 };
+    return av_rescale(width * (int64_t)height, framerate.num, framerate.den);
+}
+
+int avpriv_xma_session_acquire(void *log_ctx, XMASlot *slot, int device,
+                               int64_t load)
+{
+    int i, ret = 0;
+
+    if (device >= AV_XMA_MAX_DEVICES) {
+        av_log(log_ctx, AV_LOG_ERROR, "Invalid XMA card %d\n", device);
+        return AVERROR(EINVAL);
+    }
+
+    ff_thread_once(&sched_once, sched_init);
+    ff_mutex_lock(&sched.lock);
+
+    if (device < 0) {
+        device = sched.devices[0];
+        for (i = 1; i < sched.nb_devices; i++) {
+            if (sched.load[sched.devices[i]] < sched.load[device])
+                device = sched.devices[i];
+        }
+    }
+
+    if (!~sched.channels[device]) {
+        av_log(log_ctx, AV_LOG_ERROR, "No free channel on XMA card %d\n", device);
+        ret = AVERROR(EBUSY);
+        goto end;
+    }
+
+    for (i = 0; sched.channels[device] & (1ULL << i); i++)
+        ;
+
+    sched.channels[device] |= 1ULL << i;
+    sched.load[device]     += load;
+
+    slot->held    = 1;
+    slot->device  = device;
+    slot->channel = i;
+    slot->load    = load;
+
+    av_log(log_ctx, AV_LOG_VERBOSE, "Using XMA card %d channel %d, "
+           "card load %"PRId64" pixels/s\n", device, i, sched.load[device]);
+
+end:
+    ff_mutex_unlock(&sched.lock);
+    return ret;
+}
+
+void avpriv_xma_session_release(XMASlot *slot)
+{
+    if (!slot->held)
+        return;
+
+    ff_mutex_lock(&sched.lock);
+    sched.channels[slot->device] &= ~(1ULL << slot->channel);
+    sched.load[slot->device]     -= slot->load;
+    ff_mutex_unlock(&sched.lock);
+
+    slot->held = 0;
+}
+
+AVBufferRef *avpriv_xma_stats_alloc(void *opaque, int size)
+{
+    XMAStats *stats = opaque;
+
+    ff_xma_stats_add(&stats->allocs, 1);
+    return av_buffer_alloc(size);
+}
+
+static const struct {
+    enum AVPixelFormat pix_fmt;
+    XmaFormatType      format;
+    int                bits_per_pixel;
+} supported_formats[] = {
+    { AV_PIX_FMT_YUV420P,     XMA_YUV420_FMT_TYPE,  8 },
+    { AV_PIX_FMT_YUV422P,     XMA_YUV422_FMT_TYPE,  8 },
+    { AV_PIX_FMT_YUV444P,     XMA_YUV444_FMT_TYPE,  8 },
+    { AV_PIX_FMT_YUV420P16LE, XMA_YUV420_FMT_TYPE, 16 },
+    { AV_PIX_FMT_YUV422P16LE, XMA_YUV422_FMT_TYPE, 16 },
+    { AV_PIX_FMT_YUV444P16LE, XMA_YUV444_FMT_TYPE, 16 },
+};
+
+static int xma_frames_get_constraints(AVHWDeviceContext *ctx,
+                                      const void *hwconfig,
+                                      AVHWFramesConstraints *constraints)
+{
+    int i;
+
+    constraints->valid_sw_formats = av_malloc_array(FF_ARRAY_ELEMS(supported_formats) + 1,
+                                                    sizeof(*constraints->valid_sw_formats));
+    if (!constraints->valid_sw_formats)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < FF_ARRAY_ELEMS(supported_formats); i++)
+        constraints->valid_sw_formats[i] = supported_formats[i].pix_fmt;
+    constraints->valid_sw_formats[FF_ARRAY_ELEMS(supported_formats)] = AV_PIX_FMT_NONE;
+
+    constraints->valid_hw_formats = av_malloc_array(2, sizeof(*constraints->valid_hw_formats));
+    if (!constraints->valid_hw_formats)
+        return AVERROR(ENOMEM);
+
+    constraints->valid_hw_formats[0] = AV_PIX_FMT_XMA;
+    constraints->valid_hw_formats[1] = AV_PIX_FMT_NONE;
+
+    return 0;
+}
+
+static void xma_buffer_free(void *opaque, uint8_t *data)
+{
+    xma_frame_free((XmaFrame *)data);
+}
+
+static AVBufferRef *xma_pool_alloc(void *opaque, int size)
+{
+    AVHWFramesContext *ctx = opaque;
+    XMAFramesContext *priv = ctx->internal->priv;
+    AVBufferRef *ret;
+    XmaFrame *frame;
+
+    frame = xma_frame_alloc(&priv->props);
+    if (!frame) {
+        av_log(ctx, AV_LOG_ERROR, "Error allocating an XMA frame\n");
+        return NULL;
+    }
+
+    ret = av_buffer_create((uint8_t *)frame, sizeof(*frame),
+                           xma_buffer_free, NULL, 0);
+    if (!ret)
+        xma_frame_free(frame);
+
+    return ret;
+}
+
+static int xma_frames_init(AVHWFramesContext *ctx)
+{
+    XMAFramesContext *priv = ctx->internal->priv;
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(supported_formats); i++) {
+        if (ctx->sw_format == supported_formats[i].pix_fmt)
+            break;
+    }
+    if (i == FF_ARRAY_ELEMS(supported_formats)) {
+        av_log(ctx, AV_LOG_ERROR, "Pixel format '%s' is not supported\n",
+               av_get_pix_fmt_name(ctx->sw_format));
+        return AVERROR(ENOSYS);
+    }
+
+    priv->props.format         = supported_formats[i].format;
+    priv->props.bits_per_pixel = supported_formats[i].bits_per_pixel;
+    priv->props.width          = ctx->width;
+    priv->props.height         = ctx->height;
+
+    if (!ctx->pool) {
+        ctx->internal->pool_internal = av_buffer_pool_init2(sizeof(XmaFrame), ctx,
+                                                            xma_pool_alloc, NULL);
+        if (!ctx->internal->pool_internal)
+            return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+static int xma_get_buffer(AVHWFramesContext *ctx, AVFrame *frame)
+{
+    frame->buf[0] = av_buffer_pool_get(ctx->pool);
+    if (!frame->buf[0])
+        return AVERROR(ENOMEM);
+
+    frame->data[3] = frame->buf[0]->data;
+    frame->format  = AV_PIX_FMT_XMA;
+    frame->width   = ctx->width;
+    frame->height  = ctx->height;
+
+    return 0;
+}
+
+static int xma_transfer_get_formats(AVHWFramesContext *ctx,
+                                    enum AVHWFrameTransferDirection dir,
+                                    enum AVPixelFormat **formats)
+{
+    enum AVPixelFormat *fmts;
+
+    fmts = av_malloc_array(2, sizeof(*fmts));
+    if (!fmts)
+        return AVERROR(ENOMEM);
+
+    fmts[0] = ctx->sw_format;
+    fmts[1] = AV_PIX_FMT_NONE;
+
+    *formats = fmts;
+
+    return 0;
+}
+
+/* The planes of an XmaFrame are stored without padding between lines. */
+static int xma_transfer_data(AVHWFramesContext *ctx, AVFrame *dst,
+                             const AVFrame *src, int download)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(ctx->sw_format);
+    const AVFrame *hw = download ? src : dst;
+    XmaFrame *xframe  = (XmaFrame *)hw->data[3];
+    int linesizes[4];
+    int i, ret;
+
+    if (!xframe)
+        return AVERROR(EINVAL);
+
+    ret = av_image_fill_linesizes(linesizes, ctx->sw_format, ctx->width);
+    if (ret < 0)
+        return ret;
+
+    for (i = 0; i < desc->nb_components && i < XMA_MAX_PLANES; i++) {
+        int h = i ? AV_CEIL_RSHIFT(ctx->height, desc->log2_chroma_h) : ctx->height;
+        uint8_t *buf = xframe->data[i].buffer;
+
+        if (!buf) {
+            av_log(ctx, AV_LOG_ERROR, "XMA frame plane %d is not mapped\n", i);
+            return AVERROR(EINVAL);
+        }
+
+        if (download)
+            av_image_copy_plane(dst->data[i], dst->linesize[i], buf, linesizes[i],
+                                linesizes[i], h);
+        else
+            av_image_copy_plane(buf, linesizes[i], src->data[i], src->linesize[i],
+                                linesizes[i], h);
+    }
+
+    return 0;
+}
+
+static int xma_transfer_data_from(AVHWFramesContext *ctx, AVFrame *dst,
+                                  const AVFrame *src)
+{
+    return xma_transfer_data(ctx, dst, src, 1);
+}
+
+static int xma_transfer_data_to(AVHWFramesContext *ctx, AVFrame *dst,
+                                const AVFrame *src)
+{
+    return xma_transfer_data(ctx, dst, src, 0);
+}
+
+static int xma_device_create(AVHWDeviceContext *ctx, const char *device,
+                             AVDictionary *opts, int flags)
+{
+    AVXMADeviceContext *hwctx = ctx->hwctx;
+    AVDictionaryEntry *e;
+    const char *p = device;
+
+    while (p && *p) {
+        char *end;
+        long idx = strtol(p, &end, 10);
+
+        if (end == p || (*end && *end != ',') || idx < 0 ||
+            idx >= AV_XMA_MAX_DEVICES || hwctx->nb_devices == AV_XMA_MAX_DEVICES) {
+            av_log(ctx, AV_LOG_ERROR, "Invalid XMA device '%s'\n", device);
+            return AVERROR(EINVAL);
+        }
+        hwctx->devices[hwctx->nb_devices++] = idx;
+        p = *end ? end + 1 : end;
+    }
+    if (!hwctx->nb_devices)
+        hwctx->devices[hwctx->nb_devices++] = 0;
+
+    e = av_dict_get(opts, "cfg", NULL, 0);
+    if (e && xma_initialize(e->value) != XMA_SUCCESS) {
+        av_log(ctx, AV_LOG_ERROR, "Error initializing XMA from '%s'\n", e->value);
+        return AVERROR_EXTERNAL;
+    }
+
+    sched_set_devices(hwctx->devices, hwctx->nb_devices);
+
+    return 0;
+}
+
+const HWContextType ff_hwcontext_type_xma = {
+    .type                 = AV_HWDEVICE_TYPE_XMA,
+    .name                 = "XMA",
+
+    .device_hwctx_size    = sizeof(AVXMADeviceContext),
+    .frames_priv_size     = sizeof(XMAFramesContext),
+
+    .device_create        = xma_device_create,
+    .frames_get_constraints = xma_frames_get_constraints,
+    .frames_init          = xma_frames_init,
+    .frames_get_buffer    = xma_get_buffer,
+    .transfer_get_formats = xma_transfer_get_formats,
+    .transfer_data_to     = xma_transfer_data_to,
+    .transfer_data_from   = xma_transfer_data_from,
+
+    .pix_fmts             = (const enum AVPixelFormat[]){ AV_PIX_FMT_XMA, AV_PIX_FMT_NONE },
+};
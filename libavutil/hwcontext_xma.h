@@ -0,0 +1,63 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVUTIL_HWCONTEXT_XMA_H
+#define AVUTIL_HWCONTEXT_XMA_H
+
+#include <xma.h>
+
+/**
+ * @file
+ * An API-specific header for AV_HWDEVICE_TYPE_XMA.
+ *
+ * This API supports dynamic frame pools. AVHWFramesContext.pool must return
+ * AVBufferRefs whose data pointer points to an XmaFrame. The planes of the
+ * XmaFrame have the layout of AVHWFramesContext.sw_format without padding
+ * between lines. The XmaFrame is also set as data[3] of the AVFrame, so the
+ * XMA kernels can exchange it without a copy through host memory.
+ *
+ * XMA itself is initialized once per process. av_hwdevice_ctx_create()
+ * only calls xma_initialize() when the "cfg" option names a configuration
+ * file; otherwise the caller is expected to have done so.
+ *
+ * The device string is a comma-separated list of card indices, e.g. "0,1".
+ * XMA decoder, scaler and encoder sessions that do not ask for a specific
+ * card are spread over these cards by load (pixels per second). The card
+ * list is process-wide: creating a device replaces it for all sessions
+ * opened afterwards. Without a device only card 0 is used.
+ */
+
+#define AV_XMA_MAX_DEVICES 16
+
+/**
+ * This struct is allocated as AVHWDeviceContext.hwctx
+ */
+typedef struct AVXMADeviceContext {
+    /**
+     * Indices of the cards sessions may be placed on, set from the device
+     * string.
+     */
+    int devices[AV_XMA_MAX_DEVICES];
+    int nb_devices;
+} AVXMADeviceContext;
+
+/**
+ * AVHWFramesContext.hwctx is currently not used
+ */
+
+#endif /* AVUTIL_HWCONTEXT_XMA_H */
@@ -0,0 +1,109 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVUTIL_HWCONTEXT_XMA_INTERNAL_H
+#define AVUTIL_HWCONTEXT_XMA_INTERNAL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "rational.h"
+
+/**
+ * @file
+ * Placement of XMA sessions on cards and kernel channels, shared by the
+ * XMA decoders, encoders and filters of one process.
+ */
+
+#define XMA_MAX_CHANNELS 64
+
+typedef struct XMASlot {
+    int     held;       ///< set while the slot is acquired
+    int     device;     ///< card index
+    int     channel;    ///< kernel channel on that card
+    int64_t load;       ///< pixels per second accounted to the card
+} XMASlot;
+
+/**
+ * Estimate the load of a session processing width x height frames at
+ * the given frame rate. 25 fps is assumed if the rate is unknown.
+ */
+int64_t avpriv_xma_session_load(int width, int height, AVRational framerate);
+
+/**
+ * Pick a card and a free channel for a new session.
+ *
+ * @param device card to use, or -1 to take the least loaded card of the
+ *               list set by the XMA hwdevice
+ * @return 0 on success, a negative AVERROR code if all channels of the
+ *         card are taken
+ */
+int avpriv_xma_session_acquire(void *log_ctx, XMASlot *slot, int device,
+                               int64_t load);
+
+/**
+ * Give back the card load and channel held by slot. Does nothing if the
+ * slot is not held.
+ */
+void avpriv_xma_session_release(XMASlot *slot);
+
+/**
+ * Host-side counters of one XMA session, exported as read-only AVOptions
+ * of the codec or filter running it. The thread running the session
+ * updates them with ff_xma_stats_add() and ff_xma_stats_set(); to read
+ * them while it runs, use atomic_load() on the field the option points to
+ * rather than av_opt_get_int().
+ */
+typedef struct XMAStats {
+    atomic_int_least64_t frames;     ///< frames submitted to the card
+    atomic_int_least64_t in_flight;  ///< frames submitted whose output was not returned yet
+    atomic_int_least64_t send_time;  ///< time spent handing data to the card, in microseconds
+    atomic_int_least64_t recv_time;  ///< time spent waiting for the card, in microseconds
+    atomic_int_least64_t xfer_bytes; ///< bytes moved between host memory and the card
+    atomic_int_least64_t copy_bytes; ///< bytes copied on the host before or after a transfer
+    atomic_int_least64_t allocs;     ///< host allocations made while processing frames
+} XMAStats;
+
+static inline void ff_xma_stats_add(atomic_int_least64_t *counter, int64_t v)
+{
+    atomic_fetch_add_explicit(counter, v, memory_order_relaxed);
+}
+
+static inline void ff_xma_stats_set(atomic_int_least64_t *counter, int64_t v)
+{
+    atomic_store_explicit(counter, v, memory_order_relaxed);
+}
+
+#define XMA_STATS_OPTIONS(ctx, field, flags)                                                                              \
+    { "xma_frames",     "Frames submitted to the card",      offsetof(ctx, field.frames),     AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, (flags) | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY }, \
+    { "xma_in_flight",  "Frames the card has not returned",  offsetof(ctx, field.in_flight),  AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, (flags) | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY }, \
+    { "xma_send_time",  "Time spent sending (us)",           offsetof(ctx, field.send_time),  AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, (flags) | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY }, \
+    { "xma_recv_time",  "Time spent waiting (us)",           offsetof(ctx, field.recv_time),  AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, (flags) | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY }, \
+    { "xma_xfer_bytes", "Bytes moved to and from the card",  offsetof(ctx, field.xfer_bytes), AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, (flags) | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY }, \
+    { "xma_copy_bytes", "Bytes copied on the host",          offsetof(ctx, field.copy_bytes), AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, (flags) | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY }, \
+    { "xma_allocs",     "Host allocations while running",    offsetof(ctx, field.allocs),     AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, (flags) | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY }
+
+/**
+ * Allocator for the AVBufferPool of a session, pass its XMAStats as the
+ * pool opaque to count the allocations.
+ */
+AVBufferRef *avpriv_xma_stats_alloc(void *opaque, int size);
+
+#endif /* AVUTIL_HWCONTEXT_XMA_INTERNAL_H */
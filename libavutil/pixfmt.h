@@ -314,6 +314,12 @@ enum AVPixelFormat {
     AV_PIX_FMT_P016LE, ///< like NV12, with 16bpp per component, little-endian
     AV_PIX_FMT_P016BE, ///< like NV12, with 16bpp per component, big-endian
 
+    /**
+     * HW acceleration through the Xilinx XMA API, data[3] contains a
+     * pointer to the XmaFrame structure.
+     */
+    AV_PIX_FMT_XMA,
+
     AV_PIX_FMT_NB         ///< number of pixel formats, DO NOT USE THIS if you want to link with shared libav* because the number of formats might differ between versions
 };
 
@@ -0,0 +1,76 @@
+tests/data/hls-variants.m3u8: TAG = GEN
+tests/data/hls-variants.m3u8: ffmpeg$(PROGSSUF)$(EXESUF) | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< \
+        -f lavfi -i "aevalsrc=cos(2*PI*t)*sin(2*PI*(440+4*t)*t)::d=20" -filter_complex asplit -f hls -hls_time 10 -flags +bitexact \
+        -codec:a mp2fixed -b:a:0 64k -b:a:1 128k -var_stream_map "a:0 a:1" -master_pl_name hls-variants.m3u8 \
+        -hls_segment_filename $(TARGET_PATH)/tests/data/hls-variants-out-%v-%03d.ts \
+        -y $(TARGET_PATH)/tests/data/hls-variants-%v.m3u8 2>/dev/null
+
+FATE_LAVF_CONTAINER-$(call ALLYES, HLS_MUXER HLS_DEMUXER MPEGTS_MUXER MPEGTS_DEMUXER AEVALSRC_FILTER ASPLIT_FILTER LAVFI_INDEV MP2FIXED_ENCODER) += fate-hls-variants
+fate-hls-variants: tests/data/hls-variants.m3u8
+fate-hls-variants: CMD = framecrc -flags +bitexact -i $(TARGET_PATH)/tests/data/hls-variants.m3u8 -map 0
+
+tests/data/hls-fmp4.m3u8: TAG = GEN
+tests/data/hls-fmp4.m3u8: ffmpeg$(PROGSSUF)$(EXESUF) | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< \
+        -f lavfi -i "aevalsrc=cos(2*PI*t)*sin(2*PI*(440+4*t)*t)::d=20" -f hls -hls_time 10 -map 0 -flags +bitexact -codec:a mp2fixed \
+        -hls_segment_type fmp4 -hls_fmp4_init_filename hls-fmp4-init.mp4 \
+        -hls_segment_filename $(TARGET_PATH)/tests/data/hls-fmp4-out-%03d.m4s \
+        -y $(TARGET_PATH)/tests/data/hls-fmp4.m3u8 2>/dev/null
+
+FATE_LAVF_CONTAINER-$(call ALLYES, HLS_MUXER HLS_DEMUXER MP4_MUXER MOV_DEMUXER AEVALSRC_FILTER LAVFI_INDEV MP2FIXED_ENCODER) += fate-hls-fmp4
+fate-hls-fmp4: tests/data/hls-fmp4.m3u8
+fate-hls-fmp4: CMD = framecrc -flags +bitexact -i $(TARGET_PATH)/tests/data/hls-fmp4.m3u8
+
+tests/data/hls-variants-fmp4.m3u8: TAG = GEN
+tests/data/hls-variants-fmp4.m3u8: ffmpeg$(PROGSSUF)$(EXESUF) | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< \
+        -f lavfi -i testsrc=s=64x48:r=25:d=6 -filter_complex split -f hls -hls_time 2 -flags +bitexact -fflags +bitexact \
+        -codec:v mpeg2video -g:v:0 15 -g:v:1 5 -b:v:0 200k -b:v:1 100k -var_stream_map "v:0 v:1" \
+        -master_pl_name hls-variants-fmp4.m3u8 -hls_segment_type fmp4 -hls_fmp4_init_filename hls-variants-fmp4-init.mp4 \
+        -hls_segment_filename $(TARGET_PATH)/tests/data/hls-variants-fmp4-out-%v-%03d.m4s \
+        -y $(TARGET_PATH)/tests/data/hls-variants-fmp4-%v.m3u8 2>/dev/null
+
+# both variants are cut on the keyframes of the first one
+FATE_LAVF_CONTAINER-$(call ALLYES, HLS_MUXER MP4_MUXER TESTSRC_FILTER SPLIT_FILTER LAVFI_INDEV MPEG2VIDEO_ENCODER) += fate-hls-variants-fmp4
+fate-hls-variants-fmp4: tests/data/hls-variants-fmp4.m3u8
+fate-hls-variants-fmp4: CMD = cat $(TARGET_PATH)/tests/data/hls-variants-fmp4.m3u8 $(TARGET_PATH)/tests/data/hls-variants-fmp4-0.m3u8 $(TARGET_PATH)/tests/data/hls-variants-fmp4-1.m3u8
+
+tests/data/dash-streaming.mp4: TAG = GEN
+tests/data/dash-streaming.mp4: ffmpeg$(PROGSSUF)$(EXESUF) | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< \
+        -f lavfi -i "aevalsrc=cos(2*PI*t)*sin(2*PI*(440+4*t)*t)::d=4" -f dash -map 0 -flags +bitexact -codec:a mp2fixed \
+        -streaming 1 -frag_duration 250000 -min_seg_duration 1000000 -use_timeline 0 \
+        -init_seg_name dash-streaming-init.m4s -media_seg_name 'dash-streaming-$$Number%05d$$.m4s' \
+        -y $(TARGET_PATH)/tests/data/dash-streaming.mpd 2>/dev/null; \
+        cat $(TARGET_PATH)/tests/data/dash-streaming-init.m4s $(TARGET_PATH)/tests/data/dash-streaming-0*.m4s > $(TARGET_PATH)/$@
+
+FATE_LAVF_CONTAINER-$(call ALLYES, DASH_MUXER MOV_DEMUXER AEVALSRC_FILTER LAVFI_INDEV MP2FIXED_ENCODER) += fate-dash-streaming
+fate-dash-streaming: tests/data/dash-streaming.mp4
+fate-dash-streaming: CMD = framecrc -flags +bitexact -i $(TARGET_PATH)/tests/data/dash-streaming.mp4
+
+# the same fragments uploaded over HTTP, one chunk each
+FATE_DASH_STREAMING_HTTP-yes = fate-dash-streaming-http
+FATE_LAVF_CONTAINER-$(call ALLYES, DASH_MUXER HTTP_PROTOCOL) += $(FATE_DASH_STREAMING_HTTP-$(HAVE_THREADS))
+fate-dash-streaming-http: libavformat/tests/dashenc$(EXESUF)
+fate-dash-streaming-http: CMD = run libavformat/tests/dashenc
+
+# 2 upload threads over kept alive connections the server drops every
+# 2 requests, then a failed upload; the manifests must follow their segments
+FATE_DASH_UPLOAD_HTTP-yes = fate-dash-upload-http
+FATE_LAVF_CONTAINER-$(call ALLYES, DASH_MUXER HTTP_PROTOCOL) += $(FATE_DASH_UPLOAD_HTTP-$(HAVE_THREADS))
+fate-dash-upload-http: libavformat/tests/dashenc$(EXESUF)
+fate-dash-upload-http: CMD = run libavformat/tests/dashenc upload
+
+tests/data/async-write.mp4: TAG = GEN
+tests/data/async-write.mp4: ffmpeg$(PROGSSUF)$(EXESUF) | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< \
+        -f lavfi -i "aevalsrc=cos(2*PI*t)*sin(2*PI*(440+4*t)*t)::d=4" -f mp4 -flags +bitexact -codec:a mp2fixed \
+        -write_buffer_size 4096 -y async:$(TARGET_PATH)/$@ 2>/dev/null
+
+FATE_LAVF_CONTAINER-$(call ALLYES, ASYNC_PROTOCOL MP4_MUXER MOV_DEMUXER AEVALSRC_FILTER LAVFI_INDEV MP2FIXED_ENCODER) += fate-async-write
+fate-async-write: tests/data/async-write.mp4
+fate-async-write: CMD = framecrc -flags +bitexact -i $(TARGET_PATH)/tests/data/async-write.mp4
+
+FATE_FFMPEG += $(FATE_LAVF_CONTAINER-yes)
+fate-lavf-container: $(FATE_LAVF_CONTAINER-yes)
@@ -0,0 +1,76 @@
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-scale
+fate-xma-sw-scale: CMD = framecrc -f lavfi -i testsrc=s=1280x720:d=0.4 -filter_complex "sws_flags=+accurate_rnd+bitexact;format=yuv420p,scale_xma=outputs=2:out_1_width=640:out_1_height=360:out_2_width=512:out_2_height=288[a][b]" -map "[a]" -map "[b]"
+
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER HWUPLOAD_FILTER HWDOWNLOAD_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-hw-scale
+fate-xma-hw-scale: CMD = framecrc -xma_device 0 -f lavfi -i testsrc=s=1280x720:d=0.4 -filter_complex "sws_flags=+accurate_rnd+bitexact;format=yuv420p,hwupload,scale_xma=outputs=2:out_1_width=640:out_1_height=360:out_2_width=512:out_2_height=288[a][b];[a]hwdownload,format=yuv420p[a1];[b]hwdownload,format=yuv420p[b1]" -map "[a1]" -map "[b1]"
+
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-ladder
+fate-xma-sw-ladder: CMD = framecrc -f lavfi -i testsrc=s=1280x720:r=25:d=0.4 -filter_complex "sws_flags=+accurate_rnd+bitexact;format=yuv420p,scale_xma=ladder=640x360|512x288@yuv444p/2|320x180@yuv420p16le/3[a][b][c]" -map "[a]" -map "[b]" -map "[c]"
+
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-ladder-hbd-input
+fate-xma-sw-ladder-hbd-input: CMD = framecrc -f lavfi -i testsrc=s=1280x720:r=25:d=0.4 -filter_complex "sws_flags=+accurate_rnd+bitexact;format=yuv444p16le,scale_xma=ladder=640x360|512x288@yuv444p/2[a][b]" -map "[a]" -map "[b]"
+
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-graph-threads
+fate-xma-sw-graph-threads: CMD = framecrc -graph_threads -f lavfi -i testsrc=s=1280x720:r=25:d=0.4 -filter_complex "sws_flags=+accurate_rnd+bitexact;format=yuv420p,scale_xma=ladder=640x360|512x288@yuv444p/2|320x180@yuv420p16le/3[a][b][c]" -map "[a]" -map "[b]" -map "[c]"
+fate-xma-sw-graph-threads: REF = $(SRC_PATH)/tests/ref/fate/xma-sw-ladder
+
+tests/data/xma-reinit.png: TAG = GEN
+tests/data/xma-reinit.png: ffmpeg$(PROGSSUF)$(EXESUF) | tests/data
+	$(M)for s in 320x240 352x288 320x240; do \
+        $(TARGET_EXEC) $(TARGET_PATH)/$< -nostdin -f lavfi -i testsrc=s=$$s:r=25:d=0.2 \
+        -c:v png -f image2pipe - 2>/dev/null || exit 1; done >$(TARGET_PATH)/$@
+
+# the input changes size twice, the graph is rebuilt while its thread runs
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV PNG_ENCODER PNG_DECODER IMAGE2PIPE_MUXER IMAGE_PNG_PIPE_DEMUXER) += fate-xma-sw-graph-threads-reinit
+fate-xma-sw-graph-threads-reinit: tests/data/xma-reinit.png
+fate-xma-sw-graph-threads-reinit: CMD = framecrc -graph_threads -f png_pipe -framerate 25 -i $(TARGET_PATH)/tests/data/xma-reinit.png -filter_complex "sws_flags=+accurate_rnd+bitexact;format=yuv420p,scale_xma=ladder=160x120|128x96@yuv444p/2[a][b]" -map "[a]" -map "[b]"
+
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-mux-queue
+fate-xma-sw-mux-queue: CMD = framecrc -f lavfi -i testsrc=s=1280x720:r=25:d=0.4 -filter_complex "sws_flags=+accurate_rnd+bitexact;format=yuv420p,scale_xma=ladder=640x360|512x288@yuv444p/2|320x180@yuv420p16le/3[a][b][c]" -map "[a]" -map "[b]" -map "[c]" -mux_queue_size 1
+fate-xma-sw-mux-queue: REF = $(SRC_PATH)/tests/ref/fate/xma-sw-ladder
+
+# the encoders return their whole lookahead of large packets at once when
+# flushed, more than the thread writing the first output can take
+FATE_XMA-$(call ALLYES, XMA_SW NGC_HEVC_ENCODER FORMAT_FILTER SPLIT_FILTER TESTSRC_FILTER LAVFI_INDEV FRAMEMD5_MUXER) += fate-xma-sw-mux-queue-drop
+fate-xma-sw-mux-queue-drop: CMD = framecrc -f lavfi -i testsrc=s=352x288:r=25:d=1 -filter_complex "format=yuv420p,split[a][b]" -map "[a]" -c:v NGC265 -b:v 100M -mux_queue_size 1 -mux_queue_policy drop -f framemd5 -y $(TARGET_PATH)/tests/data/fate/xma-sw-mux-queue-drop.md5 -map "[b]" -c:v NGC265
+
+# the other output is not disturbed, ffmpeg fails once it is done
+FATE_XMA-$(call ALLYES, XMA_SW NGC_HEVC_ENCODER FORMAT_FILTER SPLIT_FILTER TESTSRC_FILTER LAVFI_INDEV FRAMEMD5_MUXER) += fate-xma-sw-mux-queue-disconnect
+fate-xma-sw-mux-queue-disconnect: CMD = framecrc -f lavfi -i testsrc=s=352x288:r=25:d=1 -filter_complex "format=yuv420p,split[a][b]" -map "[a]" -c:v NGC265 -b:v 100M -mux_queue_size 1 -mux_queue_policy disconnect -f framemd5 -y $(TARGET_PATH)/tests/data/fate/xma-sw-mux-queue-disconnect.md5 -map "[b]" -c:v NGC265; test $$? -eq 1
+fate-xma-sw-mux-queue-disconnect: REF = $(SRC_PATH)/tests/ref/fate/xma-sw-mux-queue-drop
+
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-jobs
+fate-xma-sw-jobs: tests/data/filtergraphs/xma-jobs
+fate-xma-sw-jobs: CMD = framecrc -jobs $(TARGET_PATH)/tests/data/filtergraphs/xma-jobs -graph_threads
+
+# the output of the second job matches it run alone, ffmpeg still fails
+FATE_XMA-$(call ALLYES, XMA_SW SCALE_XMA_FILTER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV H263_ENCODER) += fate-xma-sw-jobs-isolate
+fate-xma-sw-jobs-isolate: tests/data/filtergraphs/xma-jobs-isolate tests/data/filtergraphs/xma-jobs-script
+fate-xma-sw-jobs-isolate: CMD = framecrc -jobs $(TARGET_PATH)/tests/data/filtergraphs/xma-jobs-isolate; test $$? -eq 1
+
+FATE_XMA-$(call ALLYES, XMA_SW NGC_HEVC_ENCODER HWUPLOAD_FILTER FORMAT_FILTER SPLIT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-fanout
+fate-xma-sw-fanout: CMD = framecrc -xma_device 0 -f lavfi -i testsrc=s=352x288:r=25:d=0.4 -filter_complex "format=yuv420p,hwupload,split[a][b]" -map "[a]" -map "[b]" -c:v NGC265 -b:v:0 200k -b:v:1 400k
+
+FATE_XMA-$(call ALLYES, XMA_SW NGC_HEVC_ENCODER HWUPLOAD_FILTER FORMAT_FILTER SPLIT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-enc-threads
+fate-xma-sw-enc-threads: CMD = framecrc -enc_threads -xma_device 0 -f lavfi -i testsrc=s=352x288:r=25:d=0.4 -filter_complex "format=yuv420p,hwupload,split[a][b]" -map "[a]" -map "[b]" -c:v NGC265 -b:v:0 200k -b:v:1 400k
+fate-xma-sw-enc-threads: REF = $(SRC_PATH)/tests/ref/fate/xma-sw-fanout
+
+# a single queued frame, the main thread waits for the encoders on every frame
+FATE_XMA-$(call ALLYES, XMA_SW NGC_HEVC_ENCODER HWUPLOAD_FILTER FORMAT_FILTER SPLIT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-enc-threads-backpressure
+fate-xma-sw-enc-threads-backpressure: CMD = framecrc -enc_threads -enc_queue_size 1 -xma_device 0 -f lavfi -i testsrc=s=352x288:r=25:d=2 -filter_complex "format=yuv420p,hwupload,split[a][b]" -map "[a]" -map "[b]" -c:v NGC265 -b:v:0 200k -b:v:1 400k
+
+FATE_XMA-$(call ALLYES, XMA_SW NGC_HEVC_ENCODER FORMAT_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-force-idr
+fate-xma-sw-force-idr: CMD = framecrc -f lavfi -i testsrc=s=352x288:r=25:d=0.4 -filter_complex "sws_flags=+accurate_rnd+bitexact;format=yuv420p" -c:v NGC265 -g 100 -force_key_frames 0.2
+
+FATE_XMA-$(call ALLYES, XMA_SW NGC_HEVC_ENCODER FORMAT_FILTER SETPTS_FILTER TESTSRC_FILTER LAVFI_INDEV) += fate-xma-sw-bframes
+fate-xma-sw-bframes: CMD = framecrc -f lavfi -i testsrc=s=352x288:r=25:d=0.6 -vf "format=yuv420p,setpts=3*N" -vsync passthrough -c:v NGC265 -bf 2 -g 100
+
+# decoded on the card, the output matches the native decoder once the extra
+# delay of the kernel is taken out of the timestamps
+FATE_XMA_SAMPLES-$(call ALLYES, XMA_SW H264_XMA_HWACCEL H264_DEMUXER H264_PARSER SETPTS_FILTER) += fate-xma-sw-h264-hwaccel
+fate-xma-sw-h264-hwaccel: CMD = framecrc -threads 1 -hwaccel xma -i $(TARGET_SAMPLES)/h264-conformance/CABA3_TOSHIBA_E.264 -vf "setpts=N/FRAME_RATE/TB"
+fate-xma-sw-h264-hwaccel: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-caba3_toshiba_e
+
+FATE_FFMPEG += $(FATE_XMA-yes)
+FATE_SAMPLES_FFMPEG += $(FATE_XMA_SAMPLES-yes)
+fate-xma: $(FATE_XMA-yes)